@@ -0,0 +1,152 @@
+#ifndef TRACEROUTE_BENCH_BUILDER_H_
+#define TRACEROUTE_BENCH_BUILDER_H_
+
+// Packet builders shared by the benchmarks: the replies of emulated routers
+// and hosts, in network byte order.
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace bench {
+
+constexpr size_t kIpHeaderSize = 20, kQuoteSize = kIpHeaderSize + 8;
+
+inline uint32_t ChecksumAdd(const uint8_t *data, size_t size,
+                            uint32_t sum = 0) {
+  for (size_t i = 0; i + 1 < size; i += 2)
+    sum += static_cast<uint32_t>(data[i] << 8 | data[i + 1]);
+  if (size % 2 == 1) sum += static_cast<uint32_t>(data[size - 1] << 8);
+  return sum;
+}
+
+inline uint16_t ChecksumFold(uint32_t sum) {
+  while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<uint16_t>(~sum);
+}
+
+inline void Store16(uint8_t *data, uint16_t value) {
+  data[0] = static_cast<uint8_t>(value >> 8);
+  data[1] = static_cast<uint8_t>(value);
+}
+
+inline void Store32(uint8_t *data, uint32_t value) {
+  Store16(data, static_cast<uint16_t>(value >> 16));
+  Store16(data + 2, static_cast<uint16_t>(value));
+}
+
+inline uint16_t Load16(const uint8_t *data) {
+  return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+inline uint32_t Load32(const uint8_t *data) {
+  return static_cast<uint32_t>(Load16(data)) << 16 | Load16(data + 2);
+}
+
+/// Build an IPv4 packet from `source` to `destination` around `payload`,
+/// with a header padded by `options` bytes of no-op options.
+inline std::vector<uint8_t> BuildIp(uint32_t source, uint32_t destination,
+                                    uint8_t protocol,
+                                    const std::vector<uint8_t> &payload,
+                                    size_t options = 0) {
+  constexpr uint8_t kNoOperation = 1;
+  size_t header_size = kIpHeaderSize + options;
+  std::vector<uint8_t> packet(header_size + payload.size(), kNoOperation);
+  packet[0] = static_cast<uint8_t>(0x40 | header_size / 4);
+  packet[1] = 0;
+  Store16(&packet[2], static_cast<uint16_t>(packet.size()));
+  Store32(&packet[4], 0);
+  packet[8] = 64;
+  packet[9] = protocol;
+  Store16(&packet[10], 0);
+  Store32(&packet[12], source);
+  Store32(&packet[16], destination);
+  Store16(&packet[10], ChecksumFold(ChecksumAdd(packet.data(), header_size)));
+  std::copy(payload.begin(), payload.end(), packet.begin() + header_size);
+  return packet;
+}
+
+/// An ICMP error from `source` quoting `probe`, followed by an MPLS label
+/// stack extension (RFC 4884, RFC 4950) if `mpls_label` is not 0.
+inline std::vector<uint8_t> BuildIcmpError(uint32_t source, uint8_t type,
+                                           uint8_t code,
+                                           const std::vector<uint8_t> &probe,
+                                           size_t options = 0,
+                                           uint32_t mpls_label = 0) {
+  // With extensions, the quote is padded to 128 bytes.
+  constexpr size_t kCompatibleSize = 128, kExtensionSize = 4 + 4 + 4;
+  size_t quoted = std::min(probe.size(), kQuoteSize);
+  size_t quote_size = mpls_label ? kCompatibleSize : quoted;
+  std::vector<uint8_t> icmp(8 + quote_size + (mpls_label ? kExtensionSize : 0));
+  icmp[0] = type;
+  icmp[1] = code;
+  std::copy_n(probe.begin(), quoted, icmp.begin() + 8);
+  if (mpls_label) {
+    icmp[5] = static_cast<uint8_t>(quote_size / 4);
+    uint8_t *extension = &icmp[8 + quote_size];
+    extension[0] = 2 << 4;
+    Store16(&extension[4], 8);
+    extension[6] = 1;  // MPLS label stack
+    extension[7] = 1;  // Incoming
+    Store32(&extension[8], mpls_label << 12 | 1 << 8 | 1);
+    Store16(&extension[2],
+            ChecksumFold(ChecksumAdd(extension, kExtensionSize)));
+  }
+  Store16(&icmp[2], ChecksumFold(ChecksumAdd(icmp.data(), icmp.size())));
+  return BuildIp(source, Load32(&probe[12]), IPPROTO_ICMP, icmp, options);
+}
+
+/// How the probed host answers `probe`, if at all, with `options` bytes of
+/// IP options.
+inline std::optional<std::vector<uint8_t>> BuildHostReply(
+    const std::vector<uint8_t> &probe, size_t options) {
+  constexpr uint8_t kEchoRequest = 8, kDestinationUnreachable = 3,
+                    kPortUnreachable = 3;
+  constexpr uint8_t kSyn = 0x02, kRst = 0x04, kAck = 0x10;
+  uint32_t source = Load32(&probe[12]), target = Load32(&probe[16]);
+  const uint8_t *payload = probe.data() + kIpHeaderSize;
+  size_t size = probe.size() - kIpHeaderSize;
+  switch (probe[9]) {
+    case IPPROTO_ICMP: {
+      if (size < 8 || payload[0] != kEchoRequest) return std::nullopt;
+      std::vector<uint8_t> reply(payload, payload + size);
+      reply[0] = 0;
+      Store16(&reply[2], 0);
+      Store16(&reply[2], ChecksumFold(ChecksumAdd(reply.data(), reply.size())));
+      return BuildIp(target, source, IPPROTO_ICMP, reply, options);
+    }
+    case IPPROTO_UDP:
+      return BuildIcmpError(target, kDestinationUnreachable, kPortUnreachable,
+                            probe, options);
+    case IPPROTO_TCP: {
+      if (size < 20 || !(payload[13] & kSyn)) return std::nullopt;
+      // A closed port: RST, acknowledging the SYN.
+      std::vector<uint8_t> reply(20);
+      std::copy_n(payload + 2, 2, reply.begin());
+      std::copy_n(payload, 2, reply.begin() + 2);
+      Store32(&reply[8], Load32(payload + 4) + 1);
+      reply[12] = 5 << 4;
+      reply[13] = kRst | kAck;
+      std::array<uint8_t, 12> pseudo{};
+      Store32(&pseudo[0], target);
+      Store32(&pseudo[4], source);
+      pseudo[9] = IPPROTO_TCP;
+      Store16(&pseudo[10], static_cast<uint16_t>(reply.size()));
+      uint32_t sum = ChecksumAdd(pseudo.data(), pseudo.size());
+      Store16(&reply[16],
+              ChecksumFold(ChecksumAdd(reply.data(), reply.size(), sum)));
+      return BuildIp(target, source, IPPROTO_TCP, reply, options);
+    }
+    default:
+      return std::nullopt;
+  }
+}
+
+}  // namespace bench
+
+#endif  // TRACEROUTE_BENCH_BUILDER_H_
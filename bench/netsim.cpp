@@ -0,0 +1,485 @@
+// A simulated network for benchmarking traceroute without any outside
+// network. A TUN device stands in for the uplink, and every packet routed
+// into it is answered by an emulated chain of routers: each hop adds a fixed
+// delay, may drop probes, rate-limits its ICMP errors, or stays silent; the
+// targets behind the last hop answer like real hosts would. The harness runs
+// `traceroute` against the targets in each mode and reports its throughput,
+// CPU time and RTT error. With -p, each run is recorded and then replayed
+// with no network at all, which must print the same, to time the parsing
+// and matching of replies on their own.
+//
+// Needs CAP_NET_ADMIN (for the TUN device) and whatever traceroute needs.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "builder.h"
+
+namespace {
+
+using bench::BuildHostReply;
+using bench::BuildIcmpError;
+using bench::ChecksumAdd;
+using bench::ChecksumFold;
+using bench::kIpHeaderSize;
+using bench::Load32;
+using bench::Store16;
+
+using ClockType = std::chrono::steady_clock;
+using TimePoint = ClockType::time_point;
+
+constexpr const char *kDeviceName = "trsim0";
+// Our address; the /16 around it is routed into the device. Targets are
+// numbered from 10.99.1.1, routers live in 10.99.255.0/24.
+constexpr uint32_t kLocalAddress = 0x0a630001;
+constexpr uint32_t kFirstTarget = 0x0a630101;
+constexpr uint32_t kRouterBase = 0x0a63ff00;
+constexpr int kMaxHops = 250;
+constexpr int kQueueLength = 1 << 16;
+constexpr size_t kOptionsSize = 8;
+
+struct Config {
+  int hops = 8;
+  double delay_ms = 1.0;  // One way, per link
+  double loss = 0.0;      // Per link, forward path only
+  double icmp_rate = 0;   // Errors per second per router; 0 means unlimited
+  double icmp_burst = 10;
+  bool ip_options = false;  // Pad the IP header of replies with options
+  uint32_t mpls_label = 0;  // Label of hop 1 (RFC 4950), if not 0
+  std::vector<int> silent_hops;
+  int targets = 100;
+  uint32_t seed = 1;
+  std::string traceroute = "./traceroute";
+  std::vector<std::string> modes = {"-I", "", "-T"};
+  // Every mode is run once with each of these options added, for a side by
+  // side comparison; "" is the baseline.
+  std::vector<std::string> variants = {""};
+  bool replay = false;
+  std::vector<std::string> extra_args;
+};
+
+[[noreturn]] void PrintUsage() {
+  std::cerr << "Usage:\n";
+  std::cerr << "  netsim [ -h hops ] [ -d delay_ms ] [ -l loss ] [ -r "
+               "icmp_rate ] [ -b icmp_burst ] [ -s silent_hop,... ] [ -o ] [ "
+               "-M mpls_label ] [ -t targets ] [ -S seed ] [ -x traceroute ] "
+               "[ -c option ]... [ -p ] [ -- args ]\n";
+  exit(1);
+}
+
+[[noreturn]] void PrintError(const char *s = nullptr) {
+  perror(s);
+  exit(1);
+}
+
+Config ParseArg(int argc, char *argv[]) {
+  Config config{};
+  try {
+    for (int opt = getopt(argc, argv, "h:d:l:r:b:s:oM:t:S:x:c:p"); opt != -1;
+         opt = getopt(argc, argv, "h:d:l:r:b:s:oM:t:S:x:c:p")) {
+      if (opt == 'h') config.hops = std::stoi(optarg);
+      if (opt == 'd') config.delay_ms = std::stod(optarg);
+      if (opt == 'l') config.loss = std::stod(optarg);
+      if (opt == 'r') config.icmp_rate = std::stod(optarg);
+      if (opt == 'b') config.icmp_burst = std::stod(optarg);
+      if (opt == 't') config.targets = std::stoi(optarg);
+      if (opt == 'S') config.seed = static_cast<uint32_t>(std::stoul(optarg));
+      if (opt == 'x') config.traceroute = optarg;
+      if (opt == 'c') config.variants.emplace_back(optarg);
+      if (opt == 'o') config.ip_options = true;
+      if (opt == 'p') config.replay = true;
+      if (opt == 'M')
+        config.mpls_label = static_cast<uint32_t>(std::stoul(optarg));
+      if (opt == 's') {
+        std::istringstream list(optarg);
+        for (std::string hop; std::getline(list, hop, ',');)
+          config.silent_hops.push_back(std::stoi(hop));
+      }
+      if (opt == '?') PrintUsage();
+    }
+  } catch (...) {
+    PrintUsage();
+  }
+  for (int i = optind; i < argc; ++i) config.extra_args.emplace_back(argv[i]);
+  if (config.hops < 1 || config.hops > kMaxHops || config.delay_ms < 0 ||
+      config.loss < 0 || config.loss >= 1 || config.icmp_rate < 0 ||
+      config.icmp_burst < 1 || config.targets < 1 ||
+      config.targets > 250 * 250)
+    PrintUsage();
+  return config;
+}
+
+/// The emulated network behind the TUN device, answering on its own thread.
+class Network {
+  struct Pending {
+    TimePoint due;
+    std::vector<uint8_t> packet;
+    bool operator>(const Pending &other) const { return due > other.due; }
+  };
+
+  struct Router {
+    bool silent = false;
+    double tokens = 0;
+    TimePoint refilled{};
+  };
+
+  const Config &config_;
+  int tun_fd_ = -1;
+  std::vector<Router> routers_;
+  std::mt19937 random_;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<>> pending_;
+  std::atomic<bool> stop_{false};
+  std::atomic<uint64_t> probes_{0};
+  std::thread thread_;
+
+  /// Whether router `hop` may send an ICMP error now.
+  bool TakeToken(int hop, TimePoint now) {
+    auto &router = routers_[hop];
+    if (router.silent) return false;
+    if (config_.icmp_rate == 0) return true;
+    std::chrono::duration<double> elapsed = now - router.refilled;
+    router.tokens =
+        std::min(config_.icmp_burst,
+                 router.tokens + elapsed.count() * config_.icmp_rate);
+    router.refilled = now;
+    if (router.tokens < 1) return false;
+    router.tokens -= 1;
+    return true;
+  }
+
+  void Handle(std::vector<uint8_t> probe, TimePoint now) {
+    constexpr uint8_t kTimeExceeded = 11;
+    if (probe.size() < kIpHeaderSize || probe[0] != 0x45) return;
+    if (Load32(&probe[12]) != kLocalAddress) return;
+    probes_++;
+    int ttl = probe[8];
+    // The target is one link past the last router.
+    int distance = std::min(ttl, config_.hops + 1);
+    std::bernoulli_distribution lost(config_.loss);
+    for (int link = 0; link < distance; ++link) {
+      if (lost(random_)) return;
+    }
+    std::optional<std::vector<uint8_t>> reply;
+    if (ttl <= config_.hops) {
+      if (!TakeToken(ttl, now)) return;
+      // The quoted header is the one the router saw.
+      probe[8] = 1;
+      Store16(&probe[10], 0);
+      Store16(&probe[10],
+              ChecksumFold(ChecksumAdd(probe.data(), kIpHeaderSize)));
+      uint32_t label = 0;
+      if (config_.mpls_label)
+        label = config_.mpls_label + static_cast<uint32_t>(ttl) - 1;
+      reply = BuildIcmpError(kRouterBase + static_cast<uint32_t>(ttl),
+                             kTimeExceeded, 0, probe,
+                             config_.ip_options ? kOptionsSize : 0, label);
+    } else {
+      reply = BuildHostReply(probe, config_.ip_options ? kOptionsSize : 0);
+    }
+    if (!reply) return;
+    auto delay = std::chrono::duration<double, std::milli>(
+        2 * distance * config_.delay_ms);
+    pending_.push(
+        {now + std::chrono::duration_cast<ClockType::duration>(delay),
+         std::move(*reply)});
+  }
+
+  void Run() {
+    std::vector<uint8_t> buffer(65536);
+    while (!stop_) {
+      auto now = ClockType::now();
+      while (!pending_.empty() && pending_.top().due <= now) {
+        const auto &packet = pending_.top().packet;
+        if (write(tun_fd_, packet.data(), packet.size()) < 0 &&
+            errno != EAGAIN)
+          PrintError("write");
+        pending_.pop();
+      }
+      struct timespec timeout {0, 10'000'000};
+      if (!pending_.empty()) {
+        auto wait = std::min<ClockType::duration>(
+            pending_.top().due - now, std::chrono::milliseconds(10));
+        timeout.tv_nsec = std::chrono::nanoseconds(wait).count();
+      }
+      struct pollfd fd {tun_fd_, POLLIN, 0};
+      if (ppoll(&fd, 1, &timeout, nullptr) < 0 && errno != EINTR)
+        PrintError("ppoll");
+      now = ClockType::now();
+      while (true) {
+        ssize_t size = read(tun_fd_, buffer.data(), buffer.size());
+        if (size < 0) {
+          if (errno == EAGAIN || errno == EINTR) break;
+          PrintError("read");
+        }
+        Handle({buffer.begin(), buffer.begin() + size}, now);
+      }
+    }
+  }
+
+ public:
+  explicit Network(const Config &config)
+      : config_(config), routers_(kMaxHops + 1), random_(config.seed) {
+    for (int hop : config.silent_hops) {
+      if (hop >= 1 && hop <= kMaxHops) routers_[hop].silent = true;
+    }
+    for (auto &router : routers_) router.tokens = config.icmp_burst;
+
+    tun_fd_ = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (tun_fd_ < 0) PrintError("open(/dev/net/tun)");
+    struct ifreq ifr {};
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, kDeviceName, IFNAMSIZ - 1);
+    if (ioctl(tun_fd_, TUNSETIFF, &ifr) < 0) PrintError("ioctl(TUNSETIFF)");
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) PrintError("socket");
+    auto set_address = [&](unsigned long request, uint32_t address) {
+      struct sockaddr_in addr {};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(address);
+      memcpy(&ifr.ifr_addr, &addr, sizeof(addr));
+      if (ioctl(fd, request, &ifr) < 0) PrintError("ioctl(address)");
+    };
+    set_address(SIOCSIFADDR, kLocalAddress);
+    set_address(SIOCSIFNETMASK, 0xffff0000);
+    // Probes are sent in windows far larger than the default queue.
+    ifr.ifr_qlen = kQueueLength;
+    if (ioctl(fd, SIOCSIFTXQLEN, &ifr) < 0) PrintError("ioctl(SIOCSIFTXQLEN)");
+    if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) PrintError("ioctl(SIOCGIFFLAGS)");
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) PrintError("ioctl(SIOCSIFFLAGS)");
+    close(fd);
+
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  Network(const Network &other) = delete;
+  Network(Network &&other) = delete;
+  Network &operator=(const Network &other) = delete;
+  Network &operator=(Network &&other) = delete;
+
+  ~Network() {
+    stop_ = true;
+    thread_.join();
+    // The device goes away with its descriptor.
+    close(tun_fd_);
+  }
+
+  /// The number of probes received so far.
+  [[nodiscard]] uint64_t Probes() const { return probes_; }
+};
+
+struct Result {
+  double wall_seconds = 0;
+  double cpu_seconds = 0;
+  uint64_t probes = 0;
+  // Measured minus emulated RTT, in microseconds.
+  std::vector<double> rtt_errors;
+  int status = 0;
+  std::string output;
+};
+
+/// Collect the RTT error of every result printed by traceroute.
+void ParseOutput(const std::string &output, const Config &config,
+                 Result &result) {
+  std::istringstream lines(output);
+  int hop = 0;
+  for (std::string line; std::getline(lines, line);) {
+    std::istringstream tokens(line);
+    std::string previous, token;
+    bool first = true;
+    while (tokens >> token) {
+      if (first && std::all_of(token.begin(), token.end(), ::isdigit))
+        hop = std::stoi(token);
+      first = false;
+      if (token == "ms" && hop > 0) {
+        double expected = 2 * std::min(hop, config.hops + 1) *
+                          config.delay_ms * 1000;
+        result.rtt_errors.push_back(std::stod(previous) * 1000 - expected);
+      }
+      previous = token;
+    }
+  }
+}
+
+/// Run traceroute in `mode`, with the option `variant` if any and then
+/// `options`, against `targets_file`.
+Result RunTraceroute(const Config &config, const std::string &mode,
+                     const std::string &variant,
+                     const std::vector<std::string> &options,
+                     const std::string &targets_file, Network &network) {
+  std::vector<std::string> args = {config.traceroute, "-n", "-m",
+                                   std::to_string(config.hops + 2)};
+  if (!mode.empty()) args.push_back(mode);
+  if (!variant.empty()) args.push_back(variant);
+  args.insert(args.end(), options.begin(), options.end());
+  args.insert(args.end(), config.extra_args.begin(), config.extra_args.end());
+  args.insert(args.end(), {"-F", targets_file});
+  std::vector<char *> argv;
+  for (auto &arg : args) argv.push_back(arg.data());
+  argv.push_back(nullptr);
+
+  std::array<int, 2> pipe_fds{};
+  if (pipe(pipe_fds.data()) < 0) PrintError("pipe");
+  uint64_t probes = network.Probes();
+  auto start = ClockType::now();
+  pid_t pid = fork();
+  if (pid < 0) PrintError("fork");
+  if (pid == 0) {
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    execv(argv[0], argv.data());
+    perror("execv");
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+  std::string output;
+  std::array<char, 4096> buffer{};
+  for (ssize_t size;
+       (size = read(pipe_fds[0], buffer.data(), buffer.size()));) {
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      PrintError("read");
+    }
+    output.append(buffer.data(), static_cast<size_t>(size));
+  }
+  close(pipe_fds[0]);
+  struct rusage usage {};
+  Result result;
+  if (wait4(pid, &result.status, 0, &usage) < 0) PrintError("wait4");
+  result.wall_seconds =
+      std::chrono::duration<double>(ClockType::now() - start).count();
+  auto seconds = [](const struct timeval &time) {
+    return static_cast<double>(time.tv_sec) +
+           static_cast<double>(time.tv_usec) / 1e6;
+  };
+  result.cpu_seconds = seconds(usage.ru_utime) + seconds(usage.ru_stime);
+  result.probes = network.Probes() - probes;
+  ParseOutput(output, config, result);
+  result.output = std::move(output);
+  return result;
+}
+
+/// The lines of `output` in order, since traces that run side by side may
+/// finish in any.
+std::vector<std::string> SortedLines(const std::string &output) {
+  std::vector<std::string> lines;
+  std::istringstream stream(output);
+  for (std::string line; std::getline(stream, line);) lines.push_back(line);
+  std::sort(lines.begin(), lines.end());
+  return lines;
+}
+
+/// One row of the table: throughput, CPU time and RTT error of `result`.
+void PrintRow(const std::string &label, const Config &config,
+              const Result &result) {
+  double mean = 0, mean_abs = 0;
+  for (double error : result.rtt_errors) {
+    mean += error;
+    mean_abs += std::fabs(error);
+  }
+  if (!result.rtt_errors.empty()) {
+    mean /= static_cast<double>(result.rtt_errors.size());
+    mean_abs /= static_cast<double>(result.rtt_errors.size());
+  }
+  auto probes = static_cast<double>(result.probes);
+  std::cout << std::left << std::setw(16) << label << std::right
+            << std::fixed << std::setprecision(3) << std::setw(10)
+            << result.probes << std::setw(10) << result.wall_seconds
+            << std::setprecision(1) << std::setw(12)
+            << config.targets / result.wall_seconds << std::setw(12)
+            << probes / result.wall_seconds << std::setprecision(2)
+            << std::setw(14)
+            << (probes > 0 ? result.cpu_seconds * 1e6 / probes : 0)
+            << std::setw(14) << mean << std::setw(14) << mean_abs << "\n";
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  auto config = ParseArg(argc, argv);
+
+  std::string targets_file = "/tmp/netsim-targets-" + std::to_string(getpid());
+  std::string record_file = "/tmp/netsim-record-" + std::to_string(getpid());
+  {
+    std::ofstream targets(targets_file);
+    for (int i = 0; i < config.targets; ++i) {
+      struct in_addr addr {};
+      addr.s_addr = htonl(kFirstTarget + static_cast<uint32_t>(i / 250 * 256 +
+                                                              i % 250));
+      targets << inet_ntoa(addr) << "\n";
+    }
+  }
+
+  Network network(config);
+  std::cout << config.targets << " targets, " << config.hops
+            << " hops, " << config.delay_ms << " ms per link, loss "
+            << config.loss << "\n";
+  std::cout << std::left << std::setw(16) << "mode" << std::right
+            << std::setw(10) << "probes" << std::setw(10) << "wall s"
+            << std::setw(12) << "traces/s" << std::setw(12) << "probes/s"
+            << std::setw(14) << "CPU us/probe" << std::setw(14)
+            << "RTT err us" << std::setw(14) << "RTT |err| us" << "\n";
+  int status = 0;
+  for (const auto &mode : config.modes) {
+    for (const auto &variant : config.variants) {
+      std::string label = mode == "-I" ? "ICMP" : mode == "-T" ? "TCP" : "UDP";
+      if (!variant.empty()) label += " " + variant;
+      std::vector<std::string> options;
+      if (config.replay) options = {"-W", record_file};
+      auto result =
+          RunTraceroute(config, mode, variant, options, targets_file, network);
+      if (!WIFEXITED(result.status) || WEXITSTATUS(result.status) != 0) {
+        std::cerr << "netsim: traceroute " << mode << " " << variant
+                  << " failed\n";
+        status = 1;
+        continue;
+      }
+      PrintRow(label, config, result);
+      if (!config.replay) continue;
+      auto replayed = RunTraceroute(config, mode, variant,
+                                    {"-X", record_file}, targets_file,
+                                    network);
+      if (!WIFEXITED(replayed.status) || WEXITSTATUS(replayed.status) != 0 ||
+          SortedLines(replayed.output) != SortedLines(result.output)) {
+        std::cerr << "netsim: replay of traceroute " << mode << " "
+                  << variant << " differs\n";
+        status = 1;
+        continue;
+      }
+      // Nothing reaches the network: count the probes that were recorded.
+      replayed.probes = result.probes;
+      PrintRow(label + " replay", config, replayed);
+    }
+  }
+  unlink(record_file.c_str());
+  unlink(targets_file.c_str());
+  return status;
+}
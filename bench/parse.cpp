@@ -0,0 +1,510 @@
+// A microbenchmark of the receive path: how long it takes to parse a reply
+// and match it to a probe, per packet. Corpora are either synthesized (the
+// default) or read from pcap captures, e.g. taken with `tcpdump -w` on the
+// probing host or on netsim's device. With synthesized corpora, it also
+// times probes written in place, each with the match of a reply, and counts
+// the allocations they take, and then the same for whole traces, run by the
+// engine against a synthesized recording that it replays.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../packet.h"
+#include "../tracer.h"
+#include "builder.h"
+
+namespace {
+
+using ClockType = std::chrono::steady_clock;
+
+enum Mode { ICMP, TCP, UDP };
+
+// The parameters of the probes; those of traceroute for ICMP and UDP.
+constexpr uint16_t kIdentifier = 0x7122, kBasePort = 33435;
+constexpr uint16_t kTcpPort = 80;
+constexpr int kTagBits = 16;
+constexpr uint32_t kLocalAddress = 0x0a630001, kFirstTarget = 0x0a630101,
+                   kRouterBase = 0x0a63ff00;
+
+// Every allocation of the program, counted by `operator new` below.
+size_t allocations = 0;
+
+struct Config {
+  std::optional<Mode> mode;
+  uint16_t source_port = 40000;
+  uint32_t key = 0x5eed;
+  size_t packets = 1 << 14;
+  int rounds = 200;
+  std::vector<std::string> captures;
+};
+
+[[noreturn]] void PrintUsage() {
+  std::cerr << "Usage:\n";
+  std::cerr << "  parse [ -IUT ] [ -n packets ] [ -r rounds ]\n";
+  std::cerr << "  parse [ -IUT ] [ -s source_port ] [ -k key ] [ -r rounds ] "
+               "capture.pcap ...\n";
+  exit(1);
+}
+
+Config ParseArg(int argc, char *argv[]) {
+  Config config{};
+  try {
+    for (int opt = getopt(argc, argv, "IUTs:k:n:r:"); opt != -1;
+         opt = getopt(argc, argv, "IUTs:k:n:r:")) {
+      if (opt == 'I') config.mode = ICMP;
+      if (opt == 'U') config.mode = UDP;
+      if (opt == 'T') config.mode = TCP;
+      if (opt == 's')
+        config.source_port = static_cast<uint16_t>(std::stoul(optarg));
+      if (opt == 'k')
+        config.key = static_cast<uint32_t>(std::stoul(optarg, nullptr, 0));
+      if (opt == 'n') config.packets = std::stoul(optarg);
+      if (opt == 'r') config.rounds = std::stoi(optarg);
+      if (opt == '?') PrintUsage();
+    }
+  } catch (...) {
+    PrintUsage();
+  }
+  for (int i = optind; i < argc; ++i) config.captures.emplace_back(argv[i]);
+  if (config.packets == 0 || config.rounds < 1) PrintUsage();
+  return config;
+}
+
+using Corpus = std::vector<std::vector<uint8_t>>;
+
+/// A probe of `mode` to `target` carrying `tag`.
+std::vector<uint8_t> BuildProbe(const Config &config, Mode mode,
+                                uint32_t target, uint16_t tag) {
+  std::vector<uint8_t> payload;
+  uint8_t protocol = IPPROTO_ICMP;
+  switch (mode) {
+    case ICMP:
+      payload.resize(8);
+      payload[0] = traceroute::icmp::kEchoRequest;
+      bench::Store16(&payload[4], kIdentifier);
+      bench::Store16(&payload[6], tag);
+      break;
+    case UDP:
+      protocol = IPPROTO_UDP;
+      payload.resize(9);
+      bench::Store16(&payload[0], config.source_port);
+      bench::Store16(&payload[2], static_cast<uint16_t>(kBasePort + tag));
+      bench::Store16(&payload[4], static_cast<uint16_t>(payload.size()));
+      break;
+    case TCP:
+      protocol = IPPROTO_TCP;
+      payload.resize(24);
+      bench::Store16(&payload[0], config.source_port);
+      bench::Store16(&payload[2], kTcpPort);
+      bench::Store32(&payload[4], config.key << kTagBits | tag);
+      payload[12] = 6 << 4;
+      payload[13] = traceroute::tcp::kSyn;
+      break;
+  }
+  auto probe = bench::BuildIp(kLocalAddress, target, protocol, payload);
+  probe[8] = 1;
+  return probe;
+}
+
+/// Replies to probes of `mode`, as `kind` describes: "plain" time exceeded
+/// messages and answers from the destination, the same with IP "options" or
+/// "mpls" extensions, or "noise", half of which answers someone else.
+Corpus Synthesize(const Config &config, Mode mode, const std::string &kind) {
+  std::mt19937 random(1);
+  std::uniform_int_distribution<uint16_t> tags(16, 30 << 4);
+  std::uniform_int_distribution<uint32_t> targets(0, 249);
+  Corpus corpus;
+  for (size_t i = 0; i < config.packets; ++i) {
+    uint32_t target = kFirstTarget + targets(random);
+    uint16_t tag = tags(random);
+    bool foreign = kind == "noise" && i % 2 == 1;
+    Mode probe_mode = foreign ? static_cast<Mode>((mode + 1) % 3) : mode;
+    auto probe = BuildProbe(config, probe_mode, target, tag);
+    size_t options = kind == "options" ? 8 : 0;
+    if (i % 8 == 7) {
+      corpus.push_back(*bench::BuildHostReply(probe, options));
+    } else {
+      uint32_t label = kind == "mpls" ? 16000 + (tag >> 4) : 0;
+      corpus.push_back(bench::BuildIcmpError(kRouterBase + (tag >> 4),
+                                             traceroute::icmp::kTimeExceed, 0,
+                                             probe, options, label));
+    }
+  }
+  return corpus;
+}
+
+/// Read the IPv4 packets of a pcap capture with raw IP, Ethernet or Linux
+/// cooked headers, or nothing if the capture is damaged.
+std::optional<Corpus> ReadCapture(const std::string &path) {
+  constexpr uint32_t kMagic = 0xa1b2c3d4, kNanosecondMagic = 0xa1b23c4d;
+  constexpr uint32_t kEthernet = 1, kRaw = 101, kLinuxCooked = 113,
+                     kRawIPv4 = 228;
+  std::ifstream in(path, std::ios::binary);
+  std::array<uint8_t, 24> header{};
+  if (!in.read(reinterpret_cast<char *>(header.data()), header.size()))
+    return std::nullopt;
+  // The capturing host's byte order, like ours or swapped.
+  uint32_t magic = 0;
+  memcpy(&magic, header.data(), sizeof(magic));
+  bool swapped = magic != kMagic && magic != kNanosecondMagic;
+  auto u32 = [&](const uint8_t *data) {
+    uint32_t value = 0;
+    memcpy(&value, data, sizeof(value));
+    return swapped ? __builtin_bswap32(value) : value;
+  };
+  if (swapped && u32(header.data()) != kMagic &&
+      u32(header.data()) != kNanosecondMagic)
+    return std::nullopt;
+  uint32_t snap_length = u32(header.data() + 16);
+  uint32_t link_type = u32(header.data() + 20) & 0xffff;
+  size_t skip = 0;
+  if (link_type == kEthernet) {
+    skip = 14;
+  } else if (link_type == kLinuxCooked) {
+    skip = 16;
+  } else if (link_type != kRaw && link_type != kRawIPv4) {
+    return std::nullopt;
+  }
+
+  Corpus corpus;
+  std::array<uint8_t, 16> record{};
+  while (in.read(reinterpret_cast<char *>(record.data()), record.size())) {
+    uint32_t size = u32(record.data() + 8);
+    // No record outgrows the snapshot length or an IPv4 packet behind its
+    // link header; a longer one is a damaged capture.
+    if (size > snap_length || size > skip + UINT16_MAX) return std::nullopt;
+    std::vector<uint8_t> packet(size);
+    if (!in.read(reinterpret_cast<char *>(packet.data()), size)) break;
+    if (size <= skip || packet[skip] >> 4 != 4) continue;
+    corpus.emplace_back(packet.begin() + static_cast<std::ptrdiff_t>(skip),
+                        packet.end());
+  }
+  return corpus;
+}
+
+/// Parse and match one packet, the way the client of `kMode` does.
+template <Mode kMode>
+std::optional<uint16_t> ParseAndMatch(const Config &config,
+                                      const std::vector<uint8_t> &data) {
+  traceroute::PacketView packet(data.data(), data.size());
+  if (kMode == TCP && data.size() > 9 && data[9] == IPPROTO_TCP) {
+    return traceroute::MatchTCPReply(packet, config.source_port, kTcpPort,
+                                     config.key, kTagBits);
+  }
+  auto view = traceroute::ICMPView::Parse(packet);
+  if (!view) return std::nullopt;
+  if constexpr (kMode == ICMP) {
+    return traceroute::MatchEcho(*view, kIdentifier);
+  } else if constexpr (kMode == UDP) {
+    return traceroute::MatchUDP(*view, config.source_port, kBasePort);
+  } else {
+    return traceroute::MatchTCP(*view, config.source_port, kTcpPort,
+                                config.key, kTagBits);
+  }
+}
+
+/// Write the probe of `kMode` to `target` carrying `tag` to `out` in place,
+/// the way the client of `kMode` does, and return its size.
+template <Mode kMode>
+size_t WriteProbe(const Config &config, uint32_t target, uint16_t tag,
+                  uint8_t *out) {
+  in_addr source{htonl(kLocalAddress)}, destination{htonl(target)};
+  if constexpr (kMode == ICMP) {
+    traceroute::WriteEcho<kIdentifier>(out, tag, std::nullopt);
+    return traceroute::kEchoSize;
+  } else if constexpr (kMode == UDP) {
+    // As with -a paris; a classic probe only has a port to set.
+    traceroute::WriteParisPayload(out, source, destination,
+                                  config.source_port, kBasePort, tag);
+    return traceroute::kUDPPayloadSize;
+  } else {
+    traceroute::WriteSyn(out, source, destination, config.source_port,
+                         kTcpPort, config.key << kTagBits | tag);
+    return traceroute::kSynSize;
+  }
+}
+
+/// The best time per packet of `config.rounds` rounds of `per_packet` over
+/// `corpus`, and the number of packets it returned true for.
+template <typename Fn>
+std::pair<double, size_t> Time(const Config &config, const Corpus &corpus,
+                               Fn &&per_packet) {
+  size_t matched = 0;
+  double best = INFINITY;
+  // The best round is the one least disturbed by the rest of the system.
+  for (int round = 0; round < config.rounds; ++round) {
+    auto start = ClockType::now();
+    size_t round_matched = 0;
+    for (size_t i = 0; i < corpus.size(); ++i)
+      round_matched += per_packet(i) ? 1 : 0;
+    std::chrono::duration<double, std::nano> elapsed =
+        ClockType::now() - start;
+    best = std::min(best,
+                    elapsed.count() / static_cast<double>(corpus.size()));
+    matched = round_matched;
+  }
+  return {best, matched};
+}
+
+const char *ModeName(Mode mode) {
+  return mode == ICMP ? "ICMP" : mode == TCP ? "TCP" : "UDP";
+}
+
+template <Mode kMode>
+void Run(const Config &config, const std::string &name,
+         const Corpus &corpus) {
+  uint64_t checksum = 0;
+  auto [best, matched] = Time(config, corpus, [&](size_t i) {
+    auto tag = ParseAndMatch<kMode>(config, corpus[i]);
+    if (tag) checksum += *tag;
+    return tag.has_value();
+  });
+  // Keeps the loop from being optimized away.
+  asm volatile("" : : "r"(checksum));
+  std::cout << std::left << std::setw(6) << ModeName(kMode) << std::setw(24)
+            << name << std::right << std::setw(10) << corpus.size()
+            << std::setw(10) << matched << std::fixed << std::setprecision(1)
+            << std::setw(12) << best << "\n";
+}
+
+/// Write a probe and match a reply of `corpus` for each of its packets, as
+/// the engine does for every probe, with the allocations this takes.
+template <Mode kMode>
+void RunBuild(const Config &config, const Corpus &corpus) {
+  std::array<uint8_t, 64> probe{};
+  uint64_t checksum = 0;
+  size_t before = allocations;
+  auto [best, matched] = Time(config, corpus, [&](size_t i) {
+    auto tag = static_cast<uint16_t>(i);
+    size_t size = WriteProbe<kMode>(
+        config, kFirstTarget + static_cast<uint32_t>(i % 250), tag,
+        probe.data());
+    checksum += probe[size - 1];
+    auto reply = ParseAndMatch<kMode>(config, corpus[i]);
+    if (reply) checksum += *reply;
+    return reply.has_value();
+  });
+  size_t probes = corpus.size() * static_cast<size_t>(config.rounds);
+  asm volatile("" : : "r"(checksum));
+  std::cout << std::left << std::setw(6) << ModeName(kMode) << std::right
+            << std::setw(10) << corpus.size() << std::setw(10) << matched
+            << std::fixed << std::setprecision(1) << std::setw(12) << best
+            << std::setprecision(3) << std::setw(14)
+            << static_cast<double>(allocations - before) /
+                   static_cast<double>(probes)
+            << "\n";
+}
+
+// The traces the engine runs, to destinations this many hops away.
+constexpr size_t kEngineTargets = 1024;
+constexpr int kEngineHops = 16;
+
+/// Write a recording of ICMP traces to `targets` destinations, with
+/// `nqueries` probes per hop, as the engine records one, to `out`.
+void WriteRecording(const Config &config, size_t targets, int nqueries,
+                    std::ostream &out) {
+  auto put = [&](auto value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  // Nanosecond timestamps and LINKTYPE_LINUX_SLL.
+  put(uint32_t{0xa1b23c4d});
+  put(uint16_t{2});
+  put(uint16_t{4});
+  put(int32_t{0});
+  put(uint32_t{0});
+  put(uint32_t{65535});
+  put(uint32_t{113});
+  uint64_t time = 1'000'000'000;
+  auto write = [&](bool sent, const std::vector<uint8_t> &packet) {
+    constexpr uint16_t kIncoming = 0, kOutgoing = 4, kNoLinkLayer = 0xfffe;
+    std::array<uint8_t, 16> header{};
+    bench::Store16(&header[0], sent ? kOutgoing : kIncoming);
+    bench::Store16(&header[2], kNoLinkLayer);
+    bench::Store16(&header[14], 0x0800);
+    auto size = static_cast<uint32_t>(header.size() + packet.size());
+    put(static_cast<uint32_t>(time / 1'000'000'000));
+    put(static_cast<uint32_t>(time % 1'000'000'000));
+    put(size);
+    put(size);
+    out.write(reinterpret_cast<const char *>(header.data()), header.size());
+    out.write(reinterpret_cast<const char *>(packet.data()),
+              static_cast<std::streamsize>(packet.size()));
+    time += 1'000'000;
+  };
+  for (size_t i = 0; i < targets; ++i) {
+    auto target = kFirstTarget + static_cast<uint32_t>(i);
+    for (int hop = 1; hop <= kEngineHops; ++hop) {
+      for (int query = 0; query < nqueries; ++query) {
+        auto tag = static_cast<uint16_t>(hop << 8 | query);
+        auto probe = BuildProbe(config, ICMP, target, tag);
+        probe[8] = static_cast<uint8_t>(hop);
+        write(true, probe);
+        if (hop < kEngineHops) {
+          write(false, bench::BuildIcmpError(
+                           kRouterBase + static_cast<uint32_t>(hop),
+                           traceroute::icmp::kTimeExceed, 0, probe));
+        } else {
+          write(false, *bench::BuildHostReply(probe, 0));
+        }
+      }
+    }
+  }
+}
+
+/// Run the traces of `WriteRecording` with `nqueries` probes per hop in the
+/// engine, replaying the recording, once one trace has warmed it up, with
+/// the allocations this takes per trace. As only the number of probes
+/// varies with `nqueries`, allocations that do not are those of the traces,
+/// and none are of their probes.
+void RunEngine(const Config &config, int nqueries) {
+  std::string path = "/tmp/parse-XXXXXX";
+  int fd = mkstemp(path.data());
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+  close(fd);
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    WriteRecording(config, kEngineTargets + 1, nqueries, out);
+  }
+  traceroute::Options options;
+  options.mode = traceroute::ICMP;
+  options.nqueries = nqueries;
+  options.max_ttl = kEngineHops;
+  options.resolve = false;
+  options.replay_file = path;
+  auto created = traceroute::Engine::Create(options);
+  unlink(path.c_str());
+  if (!created) {
+    std::cerr << "parse: " << created.GetError().Message() << "\n";
+    exit(1);
+  }
+  auto &engine = **created;
+  // What traces print is dropped, as the callbacks of an embedder would.
+  auto add = [&](size_t i) {
+    traceroute::Target target;
+    target.addr.sin_family = AF_INET;
+    target.addr.sin_addr.s_addr =
+        htonl(kFirstTarget + static_cast<uint32_t>(i));
+    engine.Add(std::move(target), {[](std::string_view) {}, nullptr});
+  };
+  auto run = [&] {
+    while (engine.Active() > 0) {
+      if (auto error = engine.Process(-1)) {
+        std::cerr << "parse: " << error->Message() << "\n";
+        exit(1);
+      }
+    }
+  };
+  add(0);
+  run();
+  uint64_t warm = engine.Stats().matched;
+  size_t before = allocations;
+  auto start = ClockType::now();
+  for (size_t i = 1; i <= kEngineTargets; ++i) add(i);
+  run();
+  std::chrono::duration<double, std::nano> elapsed = ClockType::now() - start;
+  size_t allocated = allocations - before;
+  size_t probes = kEngineTargets * kEngineHops * static_cast<size_t>(nqueries);
+  std::cout << std::left << std::setw(6) << ModeName(ICMP) << std::right
+            << std::setw(10) << nqueries << std::setw(10) << probes
+            << std::setw(10) << engine.Stats().matched - warm << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << elapsed.count() / static_cast<double>(probes)
+            << std::setprecision(3) << std::setw(14)
+            << static_cast<double>(allocated) /
+                   static_cast<double>(kEngineTargets)
+            << "\n";
+  if (auto error = engine.Close()) {
+    std::cerr << "parse: " << error->Message() << "\n";
+    exit(1);
+  }
+}
+
+/// Call `fn` with the mode of `mode` as a template argument, so that the
+/// packets of a run see no switch on it.
+template <typename Fn>
+void Dispatch(Mode mode, Fn &&fn) {
+  switch (mode) {
+    case ICMP:
+      return fn(std::integral_constant<Mode, ICMP>{});
+    case UDP:
+      return fn(std::integral_constant<Mode, UDP>{});
+    case TCP:
+      return fn(std::integral_constant<Mode, TCP>{});
+  }
+}
+
+}  // namespace
+
+// None of these is inlined, lest the compiler pair `malloc` with `delete`.
+[[gnu::noinline]] void *operator new(size_t size) {
+  allocations++;
+  if (void *data = malloc(size)) return data;
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *data) noexcept { free(data); }
+[[gnu::noinline]] void operator delete(void *data, size_t /*size*/) noexcept {
+  free(data);
+}
+
+int main(int argc, char *argv[]) {
+  auto config = ParseArg(argc, argv);
+  std::cout << std::left << std::setw(6) << "mode" << std::setw(24)
+            << "corpus" << std::right << std::setw(10) << "packets"
+            << std::setw(10) << "matched" << std::setw(12) << "ns/packet"
+            << "\n";
+  if (!config.captures.empty()) {
+    Mode mode = config.mode.value_or(UDP);
+    for (const auto &path : config.captures) {
+      auto corpus = ReadCapture(path);
+      if (!corpus || corpus->empty()) {
+        std::cerr << "parse: cannot read IPv4 packets from " << path << "\n";
+        return 1;
+      }
+      Dispatch(mode, [&](auto kMode) { Run<kMode>(config, path, *corpus); });
+    }
+    return 0;
+  }
+  std::vector<Mode> modes = {ICMP, UDP, TCP};
+  if (config.mode) modes = {*config.mode};
+  for (Mode mode : modes) {
+    Dispatch(mode, [&](auto kMode) {
+      for (const char *kind : {"plain", "options", "mpls", "noise"})
+        Run<kMode>(config, kind, Synthesize(config, mode, kind));
+    });
+  }
+  std::cout << "\n"
+            << std::left << std::setw(6) << "mode" << std::right
+            << std::setw(10) << "probes" << std::setw(10) << "matched"
+            << std::setw(12) << "ns/probe" << std::setw(14) << "allocs/probe"
+            << "\n";
+  for (Mode mode : modes) {
+    auto corpus = Synthesize(config, mode, "plain");
+    Dispatch(mode, [&](auto kMode) { RunBuild<kMode>(config, corpus); });
+  }
+  if (config.mode && *config.mode != ICMP) return 0;
+  std::cout << "\n"
+            << std::left << std::setw(6) << "mode" << std::right
+            << std::setw(10) << "queries" << std::setw(10) << "probes"
+            << std::setw(10) << "matched" << std::setw(12) << "ns/probe"
+            << std::setw(14) << "allocs/trace" << "\n";
+  for (int nqueries : {1, 2, 3}) RunEngine(config, nqueries);
+}
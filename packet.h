@@ -0,0 +1,447 @@
+#ifndef TRACEROUTE_PACKET_H_
+#define TRACEROUTE_PACKET_H_
+
+// Views over received packets. They read fields in place, in network byte
+// order, from the buffer they were received into; nothing is copied. Every
+// header is located from the actual IHL of the IP header before it, and
+// checked to lie within the buffer before any of its fields is read.
+//
+// Probes are written in place too, into the buffer they are sent from. The
+// header fields that are the same for every probe of a mode are summed at
+// compile time, so that a checksum only adds the fields that are not.
+
+#include <netinet/in.h>
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace traceroute {
+
+namespace icmp {
+
+// type
+constexpr uint8_t kEchoReply = 0x0;
+constexpr uint8_t kDestinationUnreachable = 0x3;
+constexpr uint8_t kEchoRequest = 0x8;
+constexpr uint8_t kTimeExceed = 11;
+
+// code
+
+// Destination unreachable
+constexpr uint8_t kNetworkUnreachable = 0x0;
+constexpr uint8_t kHostUnreachable = 0x1;
+constexpr uint8_t kProtocolUnreachable = 0x2;
+constexpr uint8_t kPortUnreachable = 0x3;
+
+// Time exceeded
+constexpr uint8_t kTTLExpired = 0x0;
+constexpr uint8_t kFragmentReassemblyTimeExceeded = 0x1;
+
+}  // namespace icmp
+
+namespace tcp {
+
+// flags
+constexpr uint8_t kSyn = 0x02;
+constexpr uint8_t kRst = 0x04;
+constexpr uint8_t kAck = 0x10;
+
+// options
+constexpr uint8_t kMaxSegmentSize = 2;
+
+}  // namespace tcp
+
+/// A range of bytes. Reads must be within `Size()`, which the parsers below
+/// check once per header rather than on every access.
+class PacketView {
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+
+ public:
+  PacketView() = default;
+  PacketView(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  [[nodiscard]] const uint8_t *Data() const { return data_; }
+  [[nodiscard]] size_t Size() const { return size_; }
+
+  /// The bytes from `offset` on, or nothing if there are fewer than
+  /// `min_size` of them.
+  [[nodiscard]] std::optional<PacketView> From(size_t offset,
+                                               size_t min_size = 0) const {
+    if (offset > size_ || size_ - offset < min_size) return std::nullopt;
+    return PacketView(data_ + offset, size_ - offset);
+  }
+
+  /// The first `size` bytes, which must exist.
+  [[nodiscard]] PacketView Prefix(size_t size) const {
+    assert(size <= size_ && "Prefix out of bounds.");
+    return {data_, size};
+  }
+
+  [[nodiscard]] uint8_t U8(size_t offset) const {
+    assert(offset < size_ && "Read out of bounds.");
+    return data_[offset];
+  }
+
+  [[nodiscard]] uint16_t U16(size_t offset) const {
+    assert(offset + 2 <= size_ && "Read out of bounds.");
+    return static_cast<uint16_t>(data_[offset] << 8 | data_[offset + 1]);
+  }
+
+  [[nodiscard]] uint32_t U32(size_t offset) const {
+    return static_cast<uint32_t>(U16(offset)) << 16 | U16(offset + 2);
+  }
+
+  /// An IPv4 address, in network byte order like `in_addr` expects.
+  [[nodiscard]] struct in_addr Address(size_t offset) const {
+    assert(offset + 4 <= size_ && "Read out of bounds.");
+    struct in_addr addr {};
+    addr.s_addr = static_cast<in_addr_t>(data_[offset]) |
+                  static_cast<in_addr_t>(data_[offset + 1]) << 8 |
+                  static_cast<in_addr_t>(data_[offset + 2]) << 16 |
+                  static_cast<in_addr_t>(data_[offset + 3]) << 24;
+    return addr;
+  }
+};
+
+/// An IPv4 header, with options, and what follows it.
+class IPv4View {
+  static constexpr size_t kMinHeaderSize = 20;
+  static constexpr size_t kProtocolOffset = 9, kSourceOffset = 12,
+                          kDestinationOffset = 16;
+
+  PacketView packet_;
+  size_t header_size_ = 0;
+
+  IPv4View(PacketView packet, size_t header_size)
+      : packet_(packet), header_size_(header_size) {}
+
+ public:
+  /// Parse the header at the start of `packet`. What follows it may be
+  /// truncated, as in the quote of an ICMP error.
+  static std::optional<IPv4View> Parse(PacketView packet) {
+    if (packet.Size() < kMinHeaderSize || packet.U8(0) >> 4 != 4)
+      return std::nullopt;
+    size_t header_size = (packet.U8(0) & 0xfu) * 4;
+    if (header_size < kMinHeaderSize || header_size > packet.Size())
+      return std::nullopt;
+    return IPv4View(packet, header_size);
+  }
+
+  [[nodiscard]] size_t HeaderSize() const { return header_size_; }
+  [[nodiscard]] uint8_t Protocol() const {
+    return packet_.U8(kProtocolOffset);
+  }
+  [[nodiscard]] struct in_addr Source() const {
+    return packet_.Address(kSourceOffset);
+  }
+  [[nodiscard]] struct in_addr Destination() const {
+    return packet_.Address(kDestinationOffset);
+  }
+  [[nodiscard]] PacketView Payload() const {
+    return *packet_.From(header_size_);
+  }
+};
+
+/// The MPLS label stack entries (RFC 4950) reported by a router, as they
+/// appear on the wire: label (20 bits), traffic class (3), bottom of stack
+/// (1) and TTL (8).
+struct MPLSStack {
+  static constexpr size_t kMaxEntries = 4;
+
+  std::array<uint32_t, kMaxEntries> entries{};
+  uint8_t size = 0;
+
+  static uint32_t Label(uint32_t entry) { return entry >> 12; }
+  static uint8_t TrafficClass(uint32_t entry) { return (entry >> 9) & 0x7; }
+  static bool Bottom(uint32_t entry) { return (entry >> 8) & 0x1; }
+  static uint8_t Ttl(uint32_t entry) { return entry & 0xff; }
+};
+
+/// An ICMP message received on a raw socket, including the IP header.
+struct ICMPView {
+  static constexpr size_t kHeaderSize = 8;
+  // Of the quoted transport header, only this much is guaranteed (RFC 792).
+  static constexpr size_t kMinQuotedSize = 8;
+
+  IPv4View ip;
+  uint8_t type;
+  uint8_t code;
+  PacketView message;  // From the ICMP header on
+  // Errors only: the header of the offending packet, and the start of its
+  // transport header.
+  std::optional<IPv4View> quoted;
+  PacketView quoted_transport;
+  MPLSStack mpls;
+
+  [[nodiscard]] bool IsError() const {
+    return type == icmp::kTimeExceed || type == icmp::kDestinationUnreachable;
+  }
+  // Echo messages only
+  [[nodiscard]] uint16_t Identifier() const { return message.U16(4); }
+  [[nodiscard]] uint16_t SequenceNumber() const { return message.U16(6); }
+
+  /// Parse `packet`, starting with its IP header. Errors must quote at
+  /// least `kMinQuotedSize` bytes of the transport header.
+  static std::optional<ICMPView> Parse(PacketView packet) {
+    auto ip = IPv4View::Parse(packet);
+    if (!ip || ip->Protocol() != IPPROTO_ICMP) return std::nullopt;
+    auto message = ip->Payload();
+    if (message.Size() < kHeaderSize) return std::nullopt;
+    ICMPView view{*ip, message.U8(0), message.U8(1), message, {}, {}, {}};
+    if (!view.IsError()) return view;
+
+    auto original = *message.From(kHeaderSize);
+    // RFC 4884: the length of the original datagram, in 32-bit words, if
+    // extensions follow it.
+    size_t original_size = message.U8(5) * 4u;
+    if (original_size != 0 && original_size <= original.Size())
+      original = original.Prefix(original_size);
+    view.quoted = IPv4View::Parse(original);
+    if (!view.quoted) return std::nullopt;
+    auto transport = original.From(view.quoted->HeaderSize(), kMinQuotedSize);
+    if (!transport) return std::nullopt;
+    view.quoted_transport = *transport;
+    view.ParseExtensions(original_size);
+    return view;
+  }
+
+ private:
+  /// Read the MPLS label stack from the extension structure (RFC 4884),
+  /// which follows an original datagram of `original_size` bytes or, from
+  /// routers predating RFC 4884, one padded to 128 bytes.
+  void ParseExtensions(size_t original_size) {
+    constexpr size_t kCompatibleSize = 128, kExtensionHeaderSize = 4,
+                     kObjectHeaderSize = 4;
+    constexpr uint8_t kVersion = 2, kMPLSClass = 1, kMPLSIncomingStack = 1;
+    auto extensions = message.From(
+        kHeaderSize + (original_size != 0 ? original_size : kCompatibleSize),
+        kExtensionHeaderSize);
+    if (!extensions || extensions->U8(0) >> 4 != kVersion) return;
+    // A checksum of 0 means none was computed.
+    if (extensions->U16(2) != 0) {
+      uint32_t sum = 0;
+      for (size_t i = 0; i + 1 < extensions->Size(); i += 2)
+        sum += extensions->U16(i);
+      if (extensions->Size() % 2 == 1)
+        sum += static_cast<uint32_t>(extensions->U8(extensions->Size() - 1))
+               << 8;
+      while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+      if (sum != 0xffff) return;
+    }
+    for (auto object = extensions->From(kExtensionHeaderSize,
+                                        kObjectHeaderSize);
+         object; object = object->From(object->U16(0), kObjectHeaderSize)) {
+      size_t length = object->U16(0);
+      if (length < kObjectHeaderSize || length > object->Size()) return;
+      if (object->U8(2) != kMPLSClass || object->U8(3) != kMPLSIncomingStack)
+        continue;
+      for (size_t offset = kObjectHeaderSize;
+           offset + 4 <= length && mpls.size < MPLSStack::kMaxEntries;
+           offset += 4)
+        mpls.entries[mpls.size++] = object->U32(offset);
+    }
+  }
+};
+
+/// Recover the tag of an ICMP echo probe sent with `identifier` from an echo
+/// reply or an error quoting it.
+inline std::optional<uint16_t> MatchEcho(const ICMPView &view,
+                                         uint16_t identifier) {
+  if (view.IsError()) {
+    const auto &quoted = view.quoted_transport;
+    if (view.quoted->Protocol() != IPPROTO_ICMP ||
+        quoted.U8(0) != icmp::kEchoRequest || quoted.U16(4) != identifier)
+      return std::nullopt;
+    return quoted.U16(6);
+  }
+  if (view.type != icmp::kEchoReply || view.Identifier() != identifier)
+    return std::nullopt;
+  return view.SequenceNumber();
+}
+
+/// Recover the tag of a UDP probe, sent from `source_port` to `base_port`
+/// plus the tag, from an error quoting it.
+inline std::optional<uint16_t> MatchUDP(const ICMPView &view,
+                                        uint16_t source_port,
+                                        uint16_t base_port) {
+  if (!view.IsError() || view.quoted->Protocol() != IPPROTO_UDP)
+    return std::nullopt;
+  const auto &quoted = view.quoted_transport;
+  if (quoted.U16(0) != source_port || quoted.U16(2) < base_port)
+    return std::nullopt;
+  return static_cast<uint16_t>(quoted.U16(2) - base_port);
+}
+
+/// Recover the tag of a Paris UDP probe, sent from `source_port` to
+/// `base_port` plus one of `flows` flow numbers, with the tag as its
+/// checksum, from an error quoting it.
+inline std::optional<uint16_t> MatchParisUDP(const ICMPView &view,
+                                             uint16_t source_port,
+                                             uint16_t base_port,
+                                             uint16_t flows) {
+  if (!view.IsError() || view.quoted->Protocol() != IPPROTO_UDP)
+    return std::nullopt;
+  const auto &quoted = view.quoted_transport;
+  if (quoted.U16(0) != source_port || quoted.U16(2) < base_port ||
+      quoted.U16(2) - base_port >= flows)
+    return std::nullopt;
+  return quoted.U16(6);
+}
+
+/// Recover the tag of a TCP SYN probe, sent from `source_port` to `port`
+/// with `key` in the bits of the sequence number above the `tag_bits`-bit
+/// tag, from an error quoting it.
+inline std::optional<uint16_t> MatchTCP(const ICMPView &view,
+                                        uint16_t source_port, uint16_t port,
+                                        uint32_t key, int tag_bits) {
+  if (!view.IsError() || view.quoted->Protocol() != IPPROTO_TCP)
+    return std::nullopt;
+  const auto &quoted = view.quoted_transport;
+  uint32_t seq = quoted.U32(4);
+  if (quoted.U16(0) != source_port || quoted.U16(2) != port ||
+      seq >> tag_bits != key)
+    return std::nullopt;
+  return static_cast<uint16_t>(seq & ((1U << tag_bits) - 1));
+}
+
+/// Recover the tag of a TCP SYN probe, as in `MatchTCP`, from a SYN-ACK or
+/// RST acknowledging it. `packet` starts with the IP header.
+inline std::optional<uint16_t> MatchTCPReply(PacketView packet,
+                                             uint16_t source_port,
+                                             uint16_t port, uint32_t key,
+                                             int tag_bits) {
+  constexpr size_t kTCPHeaderSize = 20, kFlagsOffset = 13;
+  auto ip = IPv4View::Parse(packet);
+  if (!ip || ip->Protocol() != IPPROTO_TCP) return std::nullopt;
+  auto segment = ip->Payload();
+  if (segment.Size() < kTCPHeaderSize) return std::nullopt;
+  uint8_t flags = segment.U8(kFlagsOffset);
+  if (segment.U16(0) != port || segment.U16(2) != source_port ||
+      !(flags & tcp::kAck) || !(flags & (tcp::kSyn | tcp::kRst)))
+    return std::nullopt;
+  uint32_t seq = segment.U32(8) - 1;
+  if (seq >> tag_bits != key) return std::nullopt;
+  return static_cast<uint16_t>(seq & ((1U << tag_bits) - 1));
+}
+
+/// The one's complement sum of the 16-bit words `kWords`, not yet folded.
+template <uint16_t... kWords>
+constexpr uint32_t kWordSum = (0U + ... + kWords);
+
+/// The one's complement sum of `size` bytes at `data` added to `sum`, not
+/// yet folded.
+inline uint32_t ChecksumAdd(const void *data, size_t size, uint32_t sum = 0) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i + 1 < size; i += 2)
+    sum += static_cast<uint32_t>(bytes[i] << 8 | bytes[i + 1]);
+  if (size % 2 == 1) sum += static_cast<uint32_t>(bytes[size - 1] << 8);
+  return sum;
+}
+
+/// Fold a sum from `ChecksumAdd` into an Internet checksum (RFC 1071), in
+/// host byte order.
+constexpr uint16_t ChecksumFold(uint32_t sum) {
+  while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<uint16_t>(~sum);
+}
+
+/// The 16-bit word that, added to data with the checksum `from`, makes it
+/// `to`, both in host byte order.
+constexpr uint16_t ChecksumFiller(uint16_t from, uint16_t to) {
+  uint32_t sum = uint32_t{from} + static_cast<uint16_t>(~to);
+  while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<uint16_t>(sum);
+}
+
+/// Write `value` to `out` in network byte order.
+inline void Store16(uint8_t *out, uint16_t value) {
+  out[0] = static_cast<uint8_t>(value >> 8);
+  out[1] = static_cast<uint8_t>(value);
+}
+
+inline void Store32(uint8_t *out, uint32_t value) {
+  Store16(out, static_cast<uint16_t>(value >> 16));
+  Store16(out + 2, static_cast<uint16_t>(value));
+}
+
+// Type, code, checksum, identifier, sequence number and a payload.
+constexpr size_t kEchoSize = 10;
+
+/// Write an echo request with `kIdentifier` to `out`, with `tag` as its
+/// sequence number. Load balancers hash the checksum like the ports of
+/// other protocols, so in a `flow` the payload keeps it at `~flow` whatever
+/// the tag.
+template <uint16_t kIdentifier>
+void WriteEcho(uint8_t *out, uint16_t tag, std::optional<uint16_t> flow) {
+  constexpr uint32_t kSum = kWordSum<icmp::kEchoRequest << 8, kIdentifier>;
+  uint16_t payload = 0;
+  if (flow) {
+    payload = ChecksumFiller(ChecksumFold(kSum + tag),
+                             static_cast<uint16_t>(~*flow));
+  }
+  out[0] = icmp::kEchoRequest;
+  out[1] = 0;
+  Store16(out + 2, ChecksumFold(kSum + tag + payload));
+  Store16(out + 4, kIdentifier);
+  Store16(out + 6, tag);
+  Store16(out + 8, payload);
+}
+
+// A header and a maximum segment size option, as a real connection attempt
+// would have.
+constexpr size_t kSynSize = 24;
+constexpr uint16_t kSynWindow = 64240, kSynMaxSegmentSize = 1460;
+
+/// Write a SYN from `source_port` of `source` to `port` of `destination`,
+/// with the sequence number `seq`, to `out`.
+inline void WriteSyn(uint8_t *out, struct in_addr source,
+                     struct in_addr destination, uint16_t source_port,
+                     uint16_t port, uint32_t seq) {
+  // The protocol and length of the pseudo header, then the data offset and
+  // flags, the window and the option.
+  constexpr uint32_t kSum =
+      kWordSum<IPPROTO_TCP, kSynSize, kSynSize / 4 << 12 | tcp::kSyn,
+               kSynWindow, tcp::kMaxSegmentSize << 8 | 4, kSynMaxSegmentSize>;
+  uint32_t sum = ChecksumAdd(&source, sizeof(source), kSum);
+  sum = ChecksumAdd(&destination, sizeof(destination), sum);
+  sum += source_port + port + (seq >> 16) + (seq & 0xffff);
+  Store16(out, source_port);
+  Store16(out + 2, port);
+  Store32(out + 4, seq);
+  Store32(out + 8, 0);
+  out[12] = kSynSize / 4 << 4;
+  out[13] = tcp::kSyn;
+  Store16(out + 14, kSynWindow);
+  Store16(out + 16, ChecksumFold(sum));
+  Store16(out + 18, 0);
+  out[20] = tcp::kMaxSegmentSize;
+  out[21] = 4;
+  Store16(out + 22, kSynMaxSegmentSize);
+}
+
+// The payload of a UDP probe, after the header the kernel adds.
+constexpr size_t kUDPHeaderSize = 8, kUDPPayloadSize = 2;
+
+/// Write the payload of a UDP probe from `source_port` of `source` to `port`
+/// of `destination` to `out`, such that `tag` is its checksum.
+inline void WriteParisPayload(uint8_t *out, struct in_addr source,
+                              struct in_addr destination,
+                              uint16_t source_port, uint16_t port,
+                              uint16_t tag) {
+  constexpr uint16_t kLength = kUDPHeaderSize + kUDPPayloadSize;
+  // The protocol and length of the pseudo header, and the length of the
+  // UDP header.
+  constexpr uint32_t kSum = kWordSum<IPPROTO_UDP, kLength, kLength>;
+  uint32_t sum = ChecksumAdd(&source, sizeof(source), kSum);
+  sum = ChecksumAdd(&destination, sizeof(destination), sum);
+  sum += source_port + port;
+  Store16(out, ChecksumFiller(ChecksumFold(sum), tag));
+}
+
+}  // namespace traceroute
+
+#endif  // TRACEROUTE_PACKET_H_
@@ -0,0 +1,320 @@
+#ifndef TRACEROUTE_STORE_H_
+#define TRACEROUTE_STORE_H_
+
+// The trace store: an append-only file of probe results, one row per probe,
+// laid out in columns. A file is a header followed by blocks, each of which
+// decodes on its own. A block starts with its dictionaries of addresses and
+// names, which the columns refer to by index, and every column follows,
+// encoded as zigzag deltas or as runs, whichever takes fewer bytes. Readers
+// map the file and decode only the blocks and the columns a query needs;
+// the rows of a trace never span two blocks.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace traceroute::store {
+
+constexpr std::array<uint8_t, 8> kFileMagic = {'T', 'R', 'S', 'T',
+                                               'O', 'R', 'E', '1'};
+constexpr uint32_t kBlockMagic = 0x4b4c4254;  // "TBLK"
+// A block is closed at the end of the first trace that fills it this far.
+constexpr size_t kBlockRows = 4096;
+// Hence never longer than this, with a trace of fewer than 256 probes at
+// each of its 255 hops; the columns of longer blocks are corrupt.
+constexpr size_t kMaxBlockRows = kBlockRows + 255 * 255;
+
+enum Column : uint8_t {
+  TARGET,          // Address index of the destination
+  TARGET_NAME,     // Name index of the destination, as given
+  START,           // When the round of the trace started
+  TTL,
+  RESPONDER,       // Address index + 1, 0 if there was no reply
+  RESPONDER_NAME,  // Name index + 1, 0 if there is none or it was unknown
+  STATUS,          // As `kStatusNames` lists them
+  SENT,            // When the probe was sent
+  RTT,             // 0 if there was no reply
+};
+constexpr size_t kColumns = RTT + 1;
+constexpr std::array<const char *, kColumns> kColumnNames = {
+    "target", "target_name", "start", "ttl", "responder",
+    "responder_name", "status", "sent", "rtt"};
+// In the order of traceroute's `ICMPStatus`.
+constexpr std::array<const char *, 6> kStatusNames = {
+    "reached", "timeout", "expired", "!H", "!N", "!P"};
+
+enum Encoding : uint8_t { DELTAS, RUNS };
+
+/// One probe result. Addresses are in network byte order, and times in
+/// nanoseconds, since the Unix epoch for `start` and `sent`.
+struct Row {
+  uint32_t target;
+  std::string_view target_name;
+  uint64_t start;
+  uint8_t ttl;
+  std::optional<uint32_t> responder;
+  std::string_view responder_name;  // Empty if unknown
+  uint8_t status;
+  uint64_t sent;
+  uint64_t rtt;
+};
+
+inline void PutVarint(std::vector<uint8_t> &out, uint64_t value) {
+  for (; value >= 0x80; value >>= 7)
+    out.push_back(static_cast<uint8_t>(value | 0x80));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+/// Read a varint at `data`, advancing it, unless it runs past `end`.
+inline std::optional<uint64_t> GetVarint(const uint8_t *&data,
+                                         const uint8_t *end) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64 && data < end; shift += 7) {
+    uint8_t byte = *data++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  return std::nullopt;
+}
+
+inline void Put32(std::vector<uint8_t> &out, uint32_t value) {
+  for (int shift = 0; shift < 32; shift += 8)
+    out.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+inline uint32_t Get32(const uint8_t *data) {
+  return static_cast<uint32_t>(data[0]) |
+         static_cast<uint32_t>(data[1]) << 8 |
+         static_cast<uint32_t>(data[2]) << 16 |
+         static_cast<uint32_t>(data[3]) << 24;
+}
+
+/// The difference from `from` to `to`, signed, as a small unsigned number.
+inline uint64_t ZigzagDelta(uint64_t from, uint64_t to) {
+  auto delta = static_cast<int64_t>(to - from);
+  return static_cast<uint64_t>(delta) << 1 ^
+         static_cast<uint64_t>(delta >> 63);
+}
+
+inline uint64_t ApplyZigzag(uint64_t from, uint64_t zigzag) {
+  return from + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+}
+
+/// The rows of a block as they are collected, until `Encode()`.
+class BlockBuilder {
+  std::vector<uint32_t> addresses_;
+  std::vector<std::string> names_;
+  std::unordered_map<uint32_t, uint32_t> address_index_;
+  std::unordered_map<std::string, uint32_t> name_index_;
+  std::array<std::vector<uint64_t>, kColumns> columns_;
+
+  uint32_t AddressIndex(uint32_t address) {
+    auto [iter, inserted] = address_index_.try_emplace(
+        address, static_cast<uint32_t>(addresses_.size()));
+    if (inserted) addresses_.push_back(address);
+    return iter->second;
+  }
+
+  uint32_t NameIndex(std::string_view name) {
+    auto [iter, inserted] = name_index_.try_emplace(
+        std::string(name), static_cast<uint32_t>(names_.size()));
+    if (inserted) names_.emplace_back(name);
+    return iter->second;
+  }
+
+  /// Append `values` as zigzag deltas or as runs of (zigzag delta, length),
+  /// whichever is shorter, preceded by the encoding and the size.
+  static void EncodeColumn(const std::vector<uint64_t> &values,
+                           std::vector<uint8_t> &out) {
+    std::vector<uint8_t> deltas, runs;
+    uint64_t previous = 0, run_value = 0;
+    for (uint64_t value : values) {
+      PutVarint(deltas, ZigzagDelta(previous, value));
+      previous = value;
+    }
+    for (size_t i = 0; i < values.size();) {
+      size_t end = i;
+      while (end < values.size() && values[end] == values[i]) end++;
+      PutVarint(runs, ZigzagDelta(run_value, values[i]));
+      PutVarint(runs, end - i);
+      run_value = values[i];
+      i = end;
+    }
+    bool use_runs = runs.size() < deltas.size();
+    const auto &encoded = use_runs ? runs : deltas;
+    out.push_back(use_runs ? RUNS : DELTAS);
+    PutVarint(out, encoded.size());
+    out.insert(out.end(), encoded.begin(), encoded.end());
+  }
+
+ public:
+  [[nodiscard]] size_t Rows() const { return columns_[TARGET].size(); }
+
+  void Add(const Row &row) {
+    columns_[TARGET].push_back(AddressIndex(row.target));
+    columns_[TARGET_NAME].push_back(NameIndex(row.target_name));
+    columns_[START].push_back(row.start);
+    columns_[TTL].push_back(row.ttl);
+    columns_[RESPONDER].push_back(
+        row.responder ? AddressIndex(*row.responder) + 1 : 0);
+    columns_[RESPONDER_NAME].push_back(
+        row.responder_name.empty() ? 0 : NameIndex(row.responder_name) + 1);
+    columns_[STATUS].push_back(row.status);
+    columns_[SENT].push_back(row.sent);
+    columns_[RTT].push_back(row.rtt);
+  }
+
+  /// The block, with its header: the magic number, the number of rows, and
+  /// the size of what follows, little-endian.
+  [[nodiscard]] std::vector<uint8_t> Encode() const {
+    std::vector<uint8_t> body;
+    PutVarint(body, addresses_.size());
+    for (uint32_t address : addresses_) {
+      // Network byte order, as in memory.
+      const auto *bytes = reinterpret_cast<const uint8_t *>(&address);
+      body.insert(body.end(), bytes, bytes + sizeof(address));
+    }
+    PutVarint(body, names_.size());
+    for (const auto &name : names_) {
+      PutVarint(body, name.size());
+      body.insert(body.end(), name.begin(), name.end());
+    }
+    for (const auto &column : columns_) EncodeColumn(column, body);
+    std::vector<uint8_t> block;
+    Put32(block, kBlockMagic);
+    Put32(block, static_cast<uint32_t>(Rows()));
+    Put32(block, static_cast<uint32_t>(body.size()));
+    block.insert(block.end(), body.begin(), body.end());
+    return block;
+  }
+};
+
+/// A block read in place. Every size is checked against the data on
+/// parsing, so a file cut short by a crash ends at its last whole block,
+/// and every index against its dictionary on decoding.
+class BlockView {
+  static constexpr size_t kHeaderSize = 12;
+
+  struct ColumnData {
+    Encoding encoding;
+    const uint8_t *begin, *end;
+  };
+
+  uint32_t rows_ = 0;
+  size_t size_ = 0;
+  std::vector<uint32_t> addresses_;
+  std::vector<std::string_view> names_;
+  std::array<ColumnData, kColumns> columns_{};
+
+ public:
+  /// Parse the block at the start of `size` bytes at `data`.
+  static std::optional<BlockView> Parse(const uint8_t *data, size_t size) {
+    if (size < kHeaderSize || Get32(data) != kBlockMagic) return std::nullopt;
+    BlockView block;
+    block.rows_ = Get32(data + 4);
+    size_t body_size = Get32(data + 8);
+    if (body_size > size - kHeaderSize) return std::nullopt;
+    block.size_ = kHeaderSize + body_size;
+    const uint8_t *next = data + kHeaderSize, *end = data + block.size_;
+
+    auto addresses = GetVarint(next, end);
+    if (!addresses || *addresses > static_cast<size_t>(end - next) / 4)
+      return std::nullopt;
+    for (uint64_t i = 0; i < *addresses; ++i, next += 4) {
+      uint32_t address = 0;
+      std::copy(next, next + 4, reinterpret_cast<uint8_t *>(&address));
+      block.addresses_.push_back(address);
+    }
+    auto names = GetVarint(next, end);
+    if (!names || *names > static_cast<size_t>(end - next))
+      return std::nullopt;
+    for (uint64_t i = 0; i < *names; ++i) {
+      auto length = GetVarint(next, end);
+      if (!length || *length > static_cast<size_t>(end - next))
+        return std::nullopt;
+      block.names_.emplace_back(reinterpret_cast<const char *>(next),
+                                *length);
+      next += *length;
+    }
+    for (auto &column : block.columns_) {
+      if (next == end || *next > RUNS) return std::nullopt;
+      column.encoding = static_cast<Encoding>(*next++);
+      auto length = GetVarint(next, end);
+      if (!length || *length > static_cast<size_t>(end - next))
+        return std::nullopt;
+      column.begin = next;
+      column.end = next += *length;
+    }
+    return block;
+  }
+
+  [[nodiscard]] uint32_t Rows() const { return rows_; }
+  /// Of the block, header included; the next one starts there.
+  [[nodiscard]] size_t Size() const { return size_; }
+  [[nodiscard]] const std::vector<uint32_t> &Addresses() const {
+    return addresses_;
+  }
+  [[nodiscard]] const std::vector<std::string_view> &Names() const {
+    return names_;
+  }
+  [[nodiscard]] size_t EncodedSize(Column column) const {
+    return static_cast<size_t>(columns_[column].end - columns_[column].begin);
+  }
+
+  /// One past the largest value `column` may hold, if it is bounded.
+  [[nodiscard]] std::optional<uint64_t> Bound(Column column) const {
+    switch (column) {
+      case TARGET:
+        return addresses_.size();
+      case TARGET_NAME:
+        return names_.size();
+      case TTL:
+        return 256;
+      case RESPONDER:
+        return addresses_.size() + 1;
+      case RESPONDER_NAME:
+        return names_.size() + 1;
+      default:
+        return std::nullopt;
+    }
+  }
+
+  /// The values of `column`, one per row, or nothing if it is corrupt.
+  [[nodiscard]] std::optional<std::vector<uint64_t>> Decode(
+      Column column) const {
+    if (rows_ > kMaxBlockRows) return std::nullopt;
+    const auto &data = columns_[column];
+    const uint8_t *next = data.begin;
+    std::vector<uint64_t> values;
+    // Every delta takes a byte at least; runs take two, but may be long.
+    values.reserve(data.encoding == DELTAS
+                       ? std::min<size_t>(rows_, EncodedSize(column))
+                       : rows_);
+    auto bound = Bound(column);
+    uint64_t previous = 0;
+    while (values.size() < rows_) {
+      auto zigzag = GetVarint(next, data.end);
+      if (!zigzag) return std::nullopt;
+      previous = ApplyZigzag(previous, *zigzag);
+      if (bound && previous >= *bound) return std::nullopt;
+      if (data.encoding == DELTAS) {
+        values.push_back(previous);
+        continue;
+      }
+      auto length = GetVarint(next, data.end);
+      if (!length || *length > rows_ - values.size()) return std::nullopt;
+      values.insert(values.end(), *length, previous);
+    }
+    return values;
+  }
+};
+
+}  // namespace traceroute::store
+
+#endif  // TRACEROUTE_STORE_H_
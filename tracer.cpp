@@ -0,0 +1,4450 @@
+#include "tracer.h"
+
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/io_uring.h>
+#include <linux/net_tstamp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "packet.h"
+#include "store.h"
+
+namespace traceroute {
+
+namespace {
+
+constexpr uint8_t kIpHeaderLengthMask = 0xf;
+constexpr int kIcmpIdentifier = 0x7122;
+constexpr uint16_t kInitialPort = 33435;
+
+/// Thrown where a system call fails, and returned as is by the `Engine`.
+[[noreturn]] void Fail(std::string what) {
+  throw Error{std::move(what), errno};
+}
+
+// In increasing order of accuracy.
+enum TimestampSource : uint8_t { USERSPACE, SOFTWARE, HARDWARE };
+
+/// When a packet left or arrived. Kernel timestamps are converted to
+/// `ClockType`; hardware timestamps are kept as is, since they come from the
+/// clock of the NIC and can only be compared with each other.
+struct Timestamp {
+  TimePoint time{};
+  TimestampSource source = USERSPACE;  // Of `time`; never HARDWARE
+  std::optional<std::chrono::nanoseconds> hardware;
+
+  static Timestamp Now() { return {ClockType::now(), USERSPACE, {}}; }
+
+  /// The round-trip time from `send` to `recv` and the source it is based on,
+  /// or zero if a clock step put `recv` before `send`.
+  static std::pair<ClockType::duration, TimestampSource> Elapsed(
+      const Timestamp &send, const Timestamp &recv) {
+    auto elapsed = send.hardware && recv.hardware
+                       ? *recv.hardware - *send.hardware
+                       : recv.time - send.time;
+    auto source = send.hardware && recv.hardware
+                      ? HARDWARE
+                      : std::min(send.source, recv.source);
+    return {std::max(elapsed, ClockType::duration::zero()), source};
+  }
+};
+
+/// Convert kernel timestamps (taken with CLOCK_REALTIME) to `ClockType` by
+/// sampling both clocks once. The send and reply stamps of a probe must be
+/// converted with the same sample, or the jitter between samples and any
+/// step of the realtime clock in between end up in its RTT; so a sample is
+/// kept for `kRefreshInterval`, long enough to outlast the probes in flight
+/// and short enough to follow the slew of NTP.
+class KernelClock {
+  static constexpr auto kRefreshInterval = std::chrono::seconds(60);
+
+  TimePoint steady_;
+  std::chrono::nanoseconds realtime_;
+
+  static std::chrono::nanoseconds FromTimespec(const struct timespec &ts) {
+    return std::chrono::seconds(ts.tv_sec) +
+           std::chrono::nanoseconds(ts.tv_nsec);
+  }
+
+ public:
+  KernelClock() { Sample(); }
+
+  /// Sample both clocks again.
+  void Sample() {
+    steady_ = ClockType::now();
+    struct timespec ts {};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime_ = FromTimespec(ts);
+  }
+
+  /// Sample both clocks again if the last sample is `kRefreshInterval` old.
+  void Refresh() {
+    if (ClockType::now() - steady_ >= kRefreshInterval) Sample();
+  }
+
+  [[nodiscard]] TimePoint Convert(const struct timespec &ts) const {
+    return steady_ - std::chrono::duration_cast<ClockType::duration>(
+                         realtime_ - FromTimespec(ts));
+  }
+
+  /// The inverse of `Convert`, since the epoch.
+  [[nodiscard]] std::chrono::nanoseconds Realtime(TimePoint time) const {
+    return realtime_ + (time - steady_);
+  }
+
+  /// Fill `stamp` from an SCM_TIMESTAMPING or SCM_TIMESTAMPNS message.
+  /// Return false if the message holds no timestamp.
+  bool Parse(const struct cmsghdr *cmsg, Timestamp &stamp) const {
+    if (cmsg->cmsg_level != SOL_SOCKET) return false;
+    if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping stamps {};
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+      // ts[0] is the software timestamp, ts[2] the raw hardware one.
+      if (stamps.ts[0].tv_sec || stamps.ts[0].tv_nsec) {
+        stamp.time = Convert(stamps.ts[0]);
+        stamp.source = SOFTWARE;
+      }
+      if (stamps.ts[2].tv_sec || stamps.ts[2].tv_nsec)
+        stamp.hardware = FromTimespec(stamps.ts[2]);
+      return stamp.source != USERSPACE || stamp.hardware;
+    }
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts {};
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      stamp.time = Convert(ts);
+      stamp.source = SOFTWARE;
+      return true;
+    }
+    return false;
+  }
+};
+
+ICMPStatus UnreachableStatus(uint8_t code) {
+  switch (code) {
+    case icmp::kNetworkUnreachable:
+      return NETWORK_UNREACHABLE;
+    case icmp::kHostUnreachable:
+      return HOST_UNREACHABLE;
+    case icmp::kProtocolUnreachable:
+      return PROTOCOL_UNREACHABLE;
+    case icmp::kPortUnreachable:
+      return DESTINATION_REACHED;
+    default:
+      // Administratively prohibited and friends.
+      return HOST_UNREACHABLE;
+  }
+}
+
+/// The identity of a probe: its destination, TTL and attempt number. Every
+/// protocol encodes the TTL and attempt into a header field that ICMP errors
+/// quote back, while the destination is read from the quoted IP header.
+struct ProbeId {
+  struct in_addr destination;
+  uint8_t ttl;
+  uint8_t attempt;
+
+  static constexpr int kAttemptBits = 8;
+  // A UDP port only has room for the low bits of the attempt.
+  static constexpr int kCompactAttemptBits = 4;
+  static constexpr uint16_t kMaxCompactTag =
+      (UINT8_MAX << kCompactAttemptBits) | 0xf;
+
+  /// Pack the TTL and attempt into 16 bits.
+  [[nodiscard]] uint16_t Tag() const {
+    return static_cast<uint16_t>(ttl << kAttemptBits | attempt);
+  }
+
+  /// Pack the TTL and an attempt below `1 << kCompactAttemptBits` into 12
+  /// bits, which fit in the range of UDP ports above `kInitialPort`.
+  [[nodiscard]] uint16_t CompactTag() const {
+    assert(attempt < 1 << kCompactAttemptBits && "Attempt out of range.");
+    return static_cast<uint16_t>(ttl << kCompactAttemptBits | attempt);
+  }
+
+  static ProbeId FromTag(struct in_addr destination, uint16_t tag) {
+    return {destination, static_cast<uint8_t>(tag >> kAttemptBits),
+            static_cast<uint8_t>(tag & ((1U << kAttemptBits) - 1))};
+  }
+
+  static ProbeId FromCompactTag(struct in_addr destination, uint16_t tag) {
+    return {destination, static_cast<uint8_t>(tag >> kCompactAttemptBits),
+            static_cast<uint8_t>(tag & ((1U << kCompactAttemptBits) - 1))};
+  }
+
+  /// Never 0, since the TTL is at least 1.
+  [[nodiscard]] uint64_t Key() const {
+    return (static_cast<uint64_t>(destination.s_addr) << 16) | Tag();
+  }
+};
+
+/// A reply matched back to the probe that triggered it: whom it came from
+/// and when, and what it said.
+struct ProbeResult {
+  ProbeId id;
+  struct in_addr responder;
+  ICMPStatus status;
+  Timestamp recv_time;
+  MPLSStack mpls;
+};
+
+/// The time at which the kernel or the NIC actually sent a probe.
+struct SendStamp {
+  ProbeId id;
+  Timestamp send_time;
+};
+
+/// A counter that a single thread adds to and any thread may read. Being
+/// the only writer, the owner needs neither a lock nor a locked instruction.
+class Counter {
+  std::atomic<uint64_t> value_{0};
+
+ public:
+  void Add(uint64_t count = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + count,
+                 std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] uint64_t Get() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+};
+
+/// A distribution of durations, written like a `Counter`. The first bucket
+/// holds up to `first`, every further one up to `growth` times the bound of
+/// the previous one, and the last one the rest.
+class Histogram {
+  uint64_t first_ns_, growth_;
+  size_t buckets_;
+  std::unique_ptr<Counter[]> counts_;
+  Counter sum_ns_;
+
+ public:
+  Histogram(std::chrono::nanoseconds first, uint64_t growth, size_t buckets)
+      : first_ns_(static_cast<uint64_t>(first.count())),
+        growth_(growth),
+        buckets_(buckets),
+        counts_(std::make_unique<Counter[]>(buckets + 1)) {}
+
+  void Observe(ClockType::duration value) {
+    auto ns = static_cast<uint64_t>(std::max<int64_t>(
+        0, std::chrono::duration_cast<std::chrono::nanoseconds>(value)
+               .count()));
+    size_t bucket = 0;
+    for (uint64_t bound = first_ns_; bucket < buckets_ && ns > bound;
+         bound *= growth_)
+      bucket++;
+    counts_[bucket].Add();
+    sum_ns_.Add(ns);
+  }
+
+  [[nodiscard]] uint64_t Count() const {
+    uint64_t total = 0;
+    for (size_t bucket = 0; bucket <= buckets_; ++bucket)
+      total += counts_[bucket].Get();
+    return total;
+  }
+
+  /// Print `ns` nanoseconds as seconds, exactly.
+  static void WriteSeconds(std::ostream &out, uint64_t ns) {
+    std::string fraction = std::to_string(ns % 1'000'000'000);
+    out << ns / 1'000'000'000 << "." << std::string(9 - fraction.size(), '0')
+        << fraction;
+  }
+
+  /// Print as the Prometheus histogram `name`, adding `labels` (e.g.
+  /// `hop="3"`) to every sample. Buckets are cumulative.
+  void Write(std::ostream &out, const std::string &name,
+             const std::string &labels = "") const {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t total = 0;
+    uint64_t bound = first_ns_;
+    for (size_t bucket = 0; bucket <= buckets_; ++bucket, bound *= growth_) {
+      total += counts_[bucket].Get();
+      out << name << "_bucket{" << prefix << "le=\"";
+      if (bucket < buckets_) {
+        WriteSeconds(out, bound);
+      } else {
+        out << "+Inf";
+      }
+      out << "\"} " << total << "\n";
+    }
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " ";
+    WriteSeconds(out, sum_ns_.Get());
+    out << "\n";
+    out << name << "_count" << braces << " " << total << "\n";
+  }
+};
+
+/// What the probing engine counts for `-M`, written by the thread of the
+/// event loop only.
+struct EngineMetrics {
+  enum Syscall : uint8_t { SEND, RECEIVE, RECEIVE_ERRQUEUE, WAIT, ENTER };
+  static constexpr size_t kSyscalls = 5;
+
+  struct Hop {
+    Histogram rtt{std::chrono::microseconds(100), 2, 18};
+    Counter timeouts;
+  };
+
+  Counter probes_sent;
+  Counter probes_skipped;   // Left out as their hops were known
+  Counter replies_matched;  // Answered an outstanding probe
+  Counter replies_late;     // Answered one already answered or given up on
+  Counter icmp_received, icmp_stray;  // Stray: answered none of our probes
+  Counter tcp_received, tcp_stray;
+  std::array<Counter, kSyscalls> syscalls;
+  // Indexed by TTL.
+  std::deque<Hop> hops = std::deque<Hop>(UINT8_MAX + 1);
+  // From handing a probe to the kernel until it left, and from the arrival
+  // of a reply until the event loop read it.
+  Histogram send_latency{std::chrono::microseconds(1), 4, 11};
+  Histogram receive_latency{std::chrono::microseconds(1), 4, 11};
+
+  /// Print in the Prometheus text format, except for what the socket filter
+  /// dropped, which only the client knows.
+  void Write(std::ostream &out) const {
+    auto header = [&](const char *name, const char *type, const char *help) {
+      out << "# HELP " << name << " " << help << "\n# TYPE " << name << " "
+          << type << "\n";
+    };
+    header("traceroute_probes_sent_total", "counter", "Probes sent.");
+    out << "traceroute_probes_sent_total " << probes_sent.Get() << "\n";
+    header("traceroute_probes_skipped_total", "counter",
+           "Probes left out as the stop sets or the previous route knew "
+           "their hops.");
+    out << "traceroute_probes_skipped_total " << probes_skipped.Get() << "\n";
+    header("traceroute_replies_total", "counter",
+           "Replies identifying one of our probes.");
+    out << "traceroute_replies_total{result=\"matched\"} "
+        << replies_matched.Get() << "\n";
+    out << "traceroute_replies_total{result=\"late\"} " << replies_late.Get()
+        << "\n";
+    header("traceroute_packets_received_total", "counter",
+           "Packets read from the receive sockets.");
+    out << "traceroute_packets_received_total{socket=\"icmp\"} "
+        << icmp_received.Get() << "\n";
+    out << "traceroute_packets_received_total{socket=\"tcp\"} "
+        << tcp_received.Get() << "\n";
+    header("traceroute_packets_stray_total", "counter",
+           "Packets read that answered none of our probes.");
+    out << "traceroute_packets_stray_total{socket=\"icmp\"} "
+        << icmp_stray.Get() << "\n";
+    out << "traceroute_packets_stray_total{socket=\"tcp\"} "
+        << tcp_stray.Get() << "\n";
+    header("traceroute_syscalls_total", "counter",
+           "System calls made by the event loop.");
+    constexpr std::array<const char *, kSyscalls> kNames = {
+        "sendmmsg", "recvmmsg", "recvmmsg_errqueue", "epoll_wait",
+        "io_uring_enter"};
+    for (size_t call = 0; call < kSyscalls; ++call) {
+      out << "traceroute_syscalls_total{call=\"" << kNames[call] << "\"} "
+          << syscalls[call].Get() << "\n";
+    }
+    header("traceroute_timeouts_total", "counter",
+           "Probes given up on, by TTL.");
+    for (size_t ttl = 0; ttl < hops.size(); ++ttl) {
+      if (hops[ttl].timeouts.Get() == 0) continue;
+      out << "traceroute_timeouts_total{hop=\"" << ttl << "\"} "
+          << hops[ttl].timeouts.Get() << "\n";
+    }
+    header("traceroute_rtt_seconds", "histogram",
+           "Round-trip times of matched replies, by TTL.");
+    for (size_t ttl = 0; ttl < hops.size(); ++ttl) {
+      if (hops[ttl].rtt.Count() == 0) continue;
+      hops[ttl].rtt.Write(out, "traceroute_rtt_seconds",
+                          "hop=\"" + std::to_string(ttl) + "\"");
+    }
+    header("traceroute_send_latency_seconds", "histogram",
+           "From queueing a probe until the kernel sent it.");
+    send_latency.Write(out, "traceroute_send_latency_seconds");
+    header("traceroute_receive_latency_seconds", "histogram",
+           "From the arrival of a reply until the event loop read it.");
+    receive_latency.Write(out, "traceroute_receive_latency_seconds");
+  }
+};
+
+/// What `TraceRouteClient::Poll` collected.
+struct Events {
+  std::vector<SendStamp> sent;
+  std::vector<ProbeResult> replies;
+  std::vector<int> ready;  // Descriptors added with `AddWatch`
+  // Probes known to get no reply, to be given up on without waiting.
+  std::vector<ProbeId> lost;
+
+  /// Empty, but keep the capacity for the next turn.
+  void Clear() {
+    sent.clear();
+    replies.clear();
+    ready.clear();
+    lost.clear();
+  }
+};
+
+/// Outstanding probes indexed by `ProbeId::Key()`. Open addressing with
+/// linear probing keeps a lookup to one hash and, typically, one cache line,
+/// however many probes are in flight. Deletion shifts the following entries
+/// back instead of leaving tombstones, so the table never degrades.
+class ProbeTable {
+ public:
+  struct Entry {
+    uint32_t trace;
+    uint32_t probe;
+  };
+
+ private:
+  struct Slot {
+    uint64_t key;  // 0 if empty
+    Entry entry;
+  };
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+  int shift_;
+
+  [[nodiscard]] size_t Home(uint64_t key) const {
+    // Fibonacci hashing: the high bits of the product are well mixed.
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> shift_);
+  }
+
+  [[nodiscard]] size_t Mask() const { return slots_.size() - 1; }
+
+  void Grow() {
+    std::vector<Slot> slots(slots_.size() * 2);
+    std::swap(slots, slots_);
+    shift_--;
+    size_ = 0;
+    for (const auto &slot : slots) {
+      if (slot.key) Insert(slot.key, slot.entry);
+    }
+  }
+
+ public:
+  explicit ProbeTable(int capacity_bits = 10)
+      : slots_(size_t{1} << capacity_bits), shift_(64 - capacity_bits) {}
+
+  [[nodiscard]] size_t Size() const { return size_; }
+
+  void Insert(uint64_t key, Entry entry) {
+    assert(key != 0);
+    if (2 * (size_ + 1) > slots_.size()) Grow();
+    size_t index = Home(key);
+    while (slots_[index].key != 0 && slots_[index].key != key)
+      index = (index + 1) & Mask();
+    if (slots_[index].key == 0) size_++;
+    slots_[index] = {key, entry};
+  }
+
+  [[nodiscard]] std::optional<Entry> Find(uint64_t key) const {
+    for (size_t index = Home(key); slots_[index].key != 0;
+         index = (index + 1) & Mask()) {
+      if (slots_[index].key == key) return slots_[index].entry;
+    }
+    return std::nullopt;
+  }
+
+  bool Erase(uint64_t key) {
+    size_t index = Home(key);
+    while (slots_[index].key != key) {
+      if (slots_[index].key == 0) return false;
+      index = (index + 1) & Mask();
+    }
+    // Shift back every following entry that would otherwise become
+    // unreachable from its home slot.
+    for (size_t next = (index + 1) & Mask(); slots_[next].key != 0;
+         next = (next + 1) & Mask()) {
+      size_t home = Home(slots_[next].key);
+      if (((next - home) & Mask()) >= ((next - index) & Mask())) {
+        slots_[index] = slots_[next];
+        index = next;
+      }
+    }
+    slots_[index].key = 0;
+    size_--;
+    return true;
+  }
+};
+
+/// Receives the IP packets that arrive at the host through an AF_PACKET
+/// socket and a TPACKET_V3 ring it shares with the kernel. The kernel fills
+/// blocks of packets, each stamped with its arrival time, and hands a block
+/// over once it is full or a millisecond old; reading the packets of a block
+/// takes neither a system call nor a copy.
+class PacketRing {
+  // As much as the receive buffer of a raw socket, in many small blocks,
+  // since one that times out is handed over however empty it is.
+  static constexpr uint32_t kBlockSize = 1 << 15;
+  static constexpr uint32_t kBlocks = 128;
+  static constexpr uint32_t kFrameSize = 1 << 11;
+  static constexpr uint32_t kBlockTimeoutMs = 1;
+
+  int fd_{-1};
+  uint8_t *map_{nullptr};
+  uint32_t next_block_ = 0;
+
+ public:
+  /// Set up the ring, which only receives once `Bind()` is called.
+  PacketRing() {
+    // No protocol yet, so that nothing arrives before the filter.
+    fd_ = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) Fail("socket(AF_PACKET)");
+    try {
+      int version = TPACKET_V3;
+      if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version,
+                     sizeof(version)) < 0)
+        Fail("setsockopt(PACKET_VERSION)");
+#ifdef PACKET_IGNORE_OUTGOING
+      // Our own probes would only be filtered out again.
+      int ignore = 1;
+      setsockopt(fd_, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore,
+                 sizeof(ignore));
+#endif
+      struct tpacket_req3 req {};
+      req.tp_block_size = kBlockSize;
+      req.tp_block_nr = kBlocks;
+      req.tp_frame_size = kFrameSize;
+      req.tp_frame_nr = kBlockSize / kFrameSize * kBlocks;
+      req.tp_retire_blk_tov = kBlockTimeoutMs;
+      if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        Fail("setsockopt(PACKET_RX_RING)");
+      void *map = mmap(nullptr, size_t{kBlockSize} * kBlocks,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd_, 0);
+      // Locking the ring in memory takes a large enough RLIMIT_MEMLOCK.
+      if (map == MAP_FAILED)
+        map = mmap(nullptr, size_t{kBlockSize} * kBlocks,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+      if (map == MAP_FAILED) Fail("mmap(PACKET_RX_RING)");
+      map_ = static_cast<uint8_t *>(map);
+    } catch (...) {
+      close(fd_);
+      throw;
+    }
+  }
+
+  PacketRing(const PacketRing &other) = delete;
+  PacketRing(PacketRing &&other) = delete;
+  PacketRing &operator=(const PacketRing &other) = delete;
+  PacketRing &operator=(PacketRing &&other) = delete;
+
+  ~PacketRing() {
+    munmap(map_, size_t{kBlockSize} * kBlocks);
+    close(fd_);
+  }
+
+  /// Readable once a block is handed over.
+  [[nodiscard]] int Fd() const { return fd_; }
+
+  /// Start receiving the IPv4 packets of every interface, as attached
+  /// filters let through.
+  void Bind() const {
+    struct sockaddr_ll addr {};
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    if (bind(fd_, reinterpret_cast<const struct sockaddr *>(&addr),
+             sizeof(addr)) < 0)
+      Fail("bind(AF_PACKET)");
+  }
+
+  /// Pass every packet addressed to the host in the blocks handed over to
+  /// `handle`, with its arrival time, and hand the blocks back. Return the
+  /// number of blocks read.
+  template <typename Fn>
+  size_t Drain(const KernelClock &clock, Fn &&handle) {
+    size_t blocks = 0;
+    while (true) {
+      auto *block = reinterpret_cast<struct tpacket_block_desc *>(
+          map_ + size_t{next_block_} * kBlockSize);
+      auto &header = block->hdr.bh1;
+      if (!(__atomic_load_n(&header.block_status, __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER))
+        return blocks;
+      auto *frame = reinterpret_cast<uint8_t *>(block) +
+                    header.offset_to_first_pkt;
+      for (uint32_t i = 0; i < header.num_pkts; ++i) {
+        const auto *packet = reinterpret_cast<struct tpacket3_hdr *>(frame);
+        const auto *link = reinterpret_cast<struct sockaddr_ll *>(
+            frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (link->sll_pkttype == PACKET_HOST) {
+          // Unless the packet was stamped on arrival already, the kernel
+          // stamps it as it copies it into the ring.
+          struct timespec ts {};
+          ts.tv_sec = packet->tp_sec;
+          ts.tv_nsec = packet->tp_nsec;
+          Timestamp recv_time{clock.Convert(ts), SOFTWARE, {}};
+          // For SOCK_DGRAM, the captured data starts at the IP header.
+          handle(PacketView(frame + packet->tp_net,
+                            packet->tp_snaplen -
+                                (packet->tp_net - packet->tp_mac)),
+                 recv_time);
+        }
+        frame += packet->tp_next_offset;
+      }
+      __atomic_store_n(&header.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      next_block_ = (next_block_ + 1) % kBlocks;
+      blocks++;
+    }
+  }
+};
+
+/// An io_uring: queues of submissions and completions shared with the
+/// kernel, so that a single io_uring_enter() submits every operation queued
+/// since the last one and waits for completions, which are then read
+/// without system calls. Set up with the bare system calls, and with a ring
+/// of provided buffers for receives to pick from.
+class IoUring {
+  static constexpr uint32_t kEntries = 256;
+  static constexpr uint16_t kBufferGroup = 0;
+
+  int fd_{-1};
+  uint8_t *sq_map_{nullptr}, *cq_map_{nullptr};
+  size_t sq_map_size_ = 0, cq_map_size_ = 0;
+  struct io_uring_sqe *sqes_{nullptr};
+  uint32_t *sq_tail_, *sq_array_, *cq_head_, *cq_tail_;
+  uint32_t sq_mask_ = 0, cq_mask_ = 0;
+  struct io_uring_cqe *cqes_;
+  uint32_t unsubmitted_ = 0;
+
+  struct io_uring_buf_ring *buffers_{nullptr};
+  size_t buffers_size_ = 0;
+  std::vector<uint8_t> arena_;
+  uint32_t buffer_size_ = 0;
+  uint16_t buffer_mask_ = 0, buffer_tail_ = 0;
+
+  void Unmap() {
+    if (buffers_) munmap(buffers_, buffers_size_);
+    if (sqes_) munmap(sqes_, kEntries * sizeof(struct io_uring_sqe));
+    if (cq_map_ && cq_map_ != sq_map_) munmap(cq_map_, cq_map_size_);
+    if (sq_map_) munmap(sq_map_, sq_map_size_);
+  }
+
+  /// Fail unless the kernel supports every one of `opcodes`.
+  void Require(std::initializer_list<uint8_t> opcodes) {
+    constexpr size_t kOps = 256;
+    std::vector<uint8_t> data(sizeof(struct io_uring_probe) +
+                              kOps * sizeof(struct io_uring_probe_op));
+    auto *probe = reinterpret_cast<struct io_uring_probe *>(data.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                kOps) < 0)
+      Fail("io_uring_register(probe)");
+    for (uint8_t opcode : opcodes) {
+      if (opcode >= probe->ops_len ||
+          !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+        errno = ENOTSUP;
+        Fail("io_uring_register(probe)");
+      }
+    }
+  }
+
+ public:
+  /// With `buffers` of `buffer_size` bytes each to receive into.
+  IoUring(uint16_t buffers, uint32_t buffer_size) {
+    assert((buffers & (buffers - 1)) == 0 && "Buffers must be a power of 2.");
+    struct io_uring_params params {};
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, kEntries, &params));
+    if (fd_ < 0) Fail("io_uring_setup");
+    try {
+      // Waits are bounded by the timeout of io_uring_enter() itself.
+      if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP;
+        Fail("io_uring_setup");
+      }
+      // Multishot receives came in the same release as zero-copy sends,
+      // which the kernel can be asked about; the receive itself cannot.
+      Require({IORING_OP_SENDMSG, IORING_OP_RECVMSG, IORING_OP_POLL_ADD,
+             IORING_OP_SEND_ZC});
+      sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      cq_map_size_ =
+          params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+      bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+      if (single)
+        sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+      auto map = [&](size_t size, off_t offset) {
+        void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (data == MAP_FAILED) Fail("mmap(io_uring)");
+        return static_cast<uint8_t *>(data);
+      };
+      sq_map_ = map(sq_map_size_, IORING_OFF_SQ_RING);
+      cq_map_ = single ? sq_map_ : map(cq_map_size_, IORING_OFF_CQ_RING);
+      sqes_ = reinterpret_cast<struct io_uring_sqe *>(
+          map(params.sq_entries * sizeof(struct io_uring_sqe),
+              IORING_OFF_SQES));
+      sq_tail_ = reinterpret_cast<uint32_t *>(sq_map_ + params.sq_off.tail);
+      sq_mask_ = *reinterpret_cast<uint32_t *>(sq_map_ +
+                                               params.sq_off.ring_mask);
+      sq_array_ = reinterpret_cast<uint32_t *>(sq_map_ + params.sq_off.array);
+      cq_head_ = reinterpret_cast<uint32_t *>(cq_map_ + params.cq_off.head);
+      cq_tail_ = reinterpret_cast<uint32_t *>(cq_map_ + params.cq_off.tail);
+      cq_mask_ = *reinterpret_cast<uint32_t *>(cq_map_ +
+                                               params.cq_off.ring_mask);
+      cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq_map_ +
+                                                      params.cq_off.cqes);
+
+      buffers_size_ = buffers * sizeof(struct io_uring_buf);
+      void *ring = mmap(nullptr, buffers_size_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ring == MAP_FAILED) Fail("mmap(buffer ring)");
+      buffers_ = static_cast<struct io_uring_buf_ring *>(ring);
+      struct io_uring_buf_reg reg {};
+      reg.ring_addr = reinterpret_cast<uint64_t>(buffers_);
+      reg.ring_entries = buffers;
+      reg.bgid = kBufferGroup;
+      if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg,
+                  1) < 0)
+        Fail("io_uring_register(buffer ring)");
+      arena_.resize(size_t{buffers} * buffer_size);
+      buffer_size_ = buffer_size;
+      buffer_mask_ = static_cast<uint16_t>(buffers - 1);
+      for (uint16_t id = 0; id < buffers; ++id) ReturnBuffer(id);
+      PublishBuffers();
+    } catch (...) {
+      Unmap();
+      close(fd_);
+      throw;
+    }
+  }
+
+  IoUring(const IoUring &other) = delete;
+  IoUring(IoUring &&other) = delete;
+  IoUring &operator=(const IoUring &other) = delete;
+  IoUring &operator=(IoUring &&other) = delete;
+
+  ~IoUring() {
+    Unmap();
+    close(fd_);
+  }
+
+  /// Readable when completions are queued.
+  [[nodiscard]] int Fd() const { return fd_; }
+
+  [[nodiscard]] uint32_t Unsubmitted() const { return unsubmitted_; }
+
+  /// A cleared submission for the next `Enter()`, submitting those queued
+  /// so far first if the queue is full.
+  struct io_uring_sqe &Prepare() {
+    if (unsubmitted_ > sq_mask_) Enter(0, 0);
+    uint32_t tail = *sq_tail_;
+    uint32_t index = tail & sq_mask_;
+    sqes_[index] = {};
+    sq_array_[index] = index;
+    // The kernel only reads the queue when entered.
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted_++;
+    return sqes_[index];
+  }
+
+  /// Submit what was prepared, and wait until there are `min_complete`
+  /// completions or `timeout_ms` passes (forever if -1).
+  void Enter(uint32_t min_complete, int timeout_ms) {
+    struct __kernel_timespec ts {};
+    struct io_uring_getevents_arg arg {};
+    uint32_t flags = IORING_ENTER_EXT_ARG;
+    if (min_complete > 0) {
+      flags |= IORING_ENTER_GETEVENTS;
+      if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1'000'000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+      }
+    }
+    long submitted = syscall(__NR_io_uring_enter, fd_, unsubmitted_,
+                             min_complete, flags, &arg, sizeof(arg));
+    if (submitted < 0) {
+      // Timed out, interrupted, or completions are to be reaped first.
+      if (errno == ETIME || errno == EINTR || errno == EAGAIN ||
+          errno == EBUSY)
+        return;
+      Fail("io_uring_enter");
+    }
+    unsubmitted_ -= static_cast<uint32_t>(submitted);
+  }
+
+  /// Pass every queued completion to `handle`, in order.
+  template <typename Fn>
+  void Reap(Fn &&handle) {
+    uint32_t head = *cq_head_;
+    uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      handle(cqes_[head & cq_mask_]);
+      // Completions handled so far may be overwritten, should `handle`
+      // enter the ring again.
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+  }
+
+  /// Have `sqe` pick a provided buffer to receive into.
+  static void SelectBuffer(struct io_uring_sqe &sqe) {
+    sqe.flags |= IOSQE_BUFFER_SELECT;
+    sqe.buf_group = kBufferGroup;
+  }
+
+  /// The provided buffer `id`, which a completion names.
+  [[nodiscard]] const uint8_t *Buffer(uint16_t id) const {
+    return arena_.data() + size_t{id} * buffer_size_;
+  }
+
+  /// Provide buffer `id` again, once `PublishBuffers()` is called.
+  void ReturnBuffer(uint16_t id) {
+    // Not `bufs`, which C++ places after the empty struct of its
+    // declaration.
+    auto &buffer = reinterpret_cast<struct io_uring_buf *>(
+        buffers_)[buffer_tail_ & buffer_mask_];
+    buffer.addr = reinterpret_cast<uint64_t>(Buffer(id));
+    buffer.len = buffer_size_;
+    buffer.bid = id;
+    buffer_tail_++;
+  }
+
+  void PublishBuffers() {
+    __atomic_store_n(&buffers_->tail, buffer_tail_, __ATOMIC_RELEASE);
+  }
+};
+
+/// The pcap files of `Recorder` and `Replay`: LINKTYPE_LINUX_SLL, whose
+/// header tells the packets we sent from those we received, followed by the
+/// IP header.
+namespace pcap {
+
+constexpr uint32_t kMagic = 0xa1b23c4d;  // With nanosecond timestamps
+constexpr uint32_t kMicrosecondMagic = 0xa1b2c3d4;
+constexpr uint16_t kVersionMajor = 2, kVersionMinor = 4;
+constexpr uint32_t kSnapLength = 65535;
+constexpr uint32_t kLinkType = 113;  // LINKTYPE_LINUX_SLL
+constexpr uint16_t kIncoming = 0, kOutgoing = 4;
+constexpr uint16_t kNoLinkLayer = 0xfffe;  // ARPHRD_NONE
+constexpr size_t kFileHeaderSize = 24, kRecordHeaderSize = 16;
+constexpr size_t kLinkHeaderSize = 16, kProtocolOffset = 14;
+// No IP packet is longer, so no record of ours either.
+constexpr size_t kMaxRecordSize = kLinkHeaderSize + UINT16_MAX;
+
+}  // namespace pcap
+
+/// Writes every probe sent and every packet received to a pcap file, with
+/// the times they were sent and received, for `Replay` or any other reader
+/// of pcap files. Probes are written as the IP packets the kernel makes of
+/// them.
+class Recorder {
+  std::ofstream out_;
+  KernelClock clock_;
+
+  template <typename T>
+  void Put(T value) {
+    out_.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+ public:
+  explicit Recorder(const std::string &path)
+      : out_(path, std::ios::binary | std::ios::trunc) {
+    if (!out_) Fail(path);
+    Put(pcap::kMagic);
+    Put(pcap::kVersionMajor);
+    Put(pcap::kVersionMinor);
+    Put(int32_t{0});   // Time zone
+    Put(uint32_t{0});  // Accuracy of timestamps
+    Put(pcap::kSnapLength);
+    Put(pcap::kLinkType);
+  }
+
+  /// Append `packet`, starting with its IP header, which was sent or
+  /// received at `time`.
+  void Write(bool sent, PacketView packet, const Timestamp &time) {
+    auto since_epoch = clock_.Realtime(time.time).count();
+    auto size = static_cast<uint32_t>(pcap::kLinkHeaderSize + packet.Size());
+    Put(static_cast<uint32_t>(since_epoch / 1'000'000'000));
+    Put(static_cast<uint32_t>(since_epoch % 1'000'000'000));
+    Put(size);
+    Put(size);
+    std::array<uint8_t, pcap::kLinkHeaderSize> header{};
+    header[1] = sent ? pcap::kOutgoing : pcap::kIncoming;
+    header[2] = pcap::kNoLinkLayer >> 8;
+    header[3] = pcap::kNoLinkLayer & 0xff;
+    header[pcap::kProtocolOffset] = ETH_P_IP >> 8;
+    header[pcap::kProtocolOffset + 1] = ETH_P_IP & 0xff;
+    out_.write(reinterpret_cast<const char *>(header.data()), header.size());
+    out_.write(reinterpret_cast<const char *>(packet.Data()),
+               static_cast<std::streamsize>(packet.Size()));
+    if (!out_) Fail("write(record)");
+  }
+};
+
+/// A recording of `Recorder`, replayed to a client instead of the network.
+/// The packets received after a probe was sent, and before it was sent
+/// again, are its exchange, which is replayed when the client sends the
+/// same probe: the replies as fast as possible, or as long after it as
+/// they arrived after the original, and in any case with the RTTs of the
+/// recording. A probe that nothing answered is lost at once, unless the
+/// replay keeps the timing of the recording. The rest of the packets
+/// received, such as those that match no probe, go with the last probe sent
+/// before them.
+class Replay {
+ public:
+  struct Packet {
+    std::chrono::nanoseconds time;  // Since the epoch
+    bool sent;
+    std::vector<uint8_t> data;  // From the IP header on
+
+    [[nodiscard]] PacketView View() const { return {data.data(), data.size()}; }
+  };
+
+ private:
+  struct Exchange {
+    std::chrono::nanoseconds sent;
+    std::vector<size_t> received;
+    bool answered;  // By a packet that matches the probe
+  };
+
+  struct Due {
+    TimePoint when;
+    Timestamp recv_time;
+    size_t packet;
+    bool operator>(const Due &other) const { return when > other.when; }
+  };
+
+  std::vector<Packet> packets_;
+  std::unordered_map<uint64_t, std::deque<Exchange>> exchanges_;
+  std::priority_queue<Due, std::vector<Due>, std::greater<>> due_;
+  bool timing_;
+
+ public:
+  /// Read the recording at `path`, to be replayed with its original
+  /// `timing` or without.
+  Replay(const std::string &path, bool timing) : timing_(timing) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) Fail(path);
+    auto invalid = [&] {
+      errno = EINVAL;
+      Fail(path);
+    };
+    std::array<uint32_t, pcap::kFileHeaderSize / 4> header{};
+    if (!in.read(reinterpret_cast<char *>(header.data()), sizeof(header)) ||
+        (header[0] != pcap::kMagic && header[0] != pcap::kMicrosecondMagic) ||
+        header[5] != pcap::kLinkType)
+      invalid();
+    int64_t fraction = header[0] == pcap::kMagic ? 1 : 1000;
+    std::array<uint32_t, pcap::kRecordHeaderSize / 4> record{};
+    std::vector<uint8_t> data;
+    while (in.read(reinterpret_cast<char *>(record.data()), sizeof(record))) {
+      if (record[2] > pcap::kMaxRecordSize) invalid();
+      data.resize(record[2]);
+      if (!in.read(reinterpret_cast<char *>(data.data()),
+                   static_cast<std::streamsize>(data.size())))
+        invalid();
+      PacketView link(data.data(), data.size());
+      if (link.Size() < pcap::kLinkHeaderSize ||
+          link.U16(pcap::kProtocolOffset) != ETH_P_IP)
+        continue;
+      auto time = std::chrono::seconds(record[0]) +
+                  std::chrono::nanoseconds(record[1] * fraction);
+      packets_.push_back({time, link.U16(0) == pcap::kOutgoing,
+                          {data.begin() + pcap::kLinkHeaderSize, data.end()}});
+    }
+    if (!in.eof()) invalid();
+  }
+
+  /// The transport header of the first probe sent over `protocol`, from
+  /// which a client learns what its probes looked like, if there is one.
+  [[nodiscard]] std::optional<PacketView> FirstSent(uint8_t protocol) const {
+    for (const auto &packet : packets_) {
+      if (!packet.sent) continue;
+      auto ip = IPv4View::Parse(packet.View());
+      if (ip && ip->Protocol() == protocol) return ip->Payload();
+    }
+    return std::nullopt;
+  }
+
+  /// Sort the packets into exchanges, by the `ProbeId::Key()` that `key`
+  /// gives a packet sent or received, if any.
+  template <typename Fn>
+  void Index(Fn &&key) {
+    std::unordered_map<uint64_t, Exchange *> open;
+    Exchange *last = nullptr;
+    for (size_t i = 0; i < packets_.size(); ++i) {
+      const auto &packet = packets_[i];
+      auto probe = key(packet);
+      if (packet.sent) {
+        if (!probe) continue;
+        last = &exchanges_[*probe].emplace_back(
+            Exchange{packet.time, {}, false});
+        open[*probe] = last;
+        continue;
+      }
+      auto exchange = probe ? open.find(*probe) : open.end();
+      if (exchange != open.end()) {
+        exchange->second->received.push_back(i);
+        exchange->second->answered = true;
+      } else if (last) {
+        last->received.push_back(i);
+      }
+    }
+  }
+
+  /// The probe of `key` is sent at `now`: replay its next exchange. Return
+  /// whether the probe is lost, as nothing answered it when recording, and
+  /// the replay need not wait the timeout the recording waited.
+  [[nodiscard]] bool Send(uint64_t key, TimePoint now) {
+    auto exchanges = exchanges_.find(key);
+    if (exchanges == exchanges_.end() || exchanges->second.empty())
+      return !timing_;
+    auto &exchange = exchanges->second.front();
+    bool lost = !exchange.answered && !timing_;
+    for (size_t i : exchange.received) {
+      auto recv_time = now + std::chrono::duration_cast<ClockType::duration>(
+                                 packets_[i].time - exchange.sent);
+      due_.push({timing_ ? recv_time : now, {recv_time, SOFTWARE, {}}, i});
+    }
+    exchanges->second.pop_front();
+    return lost;
+  }
+
+  /// When the next packet is to be received, if any is.
+  [[nodiscard]] std::optional<TimePoint> NextDue() const {
+    if (due_.empty()) return std::nullopt;
+    return due_.top().when;
+  }
+
+  /// Pass every packet due by `now` to `handle`, with its receive time.
+  template <typename Fn>
+  void Receive(TimePoint now, Fn &&handle) {
+    while (!due_.empty() && due_.top().when <= now) {
+      auto due = due_.top();
+      due_.pop();
+      handle(packets_[due.packet].View(), due.recv_time);
+    }
+  }
+};
+
+/// The destinations a client probes when several share the host: those
+/// `ShardOf()` puts in shard `index` of `count`.
+struct Shard {
+  uint32_t index = 0, count = 1;
+};
+
+/// Sends probes towards any number of destinations and collects the replies
+/// with a single raw ICMP socket, or a `PacketRing` if asked to and the
+/// kernel allows. Datagrams are sent in batches with sendmmsg(), each
+/// carrying its own TTL as ancillary data, and replies are drained with
+/// recvmmsg() into a preallocated ring of buffers. Both sides
+/// ask the kernel for send and receive timestamps (SO_TIMESTAMPING, falling
+/// back to SO_TIMESTAMPNS), so that RTTs exclude the time spent in
+/// userspace.
+///
+/// `Client` is the subclass of a mode, which writes its probes in place
+/// with `SendRequest` and recovers their tags from replies with `Match`,
+/// and may replace `MatchReply`, `TransportHeader` and `OnReady`. These are
+/// bound at compile time, so no probe or reply takes an indirect call.
+template <typename Client>
+class TraceRouteClient {
+ protected:
+  static constexpr size_t kBufferSize = 512;
+  static constexpr size_t kBatchSize = 64;
+  static constexpr size_t kMaxDatagramSize = 64;
+  // Room for SCM_TIMESTAMPING plus the IP_RECVERR of the error queue.
+  static constexpr size_t kControlSize =
+      CMSG_SPACE(sizeof(struct scm_timestamping)) +
+      CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(sockaddr_in));
+  // Must be a power of 2.
+  static constexpr size_t kSentRingSize = 1 << 16;
+  // Replies to a window of probes arrive in bursts.
+  static constexpr int kReceiveBufferSize = 4 << 20;
+  // A probe as recorded, with the IP header and any UDP header the kernel
+  // adds to the datagram.
+  static constexpr size_t kMaxPacketSize = 20 + 8 + kMaxDatagramSize;
+  // Of `uring_`, each with room for a reply as `recvmsg` would give it.
+  static constexpr uint16_t kUringBuffers = 1024;
+  static constexpr uint32_t kUringBufferSize = 1024;
+  static_assert(sizeof(struct io_uring_recvmsg_out) + kControlSize +
+                        kBufferSize <=
+                    kUringBufferSize,
+                "Reply buffers of the io_uring too small.");
+
+  // What the completions of `uring_` are about, in the low bits of their
+  // user data; those of `SENT` carry the index of the datagram above.
+  enum Completion : uint64_t { SENT, RECEIVED, SEND_ERRORS, WATCHES };
+  static constexpr uint64_t kCompletionBits = 2;
+  static constexpr uint64_t kCompletionMask = (1 << kCompletionBits) - 1;
+
+  struct Datagram {
+    ProbeId id;
+    struct sockaddr_in addr;
+    std::array<uint8_t, kMaxDatagramSize> data;
+    struct iovec iov;
+    alignas(struct cmsghdr)
+        std::array<uint8_t, CMSG_SPACE(sizeof(int))> control;
+  };
+
+  // The sender of a reply is read from its IP header, so its address is not
+  // asked for.
+  struct RecvBuffer {
+    std::array<uint8_t, kBufferSize> data;
+    struct iovec iov;
+    alignas(struct cmsghdr) std::array<uint8_t, kControlSize> control;
+  };
+
+  // Replies are read from `recv_fd_`, which `ring_` owns if there is one.
+  int send_fd_{-1}, recv_fd_{-1};    // NOLINT
+  int epoll_fd_{-1};                 // NOLINT
+  std::optional<PacketRing> ring_;   // NOLINT
+  Shard shard_;                      // NOLINT
+  // Collected while waiting for sends to complete, for the next `Poll`.
+  Events pending_;                   // NOLINT
+  // Handed out by `Poll`.
+  Events events_;                    // NOLINT
+  std::vector<int> external_fds_;    // NOLINT
+  std::vector<int> owned_fds_;       // NOLINT
+
+  std::array<Datagram, kBatchSize> datagrams_{};
+  std::array<struct mmsghdr, kBatchSize> send_msgs_{};
+  size_t queued_ = 0;
+  std::array<RecvBuffer, kBatchSize> recv_buffers_{};
+  std::array<struct mmsghdr, kBatchSize> recv_msgs_{};
+  // With SOF_TIMESTAMPING_OPT_ID, send timestamps are numbered by the order
+  // in which datagrams were sent; remember which probe each number was.
+  bool send_timestamps_ = false;
+  uint32_t next_sent_ = 0;
+  std::vector<ProbeId> sent_ring_;
+  EngineMetrics metrics_;
+  std::optional<uint64_t> icmp_in_base_;
+  // Converts the kernel timestamps of sends and replies alike.
+  KernelClock clock_;
+  // Our address towards each destination, for the checksums of probes.
+  std::unordered_map<in_addr_t, struct sockaddr_in> sources_;
+
+  // With an io_uring, probes are sent and replies received through it, and
+  // it waits for the send error queue and for the epoll set, which keeps
+  // the other descriptors. Its requests are multishot, and re-armed once
+  // they end; `watches_ready_` is set until epoll has nothing more.
+  std::optional<IoUring> uring_;
+  struct msghdr uring_recv_ {};
+  size_t sends_in_flight_ = 0;
+  bool receiving_ = false, polling_errors_ = false, polling_watches_ = false;
+  bool watches_ready_ = false;
+  // The buffers and sizes of the replies of a `Complete`, handled once the
+  // send timestamps that came with them are.
+  std::vector<std::pair<uint16_t, size_t>> uring_received_;
+
+  std::optional<Recorder> recorder_;
+  // Probes sent while recording, numbered like `sent_ring_`, until their
+  // send timestamps arrive.
+  struct SentPacket {
+    std::array<uint8_t, kMaxPacketSize> data;
+    size_t size;
+  };
+  std::vector<SentPacket> sent_packets_;
+  // Replayed instead of the network, which is left alone; indexed with the
+  // matchers of the subclass once it is constructed.
+  std::optional<Replay> replay_;
+  bool replay_indexed_ = false;
+
+  /// A big-endian halfword of a packet and the range of values it must be
+  /// within.
+  struct FieldRange {
+    uint32_t offset;
+    uint16_t low, high;
+  };
+
+  /// Build a classic BPF program for `recv_fd_` that passes only ICMP
+  /// errors quoting a `protocol` packet whose transport header matches
+  /// `quoted`, and, unless `direct` is empty, `direct_type` messages whose
+  /// ICMP header matches `direct`. Offsets are relative to the respective
+  /// header, which is located from the IHL of both IP headers. Either must
+  /// be about a destination of `shard_`. A `ring_` also sees every other
+  /// protocol, which is rejected first.
+  [[nodiscard]] std::vector<struct sock_filter> BuildFilter(
+      uint8_t protocol, const std::vector<FieldRange> &quoted,
+      uint8_t direct_type = 0,
+      const std::vector<FieldRange> &direct = {}) const {
+    constexpr uint32_t kAccept = UINT32_MAX, kReject = 0;
+    constexpr uint32_t kIcmpHeaderSize = 8, kProtocolOffset = 9;
+    constexpr uint32_t kSourceOffset = 12, kDestinationOffset = 16;
+    std::vector<struct sock_filter> program;
+    // Jumps to the final `ret #0`, patched once its position is known; the
+    // flag tells whether it is taken if the condition holds.
+    std::vector<std::pair<size_t, bool>> rejects;
+    auto match = [&](uint32_t base, const std::vector<FieldRange> &ranges) {
+      for (const auto &range : ranges) {
+        program.push_back(
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, base + range.offset));
+        rejects.emplace_back(program.size(), false);
+        program.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, range.low, 0, 0));
+        rejects.emplace_back(program.size(), true);
+        program.push_back(
+            BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, range.high, 0, 0));
+      }
+      program.push_back(BPF_STMT(BPF_RET | BPF_K, kAccept));
+    };
+    // Reject unless the address loaded by `mode` from `offset` is of the
+    // shard, folded as `ShardOf()` does. X is kept in M[0] meanwhile.
+    auto in_shard = [&](uint16_t mode, uint32_t offset) {
+      if (shard_.count <= 1) return;
+      program.push_back(BPF_STMT(BPF_STX, 0));
+      program.push_back(BPF_STMT(BPF_LD | BPF_W | mode, offset));
+      for (uint32_t shift : {16, 8}) {
+        program.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+        program.push_back(BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, shift));
+        program.push_back(BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0));
+      }
+      program.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shard_.count));
+      program.push_back(BPF_STMT(BPF_LDX | BPF_MEM, 0));
+      rejects.emplace_back(program.size(), false);
+      program.push_back(
+          BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, shard_.index, 0, 0));
+    };
+
+    if (ring_) {
+      program.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, kProtocolOffset));
+      rejects.emplace_back(program.size(), false);
+      program.push_back(
+          BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 0));
+    }
+    // X = the offset of the ICMP header
+    program.push_back(BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0));
+    program.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0));
+    size_t to_quoted = program.size();
+    program.push_back(
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, icmp::kTimeExceed, 0, 0));
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                               icmp::kDestinationUnreachable, 0, 0));
+    if (direct.empty()) {
+      program.push_back(BPF_STMT(BPF_RET | BPF_K, kReject));
+    } else {
+      rejects.emplace_back(program.size(), false);
+      program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, direct_type, 0, 0));
+      // Direct replies come from the destination.
+      in_shard(BPF_ABS, kSourceOffset);
+      match(0, direct);
+    }
+    auto quoted_start = static_cast<uint8_t>(program.size());
+    program[to_quoted].jt = static_cast<uint8_t>(quoted_start - to_quoted - 1);
+    program[to_quoted + 1].jt =
+        static_cast<uint8_t>(quoted_start - to_quoted - 2);
+    program.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_IND,
+                               kIcmpHeaderSize + kProtocolOffset));
+    rejects.emplace_back(program.size(), false);
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, protocol, 0, 0));
+    in_shard(BPF_IND, kIcmpHeaderSize + kDestinationOffset);
+    // X += 8 + the length of the quoted IP header
+    program.push_back(
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, kIcmpHeaderSize));
+    program.push_back(
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, kIpHeaderLengthMask));
+    program.push_back(BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2));
+    program.push_back(BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0));
+    program.push_back(
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, kIcmpHeaderSize));
+    program.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+    match(0, quoted);
+
+    size_t reject = program.size();
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kReject));
+    assert(reject <= UINT8_MAX && "Filter too long for its jumps.");
+    for (auto [index, taken] : rejects) {
+      auto offset = static_cast<uint8_t>(reject - index - 1);
+      (taken ? program[index].jt : program[index].jf) = offset;
+    }
+    return program;
+  }
+
+  /// Have the kernel drop every ICMP message `program` rejects before it
+  /// reaches `recv_fd_`, and have a `ring_` receive from now on.
+  void AttachFilter(std::vector<struct sock_filter> program) {
+    struct sock_fprog fprog {};
+    fprog.len = static_cast<unsigned short>(program.size());
+    fprog.filter = program.data();
+    if (setsockopt(recv_fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                   sizeof(fprog)) < 0)
+      Fail("setsockopt(filter)");
+    if (ring_) ring_->Bind();
+    // Messages queued before the filter was attached were not checked, but
+    // the parser still ignores unrelated ones.
+    icmp_in_base_ = ReadIcmpInMsgs();
+  }
+
+  /// The number of ICMP messages received by the host (or rather, its
+  /// network namespace), all of which a raw ICMP socket would see without a
+  /// filter.
+  static std::optional<uint64_t> ReadIcmpInMsgs() {
+    std::ifstream snmp("/proc/net/snmp");
+    std::string header, values;
+    while (std::getline(snmp, header) && std::getline(snmp, values)) {
+      if (header.rfind("Icmp: ", 0) != 0) continue;
+      std::istringstream names(header), numbers(values);
+      std::string name, number;
+      while (names >> name && numbers >> number) {
+        if (name == "InMsgs") return std::stoull(number);
+      }
+    }
+    return std::nullopt;
+  }
+
+  /// Ask for kernel (and, where the NIC supports it, hardware) receive
+  /// timestamps on `fd`, or send timestamps if `send` is set.
+  static bool EnableTimestamps(int fd, bool send) {
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    flags |= send ? SOF_TIMESTAMPING_TX_SOFTWARE |
+                        SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_OPT_ID |
+                        SOF_TIMESTAMPING_OPT_TSONLY
+                  : SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+      return true;
+    if (send) return false;
+    int enable = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                      sizeof(enable)) == 0;
+  }
+
+  /// Enable send timestamps on `send_fd_`, to be called once it is open.
+  void EnableSendTimestamps() {
+    send_timestamps_ = EnableTimestamps(send_fd_, true);
+    if (!send_timestamps_) return;
+    sent_ring_.resize(kSentRingSize);
+    if (recorder_) sent_packets_.resize(kSentRingSize);
+    // Timestamps are reported through the error queue, signalled by
+    // EPOLLERR, which needs no explicit subscription.
+    if (!uring_) Watch(send_fd_, 0);
+  }
+
+  /// Read the send timestamps queued on the error queue of `send_fd_`.
+  void DrainSendTimestamps(std::vector<SendStamp> &sent) {
+    if (!send_timestamps_) return;
+    while (true) {
+      for (auto &msg : recv_msgs_) {
+        msg.msg_hdr.msg_iovlen = 0;
+        msg.msg_hdr.msg_controllen = kControlSize;
+      }
+      int received = recvmmsg(send_fd_, recv_msgs_.data(), kBatchSize,
+                              MSG_ERRQUEUE | MSG_DONTWAIT, nullptr);
+      metrics_.syscalls[EngineMetrics::RECEIVE_ERRQUEUE].Add();
+      for (auto &msg : recv_msgs_) msg.msg_hdr.msg_iovlen = 1;
+      if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        Fail("recvmmsg(errqueue)");
+      }
+      for (int i = 0; i < received; ++i) {
+        auto &msg = recv_msgs_[i].msg_hdr;
+        Timestamp stamp{};
+        std::optional<uint32_t> key;
+        for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+          if (clock_.Parse(cmsg, stamp)) continue;
+          if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+            struct sock_extended_err error {};
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+            if (error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+              key = error.ee_data;
+          }
+        }
+        // A later timestamp (e.g. from hardware) only adds to the first.
+        // Keys run from `next_sent_ - kSentRingSize` to `next_sent_ - 1`;
+        // one not numbered yet would find the slot of an older probe.
+        if (key && next_sent_ - *key - 1 < kSentRingSize) {
+          sent.push_back({sent_ring_[*key & (kSentRingSize - 1)], stamp});
+          if (recorder_) RecordSent(*key, stamp);
+        }
+      }
+      if (static_cast<size_t>(received) < kBatchSize) return;
+    }
+  }
+
+  /// Make room for bursts of replies on `fd`, beyond `rmem_max` if we may.
+  static void GrowReceiveBuffer(int fd) {
+    int size = kReceiveBufferSize;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+
+  void Watch(int fd, uint32_t events) const {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+      Fail("epoll_ctl");
+  }
+
+  /// Queue a datagram of `size` bytes to be sent to `addr` with the TTL of
+  /// `id` by the next `Flush()`, and return where to write it.
+  uint8_t *QueueDatagram(size_t size, const struct sockaddr_in &addr,
+                         const ProbeId &id) {
+    assert(size <= kMaxDatagramSize && "Datagram too large.");
+    if (queued_ == kBatchSize) Flush();
+    // Sends in flight still read their datagrams.
+    if (queued_ == 0 && sends_in_flight_ > 0) SettleSends();
+    auto &datagram = datagrams_[queued_];
+    auto &msg = send_msgs_[queued_].msg_hdr;
+    datagram.id = id;
+    datagram.addr = addr;
+    datagram.iov.iov_base = datagram.data.data();
+    datagram.iov.iov_len = size;
+    msg = {};
+    msg.msg_name = &datagram.addr;
+    msg.msg_namelen = sizeof(datagram.addr);
+    msg.msg_iov = &datagram.iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = datagram.control.data();
+    msg.msg_controllen = datagram.control.size();
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_TTL;
+    int ttl = id.ttl;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(ttl));
+    memcpy(CMSG_DATA(cmsg), &ttl, sizeof(ttl));
+    queued_++;
+    return datagram.data.data();
+  }
+
+  /// The address the kernel sends from towards `destination`.
+  const struct sockaddr_in &SourceFor(const struct sockaddr_in &destination) {
+    auto [iter, inserted] =
+        sources_.try_emplace(destination.sin_addr.s_addr, sockaddr_in{});
+    // A replay knows the sources of the recording only.
+    if (!inserted || replay_) return iter->second;
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) Fail("socket");
+    struct sockaddr_in route = destination;
+    route.sin_port = htons(kInitialPort);
+    socklen_t len = sizeof(iter->second);
+    // Connecting a datagram socket only looks up the route.
+    if (connect(fd, reinterpret_cast<const struct sockaddr *>(&route),
+                sizeof(route)) == 0)
+      getsockname(fd, reinterpret_cast<struct sockaddr *>(&iter->second), &len);
+    close(fd);
+    return iter->second;
+  }
+
+  [[nodiscard]] Client &Self() { return static_cast<Client &>(*this); }
+  [[nodiscard]] const Client &Self() const {
+    return static_cast<const Client &>(*this);
+  }
+
+  /// Record a packet received, starting with its IP header, and collect it
+  /// if it answers one of our probes.
+  void HandlePacket(PacketView packet, const Timestamp &recv_time,
+                    std::vector<ProbeResult> &replies) {
+    if (recorder_) recorder_->Write(false, packet, recv_time);
+    if (auto reply = Self().MatchReply(packet, recv_time))
+      replies.push_back(*reply);
+  }
+
+  /// Parse one ICMP packet into the reply to one of our probes, if it is
+  /// one, with `Client::Match`, which recovers the tag (see `ProbeId`) of
+  /// a probe from an error quoting it or a direct reply (e.g., an echo
+  /// reply).
+  [[nodiscard]] std::optional<ProbeResult> MatchReply(
+      PacketView packet, const Timestamp &recv_time) const {
+    auto view = ICMPView::Parse(packet);
+    if (!view) return std::nullopt;
+    auto tag = Self().Match(*view);
+    if (!tag) return std::nullopt;
+    ICMPStatus status = DESTINATION_REACHED;
+    struct in_addr destination = view->ip.Source();
+    if (view->IsError()) {
+      status = view->type == icmp::kTimeExceed ? TTL_EXPIRED
+                                               : UnreachableStatus(view->code);
+      destination = view->quoted->Destination();
+    }
+    return ProbeResult{ProbeId::FromTag(destination, *tag), view->ip.Source(),
+                       status, recv_time, view->mpls};
+  }
+
+  /// Drain the (non-blocking) raw socket `fd`, a batch at a time, passing
+  /// every packet to `handle` with its receive time, as `PacketRing` does.
+  template <typename Fn>
+  void Drain(int fd, Fn &&handle) {
+    while (true) {
+      for (auto &msg : recv_msgs_) msg.msg_hdr.msg_controllen = kControlSize;
+      int received =
+          recvmmsg(fd, recv_msgs_.data(), kBatchSize, MSG_DONTWAIT, nullptr);
+      metrics_.syscalls[EngineMetrics::RECEIVE].Add();
+      if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        Fail("recvmmsg");
+      }
+      auto now = Timestamp::Now();
+      for (int i = 0; i < received; ++i) {
+        auto &msg = recv_msgs_[i].msg_hdr;
+        Timestamp recv_time = now;
+        for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+          clock_.Parse(cmsg, recv_time);
+        handle(PacketView(recv_buffers_[i].data.data(), recv_msgs_[i].msg_len),
+               recv_time);
+      }
+      if (static_cast<size_t>(received) < kBatchSize) return;
+    }
+  }
+
+  /// Drain the receive socket and collect every reply matching a probe.
+  void DrainICMP(std::vector<ProbeResult> &replies) {
+    size_t matched = replies.size(), seen = 0;
+    auto handle = [&](PacketView packet, const Timestamp &recv_time) {
+      seen++;
+      HandlePacket(packet, recv_time, replies);
+    };
+    if (ring_) {
+      ring_->Drain(clock_, handle);
+    } else {
+      Drain(recv_fd_, handle);
+    }
+    metrics_.icmp_received.Add(seen);
+    metrics_.icmp_stray.Add(seen - (replies.size() - matched));
+  }
+
+  /// Parse a reply that `uring_` received into its buffer `id` as
+  /// `IORING_OP_RECVMSG` lays it out, of `size` bytes in all.
+  void HandleReceived(uint16_t id, size_t size,
+                      std::vector<ProbeResult> &replies) {
+    const uint8_t *buffer = uring_->Buffer(id);
+    struct io_uring_recvmsg_out out {};
+    memcpy(&out, buffer, sizeof(out));
+    // No name was asked for.
+    const uint8_t *control = buffer + sizeof(out);
+    const uint8_t *payload = control + uring_recv_.msg_controllen;
+    size_t length = std::min<size_t>(
+        out.payloadlen,
+        size - std::min<size_t>(size, static_cast<size_t>(payload - buffer)));
+    struct msghdr msg {};
+    msg.msg_control = const_cast<uint8_t *>(control);
+    msg.msg_controllen = out.controllen;
+    Timestamp recv_time = Timestamp::Now();
+    for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+      clock_.Parse(cmsg, recv_time);
+    HandlePacket({payload, length}, recv_time, replies);
+  }
+
+  /// Wait until the kernel is done with every datagram of `uring_` in
+  /// flight, so that they can be queued again.
+  void SettleSends() {
+    while (sends_in_flight_ > 0) {
+      uring_->Enter(1, -1);
+      metrics_.syscalls[EngineMetrics::ENTER].Add();
+      Complete(pending_);
+    }
+  }
+
+  /// Handle every completion of `uring_`.
+  void Complete(Events &events) {
+    size_t matched = events.replies.size();
+    bool stamps = false;
+    auto reaped = ClockType::now();
+    uring_->Reap([&](const struct io_uring_cqe &cqe) {
+      bool more = cqe.flags & IORING_CQE_F_MORE;
+      switch (cqe.user_data & kCompletionMask) {
+        case SENT:
+          sends_in_flight_--;
+          // As `Flush()` without the ring.
+          if (cqe.res < 0 && cqe.res != -EHOSTUNREACH &&
+              cqe.res != -ENETUNREACH) {
+            errno = -cqe.res;
+            Fail("sendmsg");
+          }
+          // Datagrams complete in the order they were sent, which the
+          // timestamp keys count.
+          if (cqe.res >= 0)
+            Number(datagrams_[cqe.user_data >> kCompletionBits], reaped);
+          break;
+        case RECEIVED:
+          if (!more) receiving_ = false;
+          if (cqe.res < 0) {
+            // Out of buffers, which are given back before it is re-armed.
+            if (cqe.res != -ENOBUFS) {
+              errno = -cqe.res;
+              Fail("recvmsg");
+            }
+            break;
+          }
+          // The send timestamp of a probe is queued before its reply can
+          // arrive; collect it first, so the two are seen in order.
+          stamps = true;
+          uring_received_.emplace_back(
+              static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT),
+              static_cast<size_t>(cqe.res));
+          break;
+        case SEND_ERRORS:
+          if (!more) polling_errors_ = false;
+          stamps = true;
+          break;
+        case WATCHES:
+          if (!more) polling_watches_ = false;
+          watches_ready_ = true;
+          break;
+      }
+    });
+    // Only once every send of the batch is numbered: the kernel queues the
+    // timestamp of a datagram, and may post the poll for it, before the
+    // completion of its send, whose key would not be known yet.
+    if (stamps) DrainSendTimestamps(events.sent);
+    for (auto [id, size] : uring_received_) {
+      HandleReceived(id, size, events.replies);
+      uring_->ReturnBuffer(id);
+    }
+    size_t seen = uring_received_.size();
+    uring_received_.clear();
+    uring_->PublishBuffers();
+    metrics_.icmp_received.Add(seen);
+    metrics_.icmp_stray.Add(seen - (events.replies.size() - matched));
+  }
+
+  /// Arm the multishot requests of `uring_` that have ended.
+  void Arm() {
+    if (!receiving_ && !ring_) {
+      auto &sqe = uring_->Prepare();
+      sqe.opcode = IORING_OP_RECVMSG;
+      sqe.fd = recv_fd_;
+      sqe.addr = reinterpret_cast<uint64_t>(&uring_recv_);
+      sqe.ioprio = IORING_RECV_MULTISHOT;
+      IoUring::SelectBuffer(sqe);
+      sqe.user_data = RECEIVED;
+      receiving_ = true;
+    }
+    if (!polling_errors_ && send_timestamps_) {
+      PollAdd(send_fd_, POLLERR, SEND_ERRORS);
+      polling_errors_ = true;
+    }
+    if (!polling_watches_) {
+      PollAdd(epoll_fd_, POLLIN, WATCHES);
+      polling_watches_ = true;
+    }
+  }
+
+  void PollAdd(int fd, uint32_t events, Completion completion) {
+    auto &sqe = uring_->Prepare();
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = fd;
+    sqe.poll32_events = events;
+    sqe.len = IORING_POLL_ADD_MULTI;
+    sqe.user_data = completion;
+  }
+
+  /// Collect what the epoll set has ready right away.
+  void PollWatches(Events &result) {
+    std::array<epoll_event, 64> events{};
+    int num_events = epoll_wait(epoll_fd_, events.data(),
+                                static_cast<int>(events.size()), 0);
+    metrics_.syscalls[EngineMetrics::WAIT].Add();
+    if (num_events < 0) {
+      if (errno == EINTR) return;
+      Fail("epoll_wait");
+    }
+    // As without the ring, whatever is still ready once handled is seen
+    // again.
+    watches_ready_ = num_events > 0;
+    for (int i = 0; i < num_events; ++i) Dispatch(events[i].data.fd, result);
+  }
+
+  /// Collect the events of the watched descriptor `fd`, which is ready.
+  void Dispatch(int fd, Events &result) {
+    if (fd == recv_fd_) {
+      // The send timestamp of a probe is queued before its reply can
+      // arrive; collect it first, so the two are seen in order.
+      DrainSendTimestamps(result.sent);
+      DrainICMP(result.replies);
+    } else if (fd == send_fd_) {
+      DrainSendTimestamps(result.sent);
+    } else if (std::find(external_fds_.begin(), external_fds_.end(), fd) !=
+               external_fds_.end()) {
+      result.ready.push_back(fd);
+    } else {
+      Self().OnReady(fd, result.replies);
+    }
+  }
+
+  /// Write the transport header the kernel puts in front of `datagram` sent
+  /// from `source` to `header`, if any, and return its size.
+  size_t TransportHeader(const Datagram & /*datagram*/,
+                         const struct sockaddr_in & /*source*/,
+                         uint8_t * /*header*/) const {
+    return 0;
+  }
+
+  /// Write `datagram` to `packet` as the IP packet the kernel makes of it,
+  /// and return its size.
+  size_t EncodeSent(const Datagram &datagram,
+                    std::array<uint8_t, kMaxPacketSize> &packet) {
+    constexpr size_t kIpHeaderSize = 20;
+    constexpr size_t kLengthOffset = 2, kTtlOffset = 8, kProtocolOffset = 9,
+                     kChecksumOffset = 10, kSourceOffset = 12,
+                     kDestinationOffset = 16;
+    packet = {};
+    const auto &source = SourceFor(datagram.addr);
+    size_t size = kIpHeaderSize;
+    size += Self().TransportHeader(datagram, source, packet.data() + size);
+    memcpy(packet.data() + size, datagram.data.data(), datagram.iov.iov_len);
+    size += datagram.iov.iov_len;
+    packet[0] = 0x45;  // Version 4, without options
+    Store16(&packet[kLengthOffset], static_cast<uint16_t>(size));
+    packet[kTtlOffset] = datagram.id.ttl;
+    packet[kProtocolOffset] = Client::kProtocol;
+    memcpy(&packet[kSourceOffset], &source.sin_addr, sizeof(source.sin_addr));
+    memcpy(&packet[kDestinationOffset], &datagram.addr.sin_addr,
+           sizeof(datagram.addr.sin_addr));
+    Store16(&packet[kChecksumOffset],
+            ChecksumFold(ChecksumAdd(packet.data(), kIpHeaderSize)));
+    return size;
+  }
+
+  /// Number `datagram`, which the kernel took by `now`, as its send
+  /// timestamp will be, and record it once that timestamp arrives, or right
+  /// away without one.
+  void Number(const Datagram &datagram, TimePoint now) {
+    if (recorder_ && !send_timestamps_) {
+      std::array<uint8_t, kMaxPacketSize> packet;
+      recorder_->Write(true, {packet.data(), EncodeSent(datagram, packet)},
+                       {now, USERSPACE, {}});
+    }
+    if (!send_timestamps_) return;
+    size_t index = next_sent_++ & (kSentRingSize - 1);
+    sent_ring_[index] = datagram.id;
+    if (recorder_) {
+      auto &packet = sent_packets_[index];
+      packet.size = EncodeSent(datagram, packet.data);
+    }
+  }
+
+  /// Record the probe numbered `key`, unless it already is, as sent at
+  /// `send_time`.
+  void RecordSent(uint32_t key, const Timestamp &send_time) {
+    auto &packet = sent_packets_[key & (kSentRingSize - 1)];
+    if (packet.size == 0) return;
+    recorder_->Write(true, {packet.data.data(), packet.size}, send_time);
+    packet.size = 0;
+  }
+
+  /// The transport header of the first probe of the replay over `protocol`.
+  [[nodiscard]] PacketView RecordedProbe(uint8_t protocol) const {
+    auto probe = replay_->FirstSent(protocol);
+    if (!probe || probe->Size() < ICMPView::kMinQuotedSize) {
+      errno = EINVAL;
+      Fail("replay: no probes of this mode");
+    }
+    return *probe;
+  }
+
+  /// Sort the packets of the replay by the probes they are about, as our
+  /// matchers see them. A probe is matched as a router would quote it.
+  void IndexReplay() {
+    replay_->Index([&](const Replay::Packet &packet) {
+      std::optional<uint64_t> key;
+      auto view = packet.View();
+      auto ip = IPv4View::Parse(view);
+      if (!ip) return key;
+      if (!packet.sent) {
+        if (auto reply = Self().MatchReply(view, {}))
+          key = reply->id.Key();
+        return key;
+      }
+      // Checksums of probes cover the source they were sent from.
+      struct sockaddr_in source {};
+      source.sin_family = AF_INET;
+      source.sin_addr = ip->Source();
+      sources_.try_emplace(ip->Destination().s_addr, source);
+      auto transport = ip->Payload().From(0, ICMPView::kMinQuotedSize);
+      if (!transport) return key;
+      ICMPView quote{*ip, icmp::kTimeExceed, 0, {}, ip, *transport, {}};
+      if (auto tag = Self().Match(quote))
+        key = ProbeId::FromTag(ip->Destination(), *tag).Key();
+      return key;
+    });
+    replay_indexed_ = true;
+  }
+
+  /// Collect the packets of the replay that are due.
+  void ReceiveReplayed(std::vector<ProbeResult> &replies) {
+    replay_->Receive(ClockType::now(), [&](PacketView packet,
+                                           const Timestamp &recv_time) {
+      auto ip = IPv4View::Parse(packet);
+      bool tcp = ip && ip->Protocol() == IPPROTO_TCP;
+      size_t matched = replies.size();
+      HandlePacket(packet, recv_time, replies);
+      (tcp ? metrics_.tcp_received : metrics_.icmp_received).Add();
+      if (replies.size() == matched)
+        (tcp ? metrics_.tcp_stray : metrics_.icmp_stray).Add();
+    });
+  }
+
+  /// Called when a watched descriptor other than the receive socket is ready.
+  void OnReady(int /*fd*/, std::vector<ProbeResult> & /*replies*/) {}
+
+  /// Close `fd` along with the client, and return it.
+  int Own(int fd) {
+    if (fd >= 0) owned_fds_.push_back(fd);
+    return fd;
+  }
+
+  TraceRouteClient() {
+    for (size_t i = 0; i < kBatchSize; ++i) {
+      auto &buffer = recv_buffers_[i];
+      buffer.iov.iov_base = buffer.data.data();
+      buffer.iov.iov_len = buffer.data.size();
+      auto &msg = recv_msgs_[i].msg_hdr;
+      msg.msg_iov = &buffer.iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = buffer.control.data();
+    }
+  }
+
+ public:
+  // XXX(wp): Probably implement these later?
+  TraceRouteClient(const TraceRouteClient &other) = delete;
+  TraceRouteClient(TraceRouteClient &&other) = delete;
+  TraceRouteClient &operator=(const TraceRouteClient &other) = delete;
+  TraceRouteClient &operator=(TraceRouteClient &&other) = delete;
+
+  /// Sockets are opened once the client is constructed as far as to close
+  /// them again, should one of them fail.
+  TraceRouteClient(int domain, int type, int protocol, const Options &options)
+      : TraceRouteClient() {
+    shard_ = {static_cast<uint32_t>(options.shard),
+              static_cast<uint32_t>(options.shards)};
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) Fail("epoll_create1");
+    if (!options.record_file.empty()) recorder_.emplace(options.record_file);
+    if (!options.replay_file.empty()) {
+      replay_.emplace(options.replay_file, options.replay_timing);
+      return;
+    }
+    if (options.packet_ring) {
+      try {
+        ring_.emplace();
+        recv_fd_ = ring_->Fd();
+      } catch (const Error &) {
+        // Without TPACKET_V3, the raw socket will do.
+      }
+    }
+    if (!ring_) {
+      recv_fd_ = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+      if (recv_fd_ == -1) Fail("socket");
+      EnableTimestamps(recv_fd_, false);
+      GrowReceiveBuffer(recv_fd_);
+    }
+    if (options.io_uring) {
+      try {
+        uring_.emplace(kUringBuffers, kUringBufferSize);
+        uring_recv_.msg_controllen = kControlSize;
+        uring_received_.reserve(kUringBuffers);
+      } catch (const Error &) {
+        // Without multishot receives into buffer rings, epoll will do.
+        uring_.reset();
+      }
+    }
+    // A packet ring is still drained through epoll.
+    if (!uring_ || ring_) Watch(recv_fd_, EPOLLIN);
+    send_fd_ = socket(domain, type, protocol);
+    if (send_fd_ == -1) Fail("socket");
+    if (type == SOCK_RAW) {
+      // A raw socket receives a copy of every packet of its protocol, which
+      // would fill its buffer and crowd out the send timestamps.
+      std::array<struct sock_filter, 1> drop{{BPF_STMT(BPF_RET | BPF_K, 0)}};
+      struct sock_fprog fprog {};
+      fprog.len = drop.size();
+      fprog.filter = drop.data();
+      if (setsockopt(send_fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                     sizeof(fprog)) < 0)
+        Fail("setsockopt(filter)");
+    }
+    // Send timestamps are charged to the receive buffer.
+    GrowReceiveBuffer(send_fd_);
+    EnableSendTimestamps();
+  }
+
+  ~TraceRouteClient() {
+    for (int fd : owned_fds_) close(fd);
+    for (int fd : {send_fd_, ring_ ? -1 : recv_fd_, epoll_fd_}) {
+      if (fd >= 0) close(fd);
+    }
+  }
+
+  /// Send every queued datagram, or with `uring_`, have it sent by the next
+  /// `Poll`.
+  void Flush() {
+    if (replay_) {
+      // The recording answers instead of the network.
+      if (!replay_indexed_) IndexReplay();
+      auto now = ClockType::now();
+      for (size_t i = 0; i < queued_; ++i) {
+        Number(datagrams_[i], now);
+        pending_.sent.push_back({datagrams_[i].id, {now, SOFTWARE, {}}});
+        if (replay_->Send(datagrams_[i].id.Key(), now))
+          pending_.lost.push_back(datagrams_[i].id);
+      }
+      queued_ = 0;
+      return;
+    }
+    if (uring_) {
+      for (size_t i = 0; i < queued_; ++i) {
+        auto &sqe = uring_->Prepare();
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = send_fd_;
+        sqe.addr = reinterpret_cast<uint64_t>(&send_msgs_[i].msg_hdr);
+        sqe.len = 1;
+        sqe.user_data = SENT | i << kCompletionBits;
+      }
+      sends_in_flight_ += queued_;
+      queued_ = 0;
+      return;
+    }
+    size_t sent = 0;
+    while (sent < queued_) {
+      int ret = sendmmsg(send_fd_, send_msgs_.data() + sent,
+                         static_cast<unsigned int>(queued_ - sent), 0);
+      metrics_.syscalls[EngineMetrics::SEND].Add();
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        // The destination is unroutable; its probe is lost and will time
+        // out, but the rest of the batch still has to go.
+        if (errno == EHOSTUNREACH || errno == ENETUNREACH) {
+          sent++;
+          continue;
+        }
+        Fail("sendmmsg");
+      }
+      auto now = ClockType::now();
+      for (size_t i = sent; i < sent + static_cast<size_t>(ret); ++i)
+        Number(datagrams_[i], now);
+      sent += static_cast<size_t>(ret);
+    }
+    queued_ = 0;
+  }
+
+  /// The receive counters so far.
+  [[nodiscard]] ReceiveStats Stats() const {
+    ReceiveStats stats;
+    stats.seen = metrics_.icmp_received.Get();
+    stats.matched = stats.seen - metrics_.icmp_stray.Get();
+    stats.packet_ring = ring_.has_value();
+    stats.io_uring = uring_.has_value();
+    stats.replay = replay_.has_value();
+    auto icmp_in = ReadIcmpInMsgs();
+    if (icmp_in_base_ && icmp_in) {
+      uint64_t total = *icmp_in - *icmp_in_base_;
+      stats.rejected = total > stats.seen ? total - stats.seen : 0;
+    }
+    return stats;
+  }
+
+  /// The counters of the probing engine, which the event loop adds to.
+  [[nodiscard]] EngineMetrics &Metrics() { return metrics_; }
+
+  /// Print every metric in the Prometheus text format.
+  void WriteMetrics(std::ostream &out) const {
+    metrics_.Write(out);
+    if (auto rejected = Stats().rejected) {
+      out << "# HELP traceroute_packets_filtered_total ICMP messages dropped "
+             "by the socket filter.\n"
+             "# TYPE traceroute_packets_filtered_total counter\n"
+             "traceroute_packets_filtered_total "
+          << *rejected << "\n";
+    }
+  }
+
+  /// Have `Poll` also wait for `fd` to become readable, or whatever
+  /// `events` say.
+  void AddWatch(int fd, uint32_t events = EPOLLIN) {
+    Watch(fd, events);
+    external_fds_.push_back(fd);
+  }
+
+  /// Wait for `events` on `fd`, added before, from now on.
+  void ModifyWatch(int fd, uint32_t events) const {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) < 0)
+      Fail("epoll_ctl");
+  }
+
+  /// Readable when `Poll` would return something, unless `Pending()`.
+  [[nodiscard]] int Fd() const { return uring_ ? uring_->Fd() : epoll_fd_; }
+
+  /// Whether `Poll` has something to return without waiting.
+  [[nodiscard]] bool Pending() const {
+    return watches_ready_ || !pending_.sent.empty() ||
+           !pending_.replies.empty() || !pending_.ready.empty() ||
+           !pending_.lost.empty();
+  }
+
+  /// When `Poll` has something to return without `Fd()` becoming readable,
+  /// if it will.
+  [[nodiscard]] std::optional<TimePoint> Due() const {
+    if (Pending()) return ClockType::now();
+    if (replay_) return replay_->NextDue();
+    return std::nullopt;
+  }
+
+  /// Stop waiting for `fd`, before it is closed.
+  void RemoveWatch(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    external_fds_.erase(
+        std::remove(external_fds_.begin(), external_fds_.end(), fd),
+        external_fds_.end());
+  }
+
+  /// Wait for at most `timeout_ms` milliseconds and return the send
+  /// timestamps and replies received in the meantime, until the next `Poll`.
+  [[nodiscard]] Events &Poll(int timeout_ms) {
+    if (Pending()) timeout_ms = 0;
+    clock_.Refresh();
+    // Swapped rather than moved, so that neither gives up its buffers.
+    Events &result = events_;
+    result.Clear();
+    std::swap(result, pending_);
+    if (uring_) {
+      PollRing(timeout_ms, result);
+      return result;
+    }
+    if (replay_) {
+      if (!replay_indexed_) IndexReplay();
+      if (auto due = replay_->NextDue()) {
+        auto until = static_cast<int>(std::max<int64_t>(
+            0, std::chrono::ceil<std::chrono::milliseconds>(
+                   *due - ClockType::now())
+                   .count()));
+        timeout_ms = timeout_ms < 0 ? until : std::min(timeout_ms, until);
+      }
+    }
+    std::array<epoll_event, 64> events{};
+    int num_events = epoll_wait(epoll_fd_, events.data(),
+                                static_cast<int>(events.size()), timeout_ms);
+    metrics_.syscalls[EngineMetrics::WAIT].Add();
+    if (num_events < 0) {
+      if (errno == EINTR) return result;
+      Fail("epoll_wait");
+    }
+    for (int i = 0; i < num_events; ++i) Dispatch(events[i].data.fd, result);
+    if (replay_) ReceiveReplayed(result.replies);
+    return result;
+  }
+
+  /// `Poll` through `uring_`: submit the sends flushed since, and wait for
+  /// completions in the same system call.
+  void PollRing(int timeout_ms, Events &result) {
+    if (watches_ready_) {
+      PollWatches(result);
+      if (watches_ready_) timeout_ms = 0;
+    }
+    Arm();
+    uring_->Enter(timeout_ms == 0 ? 0 : 1, timeout_ms);
+    metrics_.syscalls[EngineMetrics::ENTER].Add();
+    Complete(result);
+    if (watches_ready_) PollWatches(result);
+    // What ended is re-armed right away, so that `Fd()` tells the truth.
+    Arm();
+    if (uring_->Unsubmitted() > 0) {
+      uring_->Enter(0, 0);
+      metrics_.syscalls[EngineMetrics::ENTER].Add();
+    }
+  }
+};
+
+/// Sends SYNs built by hand through a raw socket, so that probes are batched
+/// and timestamped like those of the other modes. The probe tag is carried
+/// in the low bits of the sequence number, where ICMP errors quote it and
+/// the SYN-ACK or RST of the destination acknowledges it; the high bits are
+/// random, so that stray segments are not mistaken for replies. Replies
+/// from the destination arrive on a second raw socket, filtered by port.
+class TCPClient : public TraceRouteClient<TCPClient> {
+  friend TraceRouteClient;
+
+  static constexpr int kTagBits = 16;
+
+  uint16_t port_;
+  uint16_t source_port_{};
+  uint32_t key_;
+  // Holds on to `source_port_`. As it does not listen, the kernel answers
+  // SYN-ACKs with a RST, tearing down the half-open connection.
+  int port_fd_{-1};
+  int tcp_fd_{-1};
+
+  [[nodiscard]] std::optional<uint16_t> Match(const ICMPView &view) const {
+    return traceroute::MatchTCP(view, source_port_, port_, key_, kTagBits);
+  }
+
+  /// Also match a SYN-ACK or RST from the destination.
+  [[nodiscard]] std::optional<ProbeResult> MatchReply(
+      PacketView packet, const Timestamp &recv_time) const {
+    auto ip = IPv4View::Parse(packet);
+    if (!ip || ip->Protocol() != IPPROTO_TCP)
+      return TraceRouteClient::MatchReply(packet, recv_time);
+    auto tag = traceroute::MatchTCPReply(packet, source_port_, port_, key_,
+                                         kTagBits);
+    if (!tag) return std::nullopt;
+    return ProbeResult{ProbeId::FromTag(ip->Source(), *tag), ip->Source(),
+                       DESTINATION_REACHED, recv_time, {}};
+  }
+
+  void OnReady(int fd, std::vector<ProbeResult> &replies) {
+    if (fd != tcp_fd_) return;
+    size_t matched = replies.size(), seen = 0;
+    Drain(tcp_fd_, [&](PacketView packet, const Timestamp &recv_time) {
+      seen++;
+      HandlePacket(packet, recv_time, replies);
+    });
+    metrics_.tcp_received.Add(seen);
+    metrics_.tcp_stray.Add(seen - (replies.size() - matched));
+  }
+
+ public:
+  explicit TCPClient(const Options &options)
+      : TraceRouteClient(AF_INET, SOCK_RAW, IPPROTO_TCP, options),
+        port_(static_cast<uint16_t>(options.port)),
+        key_(std::random_device{}() >> kTagBits) {
+    if (replay_) {
+      // As the probes of the recording.
+      auto probe = RecordedProbe(IPPROTO_TCP);
+      source_port_ = probe.U16(0);
+      port_ = probe.U16(2);
+      key_ = probe.U32(4) >> kTagBits;
+      return;
+    }
+    port_fd_ = Own(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    if (port_fd_ < 0) Fail("socket");
+    struct sockaddr_in bind_addr {};
+    bind_addr.sin_family = AF_INET;
+    if (bind(port_fd_, reinterpret_cast<const struct sockaddr *>(&bind_addr),
+             sizeof(bind_addr)) < 0)
+      Fail("bind");
+    socklen_t len = sizeof(bind_addr);
+    if (getsockname(port_fd_, reinterpret_cast<struct sockaddr *>(&bind_addr),
+                    &len) < 0)
+      Fail("getsockname");
+    source_port_ = ntohs(bind_addr.sin_port);
+
+    constexpr uint32_t kSourcePort = 0, kDestinationPort = 2, kSeqHigh = 4;
+    // The tag fills the low half of the sequence number and the key the high.
+    static_assert(kTagBits == 16, "Expecting the tag in the low half.");
+    auto seq_high = static_cast<uint16_t>(key_);
+    AttachFilter(BuildFilter(IPPROTO_TCP,
+                             {{kSourcePort, source_port_, source_port_},
+                              {kDestinationPort, port_, port_},
+                              {kSeqHigh, seq_high, seq_high}}));
+
+    // A raw TCP socket receives every TCP segment; only keep those from the
+    // probed port to ours.
+    tcp_fd_ = Own(socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_TCP));
+    if (tcp_fd_ < 0) Fail("socket");
+    std::array<struct sock_filter, 7> program{{
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, kSourcePort),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port_, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, kDestinationPort),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, source_port_, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    }};
+    struct sock_fprog fprog {};
+    fprog.len = program.size();
+    fprog.filter = program.data();
+    if (setsockopt(tcp_fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                   sizeof(fprog)) < 0)
+      Fail("setsockopt(filter)");
+    EnableTimestamps(tcp_fd_, false);
+    GrowReceiveBuffer(tcp_fd_);
+    Watch(tcp_fd_, EPOLLIN);
+  }
+
+  // XXX(wp): Probably implement these later?
+  TCPClient(const TCPClient &other) = delete;
+  TCPClient(TCPClient &&other) = delete;
+  TCPClient &operator=(const TCPClient &other) = delete;
+  TCPClient &operator=(TCPClient &&other) = delete;
+
+  static constexpr uint8_t kProtocol = IPPROTO_TCP;
+
+  /// Send the probe `id` to `addr`, with a TTL of `id.ttl`. The identity
+  /// must be recoverable from the reply, so that many probes can be
+  /// outstanding at the same time. The probe is written where it is queued
+  /// until `Flush()`. TCP probes always keep to a single flow.
+  void SendRequest(const struct sockaddr_in &addr, const ProbeId &id,
+                   std::optional<uint16_t> /*flow*/) {
+    const auto &source = SourceFor(addr);
+    // Raw sockets take no port; the one in the address is ignored.
+    WriteSyn(QueueDatagram(kSynSize, addr, id), source.sin_addr,
+             addr.sin_addr, source_port_, port_, key_ << kTagBits | id.Tag());
+  }
+};
+
+class ICMPClient : public TraceRouteClient<ICMPClient> {
+  friend TraceRouteClient;
+
+  [[nodiscard]] std::optional<uint16_t> Match(const ICMPView &view) const {
+    return traceroute::MatchEcho(view, kIcmpIdentifier);
+  }
+
+ public:
+  explicit ICMPClient(const Options &options)
+      : TraceRouteClient(AF_INET, SOCK_RAW, IPPROTO_ICMP, options) {
+    if (replay_) return;
+    constexpr uint32_t kTypeCode = 0, kIdentifier = 4, kSequenceNumber = 6;
+    constexpr uint16_t kEchoRequest = icmp::kEchoRequest << 8;
+    AttachFilter(BuildFilter(
+        IPPROTO_ICMP,
+        {{kTypeCode, kEchoRequest, kEchoRequest},
+         {kIdentifier, kIcmpIdentifier, kIcmpIdentifier},
+         {kSequenceNumber, 0, UINT16_MAX}},
+        icmp::kEchoReply,
+        {{kIdentifier, kIcmpIdentifier, kIcmpIdentifier},
+         {kSequenceNumber, 0, UINT16_MAX}}));
+  }
+
+  // XXX(wp): Probably implement these later?
+  ICMPClient(const ICMPClient &other) = delete;
+  ICMPClient(ICMPClient &&other) = delete;
+  ICMPClient &operator=(const ICMPClient &other) = delete;
+  ICMPClient &operator=(ICMPClient &&other) = delete;
+
+  static constexpr uint8_t kProtocol = IPPROTO_ICMP;
+
+  void SendRequest(const struct sockaddr_in &addr, const ProbeId &id,
+                   std::optional<uint16_t> flow) {
+    WriteEcho<kIcmpIdentifier>(QueueDatagram(kEchoSize, addr, id), id.Tag(),
+                               flow);
+  }
+};
+
+/// Sends datagrams through a regular UDP socket. Classically, every probe
+/// goes to its own port above `kInitialPort`, which carries its tag. To
+/// keep the flow identifier of the probes fixed (Paris traceroute), they go
+/// to the port of their flow instead, and the tag is carried in the UDP
+/// checksum, which a two-byte payload adjusts. The kernel would leave that
+/// checksum to a NIC with checksum offload, so these are sent through a raw
+/// UDP socket with the header written here.
+class UDPClient : public TraceRouteClient<UDPClient> {
+  friend TraceRouteClient;
+
+  // As many as there are attempts, so that every probe at a hop can have
+  // its own.
+  static constexpr uint16_t kMaxFlows = 1 << ProbeId::kAttemptBits;
+
+  uint16_t source_port_{};
+  bool paris_;
+  // Reserves `source_port_` for the raw socket of Paris probes.
+  int port_fd_{-1};
+
+  /// Write the UDP header of `size` bytes of `payload` from `source` to
+  /// `port` of `destination` to `header`, with its checksum.
+  void WriteHeader(const struct sockaddr_in &source,
+                   const struct sockaddr_in &destination, uint16_t port,
+                   const uint8_t *payload, size_t size,
+                   uint8_t *header) const {
+    auto length = static_cast<uint16_t>(kUDPHeaderSize + size);
+    Store16(header, source_port_);
+    Store16(header + 2, port);
+    Store16(header + 4, length);
+    Store16(header + 6, 0);
+    // The pseudo header, then the datagram with no checksum yet.
+    uint32_t sum = ChecksumAdd(&source.sin_addr, sizeof(source.sin_addr));
+    sum = ChecksumAdd(&destination.sin_addr, sizeof(destination.sin_addr),
+                      sum);
+    sum += IPPROTO_UDP + length;
+    sum = ChecksumAdd(header, kUDPHeaderSize, sum);
+    sum = ChecksumAdd(payload, size, sum);
+    uint16_t checksum = ChecksumFold(sum);
+    // An all-zero checksum would mean none.
+    Store16(header + 6, checksum == 0 ? 0xffff : checksum);
+  }
+
+  [[nodiscard]] std::optional<uint16_t> Match(const ICMPView &view) const {
+    // Verify the returned UDP header by its ports.
+    if (paris_) {
+      return traceroute::MatchParisUDP(view, source_port_, kInitialPort,
+                                       kMaxFlows);
+    }
+    auto tag = traceroute::MatchUDP(view, source_port_, kInitialPort);
+    if (!tag || *tag > ProbeId::kMaxCompactTag) return std::nullopt;
+    return ProbeId::FromCompactTag({}, *tag).Tag();
+  }
+
+ public:
+  explicit UDPClient(const Options &options)
+      : TraceRouteClient(AF_INET,
+                         options.multipath == CLASSIC ? SOCK_DGRAM : SOCK_RAW,
+                         IPPROTO_UDP, options),
+        paris_(options.multipath != CLASSIC) {
+    if (replay_) {
+      // As the probes of the recording.
+      source_port_ = RecordedProbe(IPPROTO_UDP).U16(0);
+      return;
+    }
+    int port_fd = send_fd_;
+    if (paris_) {
+      port_fd_ = Own(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP));
+      if (port_fd_ < 0) Fail("socket");
+      port_fd = port_fd_;
+    }
+    struct sockaddr_in bind_addr {};
+    bind_addr.sin_family = AF_INET;
+    if (bind(port_fd, reinterpret_cast<const struct sockaddr *>(&bind_addr),
+             sizeof(bind_addr)) < 0)
+      Fail("bind");
+    socklen_t len = sizeof(bind_addr);
+    if (getsockname(port_fd, reinterpret_cast<struct sockaddr *>(&bind_addr),
+                    &len) < 0)
+      Fail("getsockname");
+    source_port_ = ntohs(bind_addr.sin_port);
+    constexpr uint32_t kSourcePort = 0, kDestinationPort = 2;
+    uint16_t ports = paris_ ? kMaxFlows - 1 : ProbeId::kMaxCompactTag;
+    AttachFilter(BuildFilter(
+        IPPROTO_UDP,
+        {{kSourcePort, source_port_, source_port_},
+         {kDestinationPort, kInitialPort,
+          static_cast<uint16_t>(kInitialPort + ports)}}));
+  }
+
+  static constexpr uint8_t kProtocol = IPPROTO_UDP;
+
+  size_t TransportHeader(const Datagram &datagram,
+                         const struct sockaddr_in &source,
+                         uint8_t *header) const {
+    // Paris probes carry their header already.
+    if (paris_) return 0;
+    WriteHeader(source, datagram.addr, ntohs(datagram.addr.sin_port),
+                datagram.data.data(), datagram.iov.iov_len, header);
+    return kUDPHeaderSize;
+  }
+
+  void SendRequest(const struct sockaddr_in &addr, const ProbeId &id,
+                   std::optional<uint16_t> flow) {
+    static_assert(ProbeId::kMaxCompactTag <= UINT16_MAX - kInitialPort,
+                  "Tags must fit in the port range.");
+    if (!paris_) {
+      struct sockaddr_in port_addr = addr;
+      port_addr.sin_port =
+          htons(static_cast<uint16_t>(kInitialPort + id.CompactTag()));
+      Store16(QueueDatagram(kUDPPayloadSize, port_addr, id), 0);
+      return;
+    }
+    assert(flow && *flow < kMaxFlows && "Expecting a flow.");
+    auto port = static_cast<uint16_t>(kInitialPort + *flow);
+    const auto &source = SourceFor(addr);
+    // Raw sockets take no port; the one in the header is used.
+    auto *header = QueueDatagram(kUDPHeaderSize + kUDPPayloadSize, addr, id);
+    auto *payload = header + kUDPHeaderSize;
+    WriteParisPayload(payload, source.sin_addr, addr.sin_addr, source_port_,
+                      port, id.Tag());
+    WriteHeader(source, addr, port, payload, kUDPPayloadSize, header);
+  }
+};
+
+/// Reverse DNS lookups on a pool of worker threads, so that probing never
+/// waits on DNS. Answers, including failures, are cached by the event loop
+/// thread and shared by every trace. getnameinfo() does not expose the TTL
+/// of a record, so entries expire after fixed periods instead.
+class Resolver {
+  static constexpr size_t kThreads = 8;
+  static constexpr size_t kMaxEntries = 1 << 20;
+  static constexpr std::chrono::hours kFoundTtl{1};
+  static constexpr std::chrono::minutes kNotFoundTtl{5};
+  static constexpr std::chrono::seconds kFailedTtl{30};
+
+  struct Answer {
+    struct in_addr addr;
+    std::string name;  // Empty if there is none
+    ClockType::duration ttl;
+  };
+
+  /// Lookups by outcome, counted by a single worker.
+  struct Lookups {
+    Counter found, not_found, failed;
+  };
+
+  // Shared with the workers, which may outlive the resolver while stuck in a
+  // slow lookup.
+  struct State {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<struct in_addr> jobs;
+    std::vector<Answer> answers;
+    std::array<Lookups, kThreads> lookups;
+    bool stop = false;
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    State() = default;
+    State(const State &other) = delete;
+    State(State &&other) = delete;
+    State &operator=(const State &other) = delete;
+    State &operator=(State &&other) = delete;
+    ~State() { close(event_fd); }
+  };
+
+  struct Entry {
+    std::string name;
+    TimePoint expires;
+    bool pending;
+  };
+
+  std::shared_ptr<State> state_ = std::make_shared<State>();
+  std::unordered_map<in_addr_t, Entry> cache_;
+  // Requests served by the cache or by a lookup already under way.
+  Counter cache_hits_;
+
+  static void Work(const std::shared_ptr<State> &state, size_t index) {
+    while (true) {
+      struct in_addr addr {};
+      {
+        std::unique_lock lock(state->mutex);
+        state->wake.wait(lock,
+                         [&] { return state->stop || !state->jobs.empty(); });
+        if (state->stop) return;
+        addr = state->jobs.front();
+        state->jobs.pop_front();
+      }
+      struct sockaddr_in sock_addr {};
+      sock_addr.sin_family = AF_INET;
+      sock_addr.sin_addr = addr;
+      char hostname[NI_MAXHOST];
+      int ret =
+          getnameinfo(reinterpret_cast<const struct sockaddr *>(&sock_addr),
+                      sizeof(sock_addr), hostname, sizeof(hostname), nullptr,
+                      0, NI_NAMEREQD);
+      Answer answer{addr, ret == 0 ? hostname : "",
+                    ret == 0 ? ClockType::duration(kFoundTtl)
+                    : ret == EAI_AGAIN ? ClockType::duration(kFailedTtl)
+                                       : ClockType::duration(kNotFoundTtl)};
+      auto &lookups = state->lookups[index];
+      (ret == 0 ? lookups.found
+       : ret == EAI_AGAIN ? lookups.failed
+                          : lookups.not_found)
+          .Add();
+      {
+        std::lock_guard lock(state->mutex);
+        state->answers.push_back(std::move(answer));
+      }
+      uint64_t one = 1;
+      // Cannot fail but by overflowing the counter, which it never nears.
+      (void)!write(state->event_fd, &one, sizeof(one));
+    }
+  }
+
+ public:
+  Resolver() {
+    if (state_->event_fd < 0) Fail("eventfd");
+    for (size_t i = 0; i < kThreads; ++i)
+      std::thread(Work, state_, i).detach();
+  }
+
+  Resolver(const Resolver &other) = delete;
+  Resolver(Resolver &&other) = delete;
+  Resolver &operator=(const Resolver &other) = delete;
+  Resolver &operator=(Resolver &&other) = delete;
+
+  ~Resolver() {
+    {
+      std::lock_guard lock(state_->mutex);
+      state_->stop = true;
+    }
+    state_->wake.notify_all();
+  }
+
+  /// Readable whenever lookups have completed; see `Collect`.
+  [[nodiscard]] int Fd() const { return state_->event_fd; }
+
+  /// Start looking up `addr`, unless it is cached or already under way.
+  void Request(struct in_addr addr) {
+    auto now = ClockType::now();
+    auto iter = cache_.find(addr.s_addr);
+    if (iter != cache_.end() &&
+        (iter->second.pending || iter->second.expires > now)) {
+      cache_hits_.Add();
+      return;
+    }
+    if (cache_.size() >= kMaxEntries) {
+      for (auto entry = cache_.begin(); entry != cache_.end();) {
+        if (!entry->second.pending && entry->second.expires <= now) {
+          entry = cache_.erase(entry);
+        } else {
+          ++entry;
+        }
+      }
+    }
+    // An expired name is still served until the new answer arrives.
+    auto &entry = cache_[addr.s_addr];
+    entry.pending = true;
+    {
+      std::lock_guard lock(state_->mutex);
+      state_->jobs.push_back(addr);
+    }
+    state_->wake.notify_one();
+  }
+
+  /// Move completed lookups into the cache.
+  void Collect() {
+    uint64_t count = 0;
+    if (read(state_->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      Fail("read");
+    std::vector<Answer> answers;
+    {
+      std::lock_guard lock(state_->mutex);
+      std::swap(answers, state_->answers);
+    }
+    auto now = ClockType::now();
+    for (auto &answer : answers) {
+      auto &entry = cache_[answer.addr.s_addr];
+      entry.name = std::move(answer.name);
+      entry.expires = now + answer.ttl;
+      entry.pending = false;
+    }
+  }
+
+  /// The name of `addr`, the empty string if it has none, or nothing if the
+  /// first lookup is still under way.
+  [[nodiscard]] const std::string *Find(struct in_addr addr) const {
+    auto iter = cache_.find(addr.s_addr);
+    if (iter == cache_.end() ||
+        (iter->second.pending && iter->second.expires == TimePoint{}))
+      return nullptr;
+    return &iter->second.name;
+  }
+
+  /// Print the lookup counters in the Prometheus text format.
+  void WriteMetrics(std::ostream &out) const {
+    uint64_t found = 0, not_found = 0, failed = 0;
+    for (const auto &lookups : state_->lookups) {
+      found += lookups.found.Get();
+      not_found += lookups.not_found.Get();
+      failed += lookups.failed.Get();
+    }
+    out << "# HELP traceroute_resolver_lookups_total Reverse DNS lookups.\n"
+           "# TYPE traceroute_resolver_lookups_total counter\n"
+        << "traceroute_resolver_lookups_total{result=\"found\"} " << found
+        << "\ntraceroute_resolver_lookups_total{result=\"not_found\"} "
+        << not_found
+        << "\ntraceroute_resolver_lookups_total{result=\"failed\"} "
+        << failed << "\n";
+    out << "# HELP traceroute_resolver_cache_hits_total Names requested that "
+           "needed no lookup.\n"
+           "# TYPE traceroute_resolver_cache_hits_total counter\n"
+        << "traceroute_resolver_cache_hits_total " << cache_hits_.Get()
+        << "\n";
+  }
+};
+
+/// An output stream into a string, which, unlike `std::ostringstream`, can
+/// be read and emptied without a copy, and keeps its capacity.
+class StringStream : public std::ostream {
+  class Buffer : public std::streambuf {
+   public:
+    std::string text;
+
+   protected:
+    int_type overflow(int_type ch) override {
+      if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        text.push_back(traits_type::to_char_type(ch));
+      return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char *data, std::streamsize size) override {
+      text.append(data, static_cast<size_t>(size));
+      return size;
+    }
+  };
+
+  Buffer buffer_;
+
+ public:
+  // The buffer is constructed after the stream, which is given it then.
+  StringStream() : std::ostream(nullptr) { rdbuf(&buffer_); }
+
+  StringStream(const StringStream &other) = delete;
+  StringStream(StringStream &&other) = delete;
+  StringStream &operator=(const StringStream &other) = delete;
+  StringStream &operator=(StringStream &&other) = delete;
+  ~StringStream() override = default;
+
+  [[nodiscard]] std::string &Text() { return buffer_.text; }
+};
+
+class TraceRouteLogger {
+  std::ostream &out_;
+  struct in_addr previous_ip_ {};
+  bool first_record_;
+
+ public:
+  TraceRouteLogger(std::ostream &out, int ttl)
+      : out_(out), first_record_(true) {
+    out_ << std::setw(2) << ttl << " ";
+    out_ << std::flush;
+  }
+  ~TraceRouteLogger() { out_ << "\n"; }
+
+  TraceRouteLogger(const TraceRouteLogger &other) = delete;
+  TraceRouteLogger(TraceRouteLogger &&other) = delete;
+  TraceRouteLogger &operator=(const TraceRouteLogger &other) = delete;
+  TraceRouteLogger &operator=(TraceRouteLogger &&other) = delete;
+
+  /// Print a probe answered by `ip`, named `hostname`. Only the address is
+  /// printed if `hostname` is null, and the MPLS labels the router reported
+  /// only if `mpls` is not.
+  void Print(struct in_addr ip, const std::string *hostname,
+             const MPLSStack *mpls, const Timestamp &send_time,
+             const Timestamp &recv_time, ICMPStatus status) {
+    // First reply
+    if (ip.s_addr != previous_ip_.s_addr && status != TIMEOUT) {
+      if (!first_record_) out_ << "\n   ";
+      const char *address = inet_ntoa(ip);
+      if (hostname) {
+        out_ << (hostname->empty() ? address : hostname->c_str()) << " ("
+             << address << ")";
+      } else {
+        out_ << address;
+      }
+      for (uint8_t i = 0; mpls && i < mpls->size; ++i) {
+        uint32_t entry = mpls->entries[i];
+        out_ << " <MPLS:L=" << MPLSStack::Label(entry)
+             << ",E=" << +MPLSStack::TrafficClass(entry)
+             << ",S=" << MPLSStack::Bottom(entry)
+             << ",T=" << +MPLSStack::Ttl(entry) << ">";
+      }
+    }
+    if (status == TIMEOUT) {
+      out_ << " *";
+    } else if (status == HOST_UNREACHABLE) {
+      out_ << " !H";
+    } else if (status == NETWORK_UNREACHABLE) {
+      out_ << " !N";
+    } else if (status == PROTOCOL_UNREACHABLE) {
+      out_ << " !P";
+    } else {
+      auto [elapsed, source] = Timestamp::Elapsed(send_time, recv_time);
+      auto time_elapsed =
+          std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+              .count();
+      out_ << std::fixed << std::setprecision(3) << "  "
+           << static_cast<double>(time_elapsed) / 1'000 << " ms";
+      // Kernel software timestamps are the norm; flag anything else.
+      if (source == HARDWARE) out_ << " (hw)";
+      if (source == USERSPACE) out_ << " (user)";
+      previous_ip_ = ip;
+    }
+    first_record_ = false;
+    out_ << std::flush;
+  }
+};
+
+struct Probe {
+  int ttl;
+  Timestamp send_time{};
+  Timestamp recv_time{};
+  TimePoint deadline{};
+  struct in_addr responder {};
+  ICMPStatus status = TIMEOUT;
+  bool sent = false;
+  bool done = false;
+  // Never sent, as the stop sets knew the path up to the hop, or MDA had
+  // found every next hop already.
+  bool skipped = false;
+  MPLSStack mpls{};
+};
+
+/// The stop sets of Doubletree (Donnet et al., SIGMETRICS 2005), shared by
+/// every trace. The local one holds the interfaces seen at each TTL: the
+/// path from here to them is known, so probing backward stops there. The
+/// global one holds the interfaces seen on the way to each /24: the path
+/// from them on to that prefix is known, so probing forward stops there.
+class StopSets {
+  // By key, the destination of the trace that first saw it.
+  std::unordered_map<uint64_t, in_addr_t> local_, global_;
+
+  /// Record that the trace to `owner` saw `key`, and return whether another
+  /// trace had already.
+  static bool Visit(std::unordered_map<uint64_t, in_addr_t> &set,
+                    uint64_t key, in_addr_t owner) {
+    auto [it, inserted] = set.try_emplace(key, owner);
+    return !inserted && it->second != owner;
+  }
+
+ public:
+  bool VisitLocal(uint8_t ttl, in_addr interface, in_addr destination) {
+    return Visit(local_, uint64_t{ttl} << 32 | interface.s_addr,
+                 destination.s_addr);
+  }
+
+  bool VisitGlobal(in_addr interface, in_addr destination) {
+    uint32_t prefix = ntohl(destination.s_addr) >> 8;
+    return Visit(global_, uint64_t{prefix} << 32 | interface.s_addr,
+                 destination.s_addr);
+  }
+};
+
+/// Next hops beyond which MDA stops looking for more.
+constexpr size_t kMaxResponders = 16;
+
+/// The stopping rule of the Multipath Detection Algorithm (Veitch et al.,
+/// 2009): the number of probes after which, if `k` responders answered at a
+/// hop, there is no other one with probability `confidence`, assuming that
+/// load balancers split the load evenly; for `k` up to `max_responders`.
+std::vector<size_t> MdaStoppingPoints(double confidence,
+                                      size_t max_responders) {
+  std::vector<size_t> stops;
+  size_t probes = 1;
+  for (size_t k = 1; k <= max_responders; ++k) {
+    // The probability that `probes` miss any of `k + 1` responders, by
+    // inclusion-exclusion.
+    auto miss = [&] {
+      double total = 0, binomial = 1;
+      for (size_t i = 1; i <= k; ++i) {
+        binomial = binomial * static_cast<double>(k + 2 - i) /
+                   static_cast<double>(i);
+        double term = binomial * std::pow(1 - static_cast<double>(i) /
+                                                  static_cast<double>(k + 1),
+                                          static_cast<double>(probes));
+        total += i % 2 == 1 ? term : -term;
+      }
+      return total;
+    };
+    while (miss() > 1 - confidence) probes++;
+    stops.push_back(probes);
+  }
+  return stops;
+}
+
+/// The route of an earlier trace to a destination: the responder at every
+/// TTL from 1 on, or nothing if there was none, and whether the last one is
+/// the destination.
+struct Route {
+  std::vector<std::optional<in_addr_t>> hops;
+  bool reached = false;
+};
+
+/// The probes of a single target. Results are printed in hop order into a
+/// buffer, which is either streamed as it grows or emitted once complete.
+/// A result whose responder is still being resolved holds back printing for
+/// at most `kMaxNameWait`, after which the address is printed alone.
+///
+/// Probes are given up on adaptively, as in Linux traceroute's `-w
+/// MAX,HERE,NEAR`: after `kHereFactor` times the slowest RTT already
+/// measured at their hop or, failing that, `kNearFactor` times the RTT of
+/// the nearest deeper hop that answered. The timeout is never shorter than
+/// the RTO of RFC 6298 over every RTT of the trace (nor `kMinTimeout`), and
+/// never longer than the configured wait time, which also applies until the
+/// first RTT is known.
+///
+/// For continuous monitoring, a trace is restarted for every round. Nothing
+/// is printed then, and a round ends without waiting for names.
+///
+/// With `StopSets`, probing starts at `options.start_ttl` and goes forward
+/// from there, then backward, and either direction stops at a hop whose
+/// responder another trace already saw. Hops left out this way are not
+/// printed.
+///
+/// With MDA, every probe at a hop has a flow of its own, and a hop gets
+/// probes until the stopping rule rules out another responder; a new
+/// responder at a hop the probing is past sends it back there. A hop is
+/// printed once complete, with its results grouped by responder.
+///
+/// Given the route of an earlier trace, only one probe is sent at first to
+/// each of a few sentinel hops: the last two and every `kSentinelStride`th.
+/// Once they are all done, the hops up to a sentinel whose responder
+/// changed, from the previous sentinel on, are probed in full, and so is
+/// the rest of the path if the last hop changed. Hops left out this way are
+/// not printed.
+class Trace {
+  static constexpr std::chrono::seconds kMaxNameWait{2};
+  static constexpr std::chrono::milliseconds kMinTimeout{250};
+  static constexpr int kHereFactor = 3, kNearFactor = 10;
+  static constexpr size_t kSentinelStride = 4;
+
+  // The probing of a hop with MDA: how many probes it needs as far as
+  // known, and how many of them were sent and are outstanding.
+  struct Branching {
+    size_t needed;
+    size_t sent = 0, pending = 0, responders = 0;
+    bool complete = false;
+  };
+
+  Target target_;
+  Resolver *resolver_;
+  StopSets *stop_sets_;
+  std::vector<Probe> probes_;
+  size_t nqueries_, sim_queries_;
+  // Probes past `last_probe_` lie beyond the destination (or the gap limit,
+  // or a hop in the global stop set) and are not needed, nor are those
+  // before `first_probe_`, below a hop in the local stop set.
+  size_t first_probe_ = 0, last_probe_;
+  // Probes are sent forward from `start_probe_`, then backward from it:
+  // those sent so far are the ones from `next_backward_` to `next_forward_`.
+  size_t start_probe_ = 0;
+  size_t next_forward_ = 0, next_backward_ = 0;
+  size_t next_print_ = 0, in_flight_ = 0;
+  Multipath multipath_;
+  // The attempt numbers the encoding of the probes has room for.
+  size_t attempts_;
+  // With MDA, `stops_` from `MdaStoppingPoints`, the state of every hop,
+  // and the hops before `next_forward_` that need more probes.
+  std::vector<size_t> stops_;
+  std::vector<Branching> branching_;
+  std::vector<size_t> top_ups_;
+  // When re-tracing, the previous responder of every hop up to the last one
+  // it had, the probes to send, in order, and the sentinels not done yet.
+  std::optional<Route> previous_;
+  std::deque<size_t> queue_;
+  size_t sentinels_ = 0, unchanged_ = 0;
+  ClockType::duration wait_time_;
+  std::optional<ClockType::duration> srtt_, rttvar_;
+  // The slowest RTT measured at each hop, zero if none.
+  std::vector<ClockType::duration> hop_rtts_;
+  int gap_limit_, silent_hops_ = 0;
+  bool extensions_, continuous_;
+  // Rounds since the start, which vary the attempt numbers of probes, so
+  // that a reply to an earlier round is not taken for one to this round.
+  size_t round_ = 0;
+  bool reached_ = false;
+  StringStream buffer_;
+  std::optional<TraceRouteLogger> logger_;
+
+ public:
+  /// A trace of `target`, counting its rounds from `round` on, so that
+  /// earlier traces to it do not share its attempt numbers.
+  Trace(Target target, const Options &options, Resolver *resolver,
+        StopSets *stop_sets, size_t round = 0)
+      : target_(std::move(target)),
+        resolver_(resolver),
+        stop_sets_(stop_sets),
+        nqueries_(static_cast<size_t>(options.nqueries)),
+        sim_queries_(static_cast<size_t>(options.sim_queries)),
+        multipath_(options.multipath),
+        attempts_(options.mode == UDP && options.multipath == CLASSIC
+                      ? 1 << ProbeId::kCompactAttemptBits
+                      : 1 << ProbeId::kAttemptBits),
+        wait_time_(std::chrono::duration_cast<ClockType::duration>(
+            std::chrono::duration<double>(options.wait_time))),
+        gap_limit_(options.gap_limit),
+        extensions_(options.extensions),
+        continuous_(options.interval > 0),
+        round_(round) {
+    if (multipath_ == MDA) {
+      // Room for every probe a hop may need.
+      stops_ = MdaStoppingPoints(options.confidence, kMaxResponders);
+      nqueries_ = stops_.back();
+      assert(nqueries_ < attempts_ && "Probes of a hop must be distinct.");
+    }
+    probes_.reserve(
+        static_cast<size_t>(options.max_ttl - options.first_ttl + 1) *
+        nqueries_);
+    for (int hop = options.first_ttl; hop <= options.max_ttl; ++hop) {
+      for (size_t query = 0; query < nqueries_; ++query)
+        probes_.push_back(Probe{hop});
+    }
+    last_probe_ = probes_.size();
+    if (multipath_ == MDA)
+      branching_.assign(probes_.size() / nqueries_, {stops_.front()});
+    if (stop_sets_) {
+      start_probe_ =
+          static_cast<size_t>(options.start_ttl - options.first_ttl) *
+          nqueries_;
+      next_forward_ = next_backward_ = start_probe_;
+    }
+    hop_rtts_.resize(probes_.size() / nqueries_);
+    if (continuous_) return;
+    buffer_ << "traceroute to " << target_.hostname << " ("
+            << inet_ntoa(target_.addr.sin_addr) << "), " << options.max_ttl
+            << " hops max\n";
+  }
+
+  [[nodiscard]] const Target &GetTarget() const { return target_; }
+  [[nodiscard]] const Probe &GetProbe(size_t probe) const {
+    return probes_[probe];
+  }
+  /// Rounds take turns at blocks of `nqueries_` attempts, so that two in a
+  /// row never share one.
+  [[nodiscard]] ProbeId GetProbeId(size_t probe) const {
+    size_t block = round_ % (attempts_ / nqueries_);
+    return {target_.addr.sin_addr, static_cast<uint8_t>(probes_[probe].ttl),
+            static_cast<uint8_t>(block * nqueries_ + probe % nqueries_)};
+  }
+  /// The flow of `probe`, if it is to keep to one.
+  [[nodiscard]] std::optional<uint16_t> GetFlow(size_t probe) const {
+    if (multipath_ == CLASSIC) return std::nullopt;
+    if (multipath_ == PARIS) return 0;
+    return static_cast<uint16_t>(probe % nqueries_);
+  }
+  /// The probes of this round, in hop order, once it is `Done()`.
+  [[nodiscard]] size_t Size() const { return last_probe_; }
+  [[nodiscard]] bool Done() const { return next_print_ >= last_probe_; }
+  [[nodiscard]] bool CanSend() const {
+    if (previous_) return !queue_.empty() && in_flight_ < sim_queries_;
+    return (!top_ups_.empty() || next_forward_ < last_probe_ ||
+            next_backward_ > first_probe_) &&
+           in_flight_ < sim_queries_;
+  }
+  [[nodiscard]] bool Reached() const { return reached_; }
+  /// The probes the stop sets or the previous route made unnecessary.
+  [[nodiscard]] size_t Skipped() const { return first_probe_ + unchanged_; }
+
+  /// How long to wait for a reply to `probe` as far as known so far.
+  [[nodiscard]] ClockType::duration Timeout(size_t probe) const {
+    if (!srtt_) return wait_time_;
+    ClockType::duration timeout = *srtt_ + 4 * *rttvar_;
+    size_t hop = probe / nqueries_;
+    if (hop_rtts_[hop] != ClockType::duration::zero()) {
+      timeout = std::max(timeout, kHereFactor * hop_rtts_[hop]);
+    } else {
+      for (size_t next = hop + 1; next < hop_rtts_.size(); ++next) {
+        if (hop_rtts_[next] == ClockType::duration::zero()) continue;
+        timeout = std::max(timeout, kNearFactor * hop_rtts_[next]);
+        break;
+      }
+    }
+    return std::clamp<ClockType::duration>(timeout, kMinTimeout, wait_time_);
+  }
+
+  /// The probes sent but neither answered nor given up on yet.
+  [[nodiscard]] std::vector<size_t> InFlight() const {
+    std::vector<size_t> probes;
+    for (size_t probe = next_backward_; probe < next_forward_; ++probe) {
+      if (probes_[probe].sent && !probes_[probe].done) probes.push_back(probe);
+    }
+    return probes;
+  }
+
+  /// Start another round, once this one is `Done()` and the probes still in
+  /// flight are forgotten. RTTs measured so far still shape the timeouts,
+  /// and if the destination was reached, probing stops at its hop unless the
+  /// path turns out to be longer.
+  void Restart() {
+    last_probe_ = reached_ ? last_probe_ : probes_.size();
+    for (auto &probe : probes_) probe = Probe{probe.ttl};
+    std::fill(hop_rtts_.begin(), hop_rtts_.end(), ClockType::duration{});
+    if (multipath_ == MDA) branching_.assign(branching_.size(), {stops_[0]});
+    top_ups_.clear();
+    next_forward_ = next_backward_ = start_probe_;
+    first_probe_ = next_print_ = in_flight_ = 0;
+    silent_hops_ = 0;
+    reached_ = false;
+    round_++;
+  }
+
+  /// Re-trace `route`, by its sentinel hops first. Nothing is sent yet.
+  void Retrace(const Route &route) {
+    auto first_ttl = static_cast<size_t>(probes_.front().ttl);
+    if (route.hops.size() < first_ttl) return;
+    // The hops of the route within the TTLs to probe.
+    size_t hops =
+        std::min(route.hops.size() + 1 - first_ttl, hop_rtts_.size());
+    auto begin = route.hops.begin() + static_cast<long>(first_ttl - 1);
+    previous_ = Route{{begin, begin + static_cast<long>(hops)},
+                      route.reached && first_ttl - 1 + hops ==
+                                           route.hops.size()};
+    for (size_t hop = 0; hop < hops; ++hop) {
+      if (hop % kSentinelStride == kSentinelStride - 1 || hop + 2 >= hops) {
+        queue_.push_back(hop * nqueries_);
+        sentinels_++;
+      }
+    }
+  }
+
+  /// Claim the next probe to send and record its send time.
+  size_t NextProbe(TimePoint send_time) {
+    in_flight_++;
+    size_t index = 0;
+    if (previous_) {
+      index = queue_.front();
+      queue_.pop_front();
+      next_forward_ = std::max(next_forward_, index + 1);
+    } else if (multipath_ == MDA) {
+      index = NextBranch();
+    } else {
+      index = next_forward_ < last_probe_ ? next_forward_++ : --next_backward_;
+    }
+    auto &probe = probes_[index];
+    probe.sent = true;
+    probe.send_time = {send_time, USERSPACE, {}};
+    probe.deadline = send_time + Timeout(index);
+    return index;
+  }
+
+  /// Recompute when to give up on `probe`, and return whether it changed.
+  bool Reschedule(size_t probe) {
+    auto deadline = probes_[probe].send_time.time + Timeout(probe);
+    if (deadline == probes_[probe].deadline) return false;
+    probes_[probe].deadline = deadline;
+    return true;
+  }
+
+  /// Bring forward the deadline of every outstanding probe that can be given
+  /// up on sooner given the RTTs measured since it was sent, passing each
+  /// of them to `on_change`.
+  template <typename Fn>
+  void Tighten(Fn &&on_change) {
+    for (size_t probe = next_backward_; probe < next_forward_; ++probe) {
+      auto &current = probes_[probe];
+      if (!current.sent || current.done) continue;
+      auto deadline = current.send_time.time + Timeout(probe);
+      if (deadline >= current.deadline) continue;
+      current.deadline = deadline;
+      on_change(probe);
+    }
+  }
+
+  /// Replace the send time of `probe` with the one taken by the kernel.
+  void OnSent(size_t probe, const Timestamp &send_time) {
+    probes_[probe].send_time = send_time;
+  }
+
+  /// Record the reply to `index`. Return false if the probe is already done.
+  bool OnReply(size_t index, const ProbeResult &reply) {
+    if (probes_[index].done) return false;
+    auto &probe = probes_[index];
+    probe.responder = reply.responder;
+    probe.recv_time = reply.recv_time;
+    probe.status = reply.status;
+    probe.mpls = reply.mpls;
+    probe.done = true;
+    in_flight_--;
+    auto rtt = Timestamp::Elapsed(probe.send_time, probe.recv_time).first;
+    // An RTT clamped across a clock step says nothing of the path.
+    if (rtt > ClockType::duration::zero() && !srtt_) {
+      srtt_ = rtt;
+      rttvar_ = rtt / 2;
+    } else if (rtt > ClockType::duration::zero()) {
+      auto error = *srtt_ > rtt ? *srtt_ - rtt : rtt - *srtt_;
+      rttvar_ = (3 * *rttvar_ + error) / 4;
+      srtt_ = (7 * *srtt_ + rtt) / 8;
+    }
+    auto &hop_rtt = hop_rtts_[index / nqueries_];
+    hop_rtt = std::max(hop_rtt, rtt);
+    if (reply.status == DESTINATION_REACHED) {
+      // Destination reached; stop at the end of this hop.
+      Truncate((index / nqueries_ + 1) * nqueries_);
+      reached_ = true;
+    } else if (reply.status == TTL_EXPIRED && !reached_ && round_ > 0 &&
+               index / nqueries_ + 1 == last_probe_ / nqueries_) {
+      // A router at the last hop of the previous path; it got longer.
+      last_probe_ = std::min(probes_.size(), last_probe_ + nqueries_);
+    }
+    if (stop_sets_ && reply.status == TTL_EXPIRED) Visit(index, reply);
+    if (multipath_ == MDA) Settle(index);
+    if (sentinels_ > 0 && index % nqueries_ == 0 && --sentinels_ == 0)
+      Compare();
+    return true;
+  }
+
+  /// Enter the responder of `index` in the stop sets, and stop probing in
+  /// its direction if the path beyond it is known already.
+  void Visit(size_t index, const ProbeResult &reply) {
+    auto interface = reply.responder;
+    auto destination = target_.addr.sin_addr;
+    size_t hop_start = index / nqueries_ * nqueries_;
+    bool known_before = stop_sets_->VisitLocal(
+        static_cast<uint8_t>(probes_[index].ttl), interface, destination);
+    bool known_after = stop_sets_->VisitGlobal(interface, destination);
+    if (index >= start_probe_ && known_after) {
+      Truncate(hop_start + nqueries_);
+    } else if (index < start_probe_ && known_before) {
+      // Hops already partly sent are finished anyway, so that every hop is
+      // either printed whole or left out.
+      first_probe_ = std::max(
+          first_probe_,
+          std::min(hop_start, next_backward_ / nqueries_ * nqueries_));
+      for (size_t probe = 0; probe < first_probe_; ++probe) {
+        probes_[probe].done = true;
+        probes_[probe].skipped = true;
+      }
+    }
+  }
+
+  /// Give up on a probe. Return false if it was already answered.
+  bool OnTimeout(size_t probe) {
+    if (probes_[probe].done) return false;
+    probes_[probe].done = true;
+    in_flight_--;
+    if (multipath_ == MDA) Settle(probe);
+    if (sentinels_ > 0 && probe % nqueries_ == 0 && --sentinels_ == 0)
+      Compare();
+    return true;
+  }
+
+  /// Stop probing past `last`.
+  void Truncate(size_t last) {
+    last_probe_ = std::min(last_probe_, last);
+    top_ups_.erase(std::remove_if(top_ups_.begin(), top_ups_.end(),
+                                  [&](size_t hop) {
+                                    return hop * nqueries_ >= last_probe_;
+                                  }),
+                   top_ups_.end());
+    while (!queue_.empty() && queue_.back() >= last_probe_) {
+      queue_.pop_back();
+      // A sentinel past the end has nothing to tell.
+      if (sentinels_ > 0 && --sentinels_ == 0) Compare();
+    }
+  }
+
+  /// Whether the sentinel probe of `hop` found the responder it had before.
+  [[nodiscard]] bool Unchanged(size_t hop) const {
+    const auto &probe = probes_[hop * nqueries_];
+    const auto &expected = previous_->hops[hop];
+    if (probe.status == TIMEOUT) return !expected;
+    if (!expected || probe.responder.s_addr != *expected)
+      return false;
+    if (hop + 1 < previous_->hops.size()) return probe.status == TTL_EXPIRED;
+    return (probe.status == DESTINATION_REACHED) == previous_->reached;
+  }
+
+  /// Once every sentinel is done, queue the hops that changed, and leave
+  /// out the others.
+  void Compare() {
+    size_t hops = previous_->hops.size(), from = 0;
+    std::vector<bool> queued(probes_.size());
+    auto probe_all = [&](size_t begin, size_t end) {
+      for (size_t probe = begin * nqueries_;
+           probe < std::min(end * nqueries_, last_probe_); ++probe) {
+        if (probes_[probe].sent) continue;
+        queue_.push_back(probe);
+        queued[probe] = true;
+      }
+    };
+    for (size_t hop = 0; hop < hops; ++hop) {
+      if (hop % kSentinelStride != kSentinelStride - 1 && hop + 2 < hops)
+        continue;
+      if (!Unchanged(hop)) probe_all(from, hop + 1);
+      from = hop + 1;
+    }
+    // Beyond the last hop, the path may go on where it ended before.
+    if (!Unchanged(hops - 1)) {
+      probe_all(hops, probes_.size() / nqueries_);
+    } else {
+      Truncate(hops * nqueries_);
+    }
+    for (size_t probe = 0; probe < last_probe_; ++probe) {
+      if (probes_[probe].sent || queued[probe]) continue;
+      probes_[probe].done = true;
+      probes_[probe].skipped = true;
+      unchanged_++;
+    }
+  }
+
+  /// The route found, with the hops left out as they were in `previous`.
+  [[nodiscard]] Route GetRoute(const Route *previous) const {
+    auto first_ttl = static_cast<size_t>(probes_.front().ttl);
+    Route route;
+    if (previous) {
+      route.hops.assign(previous->hops.begin(),
+                        previous->hops.begin() +
+                            static_cast<long>(std::min(
+                                previous->hops.size(), first_ttl - 1)));
+    }
+    route.hops.resize(first_ttl - 1);
+    for (size_t hop = 0; hop * nqueries_ < last_probe_; ++hop) {
+      auto begin = probes_.begin() + static_cast<long>(hop * nqueries_);
+      auto answered = std::find_if(begin, begin + static_cast<long>(nqueries_),
+                                   [](const Probe &probe) {
+                                     return !probe.skipped &&
+                                            probe.status != TIMEOUT;
+                                   });
+      if (begin->skipped) {
+        route.hops.push_back(previous_->hops[hop]);
+      } else if (answered != begin + static_cast<long>(nqueries_)) {
+        route.hops.push_back(answered->responder.s_addr);
+      } else {
+        route.hops.emplace_back();
+      }
+    }
+    route.reached = reached_;
+    return route;
+  }
+
+  /// With MDA, claim the next probe of a hop that needs more, and move on
+  /// from a hop once it has as many as it needs.
+  size_t NextBranch() {
+    if (!top_ups_.empty()) {
+      size_t hop = top_ups_.back();
+      auto &state = branching_[hop];
+      if (++state.sent >= state.needed) top_ups_.pop_back();
+      state.pending++;
+      return hop * nqueries_ + state.sent - 1;
+    }
+    size_t index = next_forward_, hop = index / nqueries_;
+    auto &state = branching_[hop];
+    state.sent++;
+    state.pending++;
+    next_forward_ =
+        state.sent < state.needed ? index + 1 : (hop + 1) * nqueries_;
+    return index;
+  }
+
+  /// With MDA, account for the answer to `index` or its timeout. A new
+  /// responder raises the number of probes its hop needs, and a hop is
+  /// complete once they all are done.
+  void Settle(size_t index) {
+    size_t hop = index / nqueries_, first = hop * nqueries_;
+    auto &state = branching_[hop];
+    state.pending--;
+    const auto &probe = probes_[index];
+    auto begin = probes_.begin() + static_cast<long>(first);
+    auto end = begin + static_cast<long>(state.sent);
+    auto same_responder = [&](const Probe &other) {
+      return &other != &probe && other.done && other.status != TIMEOUT &&
+             other.responder.s_addr == probe.responder.s_addr;
+    };
+    if (probe.status == DESTINATION_REACHED) {
+      // Nothing lies beyond the destination.
+      state.needed = state.sent;
+    } else if (probe.status != TIMEOUT &&
+               std::none_of(begin, end, same_responder)) {
+      state.responders++;
+      state.needed =
+          stops_[std::min(state.responders, kMaxResponders) - 1];
+      bool passed = next_forward_ >= first + nqueries_;
+      if (passed && state.sent < state.needed && first < last_probe_ &&
+          std::find(top_ups_.begin(), top_ups_.end(), hop) == top_ups_.end())
+        top_ups_.push_back(hop);
+    }
+    if (state.pending > 0 || state.sent < state.needed) return;
+    state.complete = true;
+    for (size_t skipped = first + state.sent; skipped < first + nqueries_;
+         ++skipped) {
+      probes_[skipped].done = true;
+      probes_[skipped].skipped = true;
+    }
+  }
+
+  /// Group the results of a complete hop by responder, in the order of
+  /// their first probes, and the timeouts last. Probes move, so nothing
+  /// may refer to them by index any more.
+  void Group(size_t hop) {
+    auto begin = probes_.begin() + static_cast<long>(hop * nqueries_);
+    auto end = begin + static_cast<long>(branching_[hop].sent);
+    std::vector<in_addr_t> responders;
+    auto rank = [&](const Probe &result) {
+      if (result.status == TIMEOUT) return responders.size();
+      return static_cast<size_t>(
+          std::find(responders.begin(), responders.end(),
+                    result.responder.s_addr) -
+          responders.begin());
+    };
+    for (auto result = begin; result != end; ++result) {
+      if (rank(*result) == responders.size() && result->status != TIMEOUT)
+        responders.push_back(result->responder.s_addr);
+    }
+    std::stable_sort(begin, end, [&](const Probe &lhs, const Probe &rhs) {
+      return rank(lhs) < rank(rhs);
+    });
+  }
+
+  /// Print every completed probe that is next in hop order. Return when
+  /// printing has to resume at the latest if it is held back by a lookup.
+  std::optional<TimePoint> Print() {
+    auto now = ClockType::now();
+    for (; next_print_ < last_probe_ && probes_[next_print_].done;
+         ++next_print_) {
+      // A hop probed with MDA is printed once complete, and grouped then.
+      size_t hop = next_print_ / nqueries_;
+      if (multipath_ == MDA) {
+        if (!branching_[hop].complete) break;
+        if (next_print_ % nqueries_ == 0) Group(hop);
+      }
+      const auto &probe = probes_[next_print_];
+      const std::string *hostname = nullptr;
+      if (resolver_ && probe.status != TIMEOUT && !continuous_) {
+        hostname = resolver_->Find(probe.responder);
+        auto give_up = probe.recv_time.time + kMaxNameWait;
+        if (!hostname && give_up > now) return give_up;
+      }
+      if (!continuous_ && !probe.skipped) {
+        if (next_print_ % nqueries_ == 0) logger_.emplace(buffer_, probe.ttl);
+        logger_->Print(probe.responder, hostname,
+                       extensions_ ? &probe.mpls : nullptr, probe.send_time,
+                       probe.recv_time, probe.status);
+      }
+      // Hops before the start are probed last, when the path is known, and
+      // hops left out of a re-trace are not silent.
+      if (next_print_ < start_probe_ ||
+          probes_[next_print_ / nqueries_ * nqueries_].skipped)
+        continue;
+      if (probe.status != TIMEOUT) silent_hops_ = -1;
+      if ((next_print_ + 1) % nqueries_ == 0) {
+        silent_hops_++;
+        if (gap_limit_ > 0 && silent_hops_ >= gap_limit_)
+          Truncate(next_print_ + 1);
+      }
+    }
+    if (Done()) logger_.reset();
+    return std::nullopt;
+  }
+
+  /// Move what has been printed so far to the end of `out`.
+  void Flush(std::string &out) {
+    out += buffer_.Text();
+    buffer_.Text().clear();
+  }
+};
+
+/// Appends the results of every trace to a file in the format of store.h.
+/// Rows are collected into a block on the event loop, and full blocks are
+/// encoded and written by a thread of their own, so that neither holds up
+/// probing.
+class TraceStore {
+  int fd_ = -1;
+  // From `ClockType` to the time since the epoch.
+  std::chrono::nanoseconds epoch_offset_;
+  traceroute::store::BlockBuilder block_;
+  // Shared with the writer.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<traceroute::store::BlockBuilder> full_;
+  bool stop_ = false;
+  // Why the writer gave up, after which blocks are dropped.
+  std::optional<Error> error_;
+  std::thread writer_;
+
+  [[nodiscard]] uint64_t Nanoseconds(TimePoint time) const {
+    return static_cast<uint64_t>(
+        (std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch()) +
+         epoch_offset_)
+            .count());
+  }
+
+  void WriteAll(const std::vector<uint8_t> &data) const {
+    for (size_t written = 0; written < data.size();) {
+      ssize_t ret = write(fd_, data.data() + written, data.size() - written);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0) Fail("write");
+      written += static_cast<size_t>(ret);
+    }
+  }
+
+  void Work() {
+    while (true) {
+      std::deque<traceroute::store::BlockBuilder> blocks;
+      {
+        std::unique_lock lock(mutex_);
+        wake_.wait(lock, [&] { return stop_ || !full_.empty(); });
+        if (full_.empty()) return;
+        std::swap(blocks, full_);
+      }
+      try {
+        for (const auto &block : blocks) WriteAll(block.Encode());
+      } catch (Error &error) {
+        std::lock_guard lock(mutex_);
+        error_ = std::move(error);
+        return;
+      }
+    }
+  }
+
+  void Hand(traceroute::store::BlockBuilder block) {
+    {
+      std::lock_guard lock(mutex_);
+      full_.push_back(std::move(block));
+    }
+    wake_.notify_one();
+  }
+
+ public:
+  /// Open `path` for appending, creating it if need be.
+  explicit TraceStore(const std::string &path)
+      : epoch_offset_(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch() -
+            ClockType::now().time_since_epoch())) {
+    namespace store = traceroute::store;
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) Fail(path);
+    try {
+      std::array<uint8_t, store::kFileMagic.size()> magic{};
+      ssize_t size = pread(fd_, magic.data(), magic.size(), 0);
+      if (size < 0) Fail(path);
+      if (size == 0) {
+        WriteAll({store::kFileMagic.begin(), store::kFileMagic.end()});
+      } else if (magic != store::kFileMagic) {
+        throw Error{path + " is not a trace store"};
+      }
+    } catch (...) {
+      close(fd_);
+      throw;
+    }
+    writer_ = std::thread(&TraceStore::Work, this);
+  }
+
+  TraceStore(const TraceStore &other) = delete;
+  TraceStore(TraceStore &&other) = delete;
+  TraceStore &operator=(const TraceStore &other) = delete;
+  TraceStore &operator=(TraceStore &&other) = delete;
+
+  ~TraceStore() { Close(); }
+
+  /// Why writing failed, if it has.
+  std::optional<Error> GetError() {
+    std::lock_guard lock(mutex_);
+    return error_;
+  }
+
+  /// Write what is left and wait for the writer. Nothing is recorded after.
+  std::optional<Error> Close() {
+    if (!writer_.joinable()) return error_;
+    if (block_.Rows() > 0) Hand(std::move(block_));
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    close(fd_);
+    return error_;
+  }
+
+  /// Add the results of `trace`, once it is `Done()`, for the round that
+  /// started at `start`. The names of responders are those `resolver`
+  /// already knows.
+  void Record(const Trace &trace, TimePoint start, const Resolver *resolver) {
+    const auto &target = trace.GetTarget();
+    for (size_t index = 0; index < trace.Size(); ++index) {
+      const auto &probe = trace.GetProbe(index);
+      if (probe.skipped) continue;
+      traceroute::store::Row row{target.addr.sin_addr.s_addr,
+                                 target.hostname,
+                                 Nanoseconds(start),
+                                 static_cast<uint8_t>(probe.ttl),
+                                 {},
+                                 {},
+                                 probe.status,
+                                 Nanoseconds(probe.send_time.time),
+                                 0};
+      if (probe.status != TIMEOUT) {
+        auto addr = probe.responder;
+        row.responder = addr.s_addr;
+        const std::string *name = resolver ? resolver->Find(addr) : nullptr;
+        if (name) row.responder_name = *name;
+        row.rtt = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Timestamp::Elapsed(probe.send_time, probe.recv_time).first)
+                .count());
+      }
+      block_.Add(row);
+    }
+    // Blocks end with a trace, so that its rows are never split.
+    if (block_.Rows() < traceroute::store::kBlockRows) return;
+    Hand(std::move(block_));
+    block_ = {};
+  }
+};
+
+/// A FIFO queue in a ring that doubles when full and never shrinks, so that,
+/// unlike a `std::deque`, going round it allocates nothing.
+template <typename T>
+class RingQueue {
+  std::vector<T> items_ = std::vector<T>(16);
+  size_t head_ = 0, size_ = 0;
+
+ public:
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+  [[nodiscard]] const T &front() const { return items_[head_]; }
+
+  void push_back(T item) {
+    if (size_ == items_.size()) {
+      std::rotate(items_.begin(),
+                  items_.begin() + static_cast<std::ptrdiff_t>(head_),
+                  items_.end());
+      head_ = 0;
+      items_.resize(items_.size() * 2);
+    }
+    items_[(head_ + size_) & (items_.size() - 1)] = std::move(item);
+    size_++;
+  }
+
+  void pop_front() {
+    head_ = (head_ + 1) & (items_.size() - 1);
+    size_--;
+  }
+};
+
+/// Timers of `Value`s in a hashed timing wheel: a ring of `kSlots` slots of
+/// `kTick` each, where a timer goes to the slot of its deadline, modulo the
+/// ring. Adding a timer and expiring one cost O(1) however many are
+/// pending; timers further out than one revolution are passed over until
+/// their turn comes. Timers fire up to `kTick` late, in slot order. A slot
+/// is a list threaded through one pool of timers, whose entries are reused,
+/// so that the wheel stops allocating once it has held its most timers.
+template <typename Value>
+class TimerWheel {
+  static constexpr size_t kSlots = 4096;  // Must be a power of 2.
+  static constexpr size_t kWords = kSlots / 64;
+  static constexpr std::chrono::milliseconds kTick{1};
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  struct Timer {
+    TimePoint when;
+    Value value;
+    uint32_t next;  // In its slot, or in `free_`
+  };
+
+  TimePoint origin_ = ClockType::now();
+  // Slots before `next_tick_` have been expired.
+  uint64_t next_tick_ = 0;
+  std::vector<Timer> timers_;
+  uint32_t free_ = kNone;
+  // The first and last timer of every slot, in the order they were added.
+  std::vector<std::pair<uint32_t, uint32_t>> slots_ =
+      std::vector<std::pair<uint32_t, uint32_t>>(kSlots, {kNone, kNone});
+  // Which slots are not empty, to skip over the others.
+  std::array<uint64_t, kWords> occupied_{};
+  size_t size_ = 0;
+
+  /// The first tick at or after `when`.
+  [[nodiscard]] uint64_t TickOf(TimePoint when) const {
+    if (when <= origin_) return 0;
+    return static_cast<uint64_t>(
+        std::chrono::ceil<std::chrono::milliseconds>(when - origin_) / kTick);
+  }
+
+  /// The first tick from `tick` on whose slot is not empty, if any is.
+  [[nodiscard]] std::optional<uint64_t> NextOccupied(uint64_t tick) const {
+    // Whole words of `occupied_`, from the one of `tick` around the ring and
+    // back to it.
+    uint64_t base = tick & ~uint64_t{63};
+    for (size_t step = 0; step <= kWords; ++step, base += 64) {
+      uint64_t word = occupied_[(base & (kSlots - 1)) / 64];
+      if (base < tick) word &= ~uint64_t{0} << (tick - base);
+      if (word != 0)
+        return base + static_cast<uint64_t>(__builtin_ctzll(word));
+    }
+    return std::nullopt;
+  }
+
+  /// Append the timer `index` to `slot`.
+  void Link(size_t slot, uint32_t index) {
+    auto &[head, tail] = slots_[slot];
+    timers_[index].next = kNone;
+    (tail == kNone ? head : timers_[tail].next) = index;
+    tail = index;
+    occupied_[slot / 64] |= uint64_t{1} << (slot % 64);
+  }
+
+ public:
+  [[nodiscard]] bool Empty() const { return size_ == 0; }
+
+  void Insert(TimePoint when, Value value) {
+    uint64_t tick = std::max(TickOf(when), next_tick_);
+    uint32_t index = free_;
+    if (index != kNone) {
+      free_ = timers_[index].next;
+      timers_[index].when = when;
+      timers_[index].value = std::move(value);
+    } else {
+      index = static_cast<uint32_t>(timers_.size());
+      timers_.push_back({when, std::move(value), kNone});
+    }
+    Link(tick & (kSlots - 1), index);
+    size_++;
+  }
+
+  /// When the next timer may be due, if there is any. This is early if the
+  /// first occupied slot only holds timers of later revolutions.
+  [[nodiscard]] std::optional<TimePoint> Next() const {
+    if (size_ == 0) return std::nullopt;
+    auto tick = NextOccupied(next_tick_);
+    if (!tick) return std::nullopt;
+    return origin_ + *tick * kTick;
+  }
+
+  /// Pass every timer due by `now` to `fn` with its deadline, removing it.
+  /// `fn` may add timers.
+  template <typename Fn>
+  void Expire(TimePoint now, Fn &&fn) {
+    if (now < origin_) return;
+    auto last = static_cast<uint64_t>((now - origin_) / kTick);
+    // A whole revolution covers every slot.
+    uint64_t first = std::max(next_tick_, last >= kSlots ? last - kSlots + 1
+                                                          : uint64_t{0});
+    next_tick_ = last + 1;
+    for (auto tick = NextOccupied(first); tick && *tick <= last;
+         tick = NextOccupied(*tick + 1)) {
+      size_t slot = *tick & (kSlots - 1);
+      uint32_t index = std::exchange(slots_[slot], {kNone, kNone}).first;
+      occupied_[slot / 64] &= ~(uint64_t{1} << (slot % 64));
+      // `fn` may add timers, and grow the pool, so nothing in it is held on
+      // to across the call.
+      while (index != kNone) {
+        uint32_t next = timers_[index].next;
+        if (timers_[index].when > now) {
+          // Due in a later revolution.
+          Link(slot, index);
+        } else {
+          auto when = timers_[index].when;
+          Value value = std::move(timers_[index].value);
+          timers_[index].next = free_;
+          free_ = index;
+          size_--;
+          fn(when, std::move(value));
+        }
+        index = next;
+      }
+      if (size_ == 0) break;
+    }
+  }
+};
+
+/// A token bucket of `rate` tokens per second, holding up to `kBurst`
+/// seconds' worth (at least one). A probe may be sent while there is a
+/// token, and `Take` the cost of it.
+class TokenBucket {
+  static constexpr std::chrono::milliseconds kBurst{10};
+
+  double rate_, capacity_, tokens_;
+  TimePoint last_;
+
+ public:
+  TokenBucket(double rate, TimePoint now)
+      : rate_(rate),
+        capacity_(std::max(1.0, rate * std::chrono::duration<double>(kBurst)
+                                           .count())),
+        tokens_(capacity_),
+        last_(now) {}
+
+  /// When the next token will be there, or nothing if it is now.
+  [[nodiscard]] std::optional<TimePoint> Wait(TimePoint now) {
+    if (now > last_) {
+      tokens_ = std::min(
+          capacity_,
+          tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+      last_ = now;
+    }
+    if (tokens_ >= 1) return std::nullopt;
+    return last_ + std::chrono::duration_cast<ClockType::duration>(
+                       std::chrono::duration<double>((1 - tokens_) / rate_));
+  }
+
+  void Take(double cost) { tokens_ -= cost; }
+};
+
+/// Paces probes with token buckets: overall, for every destination, and for
+/// every /24 of destinations, which often share the routers close to them.
+/// A probe costs between 0.5 and 1.5 tokens at random, one on average, so
+/// that probes are not spaced regularly enough to fall into step with the
+/// token buckets that routers limit their ICMP errors with.
+class Scheduler {
+  static constexpr in_addr_t kPrefixMask = 0xffffff00;
+
+  double destination_rate_, prefix_rate_;
+  std::optional<TokenBucket> global_;
+  std::unordered_map<in_addr_t, TokenBucket> destinations_, prefixes_;
+  std::mt19937 random_{std::random_device{}()};
+  std::uniform_real_distribution<double> cost_{0.5, 1.5};
+
+  /// The bucket of `key` in `buckets`, made on first use, if limited.
+  static TokenBucket *Bucket(
+      std::unordered_map<in_addr_t, TokenBucket> &buckets, in_addr_t key,
+      double rate, TimePoint now) {
+    if (rate <= 0) return nullptr;
+    return &buckets.try_emplace(key, rate, now).first->second;
+  }
+
+ public:
+  Scheduler(const Options &options, TimePoint now)
+      : destination_rate_(options.destination_rate),
+        prefix_rate_(options.prefix_rate) {
+    if (options.send_rate > 0) global_.emplace(options.send_rate, now);
+  }
+
+  /// When any probe may be sent at the earliest, or nothing if now.
+  [[nodiscard]] std::optional<TimePoint> Wait(TimePoint now) {
+    return global_ ? global_->Wait(now) : std::nullopt;
+  }
+
+  /// Take the tokens to send a probe to `destination` if the limits of the
+  /// destination allow it now, given that `Wait` allows any. Otherwise,
+  /// return when they may.
+  std::optional<TimePoint> Acquire(struct in_addr destination,
+                                   TimePoint now) {
+    if (!global_ && destination_rate_ <= 0 && prefix_rate_ <= 0)
+      return std::nullopt;
+    std::array<TokenBucket *, 3> buckets = {
+        Bucket(destinations_, destination.s_addr, destination_rate_, now),
+        Bucket(prefixes_, ntohl(destination.s_addr) & kPrefixMask,
+               prefix_rate_, now),
+        global_ ? &*global_ : nullptr};
+    std::optional<TimePoint> wait;
+    for (auto *bucket : buckets) {
+      if (!bucket) continue;
+      auto until = bucket->Wait(now);
+      if (until && (!wait || *until > *wait)) wait = until;
+    }
+    if (wait) return wait;
+    double cost = cost_(random_);
+    for (auto *bucket : buckets) {
+      if (bucket) bucket->Take(cost);
+    }
+    return std::nullopt;
+  }
+};
+
+/// Replace `path` with the metrics of `client` and `resolver`, atomically,
+/// so that a collector (e.g., the textfile collector of the Prometheus node
+/// exporter) never reads a partial file.
+template <typename Client>
+void ExportMetrics(const std::string &path, const Client &client,
+                   const Resolver *resolver) {
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary);
+    if (!out) Fail(temporary);
+    client.WriteMetrics(out);
+    if (resolver) resolver->WriteMetrics(out);
+    if (!out.flush()) Fail(temporary);
+  }
+  if (rename(temporary.c_str(), path.c_str()) < 0) Fail("rename");
+}
+
+/// Read the routes kept in `path` by `WriteRoutes`, if it exists: one
+/// destination per line, then 1 if the route reached it and 0 otherwise,
+/// then the responder at every TTL from 1 on, or `*` if there was none.
+std::unordered_map<in_addr_t, Route> ReadRoutes(const std::string &path) {
+  std::unordered_map<in_addr_t, Route> routes;
+  std::ifstream file(path);
+  if (!file) return routes;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string destination, hop;
+    struct in_addr addr {};
+    Route route;
+    if (!(fields >> destination >> route.reached) ||
+        inet_pton(AF_INET, destination.c_str(), &addr) != 1)
+      continue;
+    while (fields >> hop) {
+      struct in_addr responder {};
+      if (hop == "*") {
+        route.hops.emplace_back();
+      } else if (inet_pton(AF_INET, hop.c_str(), &responder) == 1) {
+        route.hops.emplace_back(responder.s_addr);
+      } else {
+        break;
+      }
+    }
+    routes[addr.s_addr] = std::move(route);
+  }
+  return routes;
+}
+
+/// Replace `path` with `routes`, atomically, in the format of `ReadRoutes`.
+void WriteRoutes(const std::string &path,
+                 const std::unordered_map<in_addr_t, Route> &routes) {
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary);
+    if (!out) Fail(temporary);
+    auto print = [&](in_addr_t address) {
+      struct in_addr addr {};
+      addr.s_addr = address;
+      out << inet_ntoa(addr);
+    };
+    for (const auto &[destination, route] : routes) {
+      print(destination);
+      out << " " << route.reached;
+      for (const auto &hop : route.hops) {
+        out << " ";
+        if (hop) {
+          print(*hop);
+        } else {
+          out << "*";
+        }
+      }
+      out << "\n";
+    }
+    if (!out.flush()) Fail(temporary);
+  }
+  if (rename(temporary.c_str(), path.c_str()) < 0) Fail("rename");
+}
+
+ClockType::duration Seconds(double seconds) {
+  return std::chrono::duration_cast<ClockType::duration>(
+      std::chrono::duration<double>(seconds));
+}
+
+}  // namespace
+
+std::string Error::Message() const {
+  if (code == 0) return what;
+  return what + ": " + strerror(code);
+}
+
+int MaxRepeatedQueries(const Options &options) {
+  // MDA probes a hop as many times as it may need, whatever `-q` says, and
+  // two traces need two blocks of attempts for that.
+  if (options.multipath == MDA) {
+    size_t needed =
+        MdaStoppingPoints(options.confidence, kMaxResponders).back();
+    return needed <= (1 << ProbeId::kAttemptBits) / 2 ? kMaxQueries : 0;
+  }
+  // Classic UDP probes keep their attempt in the low bits of the port.
+  if (options.mode == UDP && options.multipath == CLASSIC)
+    return (1 << ProbeId::kCompactAttemptBits) / 2;
+  return kMaxQueries;
+}
+
+std::optional<Error> Validate(const Options &options) {
+  if (options.first_ttl < 1 || options.first_ttl > options.max_ttl ||
+      options.max_ttl > 255)
+    return Error{"TTLs out of range"};
+  if (options.nqueries < 1 || options.nqueries > kMaxQueries ||
+      options.sim_queries < 1)
+    return Error{"probe counts out of range"};
+  if (options.interval > 0 && options.nqueries > MaxRepeatedQueries(options))
+    return Error{"too many queries per hop for monitoring"};
+  if (options.send_rate < 0 || options.destination_rate < 0 ||
+      options.prefix_rate < 0)
+    return Error{"negative rate"};
+  if (options.gap_limit < 0 || options.wait_time <= 0 ||
+      options.interval < 0 || options.count < 0)
+    return Error{"negative limit"};
+  if (options.start_ttl != 0 && (options.start_ttl < options.first_ttl ||
+                                 options.start_ttl > options.max_ttl))
+    return Error{"start TTL out of range"};
+  // Up to rounding, as a percentage divided by 100 rarely is exact.
+  constexpr double kRounding = 1e-9;
+  if (options.confidence < 0.5 - kRounding ||
+      options.confidence > 0.999 + kRounding)
+    return Error{"confidence out of range"};
+  if (options.port < 1 || options.port > UINT16_MAX)
+    return Error{"port out of range"};
+  if (options.shards < 1 || options.shard < 0 ||
+      options.shard >= options.shards)
+    return Error{"shard out of range"};
+  if (options.count > 0 && options.interval == 0)
+    return Error{"a count of rounds without an interval"};
+  // Monitoring has to probe every hop of every round.
+  if (options.start_ttl != 0 && options.interval > 0)
+    return Error{"stop sets with monitoring"};
+  // TCP probes could only vary their flow by the source port, of which
+  // there is one. Monitoring and the stop sets expect a single responder per
+  // hop.
+  if (options.multipath == MDA &&
+      (options.mode == TCP || options.interval > 0 || options.start_ttl != 0))
+    return Error{"MDA with TCP, monitoring or stop sets"};
+  // An incremental re-trace chooses its own hops, and expects one responder
+  // at each of them.
+  if (!options.cache_file.empty() &&
+      (options.interval > 0 || options.start_ttl != 0 ||
+       options.multipath == MDA))
+    return Error{"a route cache with monitoring, stop sets or MDA"};
+  return std::nullopt;
+}
+
+int ShardOf(struct in_addr addr, int shards) {
+  uint32_t folded = ntohl(addr.s_addr);
+  folded ^= folded >> 16;
+  folded ^= folded >> 8;
+  return static_cast<int>(folded % static_cast<uint32_t>(shards));
+}
+
+Result<std::vector<struct in_addr>> LookUp(const std::string &host) {
+  hostent *entry = gethostbyname(host.c_str());
+  if (!entry || !entry->h_addr_list || !entry->h_addr_list[0])
+    return Error{"unknown host " + host};
+  std::vector<struct in_addr> addrs;
+  for (auto **addr = reinterpret_cast<in_addr **>(entry->h_addr_list); *addr;
+       ++addr)
+    addrs.push_back(**addr);
+  return addrs;
+}
+
+/// What `Engine` forwards to, implemented for each mode by
+/// `ProbingEngine`.
+class Engine::Impl {
+ public:
+  Impl() = default;
+  Impl(const Impl &other) = delete;
+  Impl(Impl &&other) = delete;
+  Impl &operator=(const Impl &other) = delete;
+  Impl &operator=(Impl &&other) = delete;
+  virtual ~Impl() = default;
+
+  virtual void Add(Target target, TraceCallbacks callbacks) = 0;
+  [[nodiscard]] virtual size_t Active() const = 0;
+  [[nodiscard]] virtual int Fd() const = 0;
+  [[nodiscard]] virtual std::optional<TimePoint> Deadline() const = 0;
+  virtual std::optional<Error> Process(int timeout_ms) = 0;
+  virtual std::optional<Error> Watch(int fd, uint32_t events,
+                                     std::function<void()> on_ready) = 0;
+  virtual std::optional<Error> ModifyWatch(int fd, uint32_t events) = 0;
+  virtual void Unwatch(int fd) = 0;
+  [[nodiscard]] virtual ReceiveStats Stats() const = 0;
+  virtual std::optional<Error> Close() = 0;
+};
+
+namespace {
+
+/// Every trace at once. A single scheduler interleaves the probes of all
+/// traces, keeping up to `options.sim_queries` of them in flight per trace
+/// and at most `options.send_rate` probes per second overall, while one
+/// event loop collects the replies and matches them through a `ProbeTable`.
+/// With `options.metrics_file`, the metrics are exported every
+/// `kMetricsInterval` and once closed.
+///
+/// With `options.interval`, every trace is started again that long after
+/// the start of its previous round, over the same sockets, until
+/// `options.count` rounds are done. With `options.cache_file`, targets whose
+/// route is kept there are re-traced incrementally, and the routes found
+/// replace the ones kept.
+///
+/// The slot of a trace is freed once it is done, and reused later; traces
+/// to a destination that is being traced wait for it to finish.
+///
+/// `Client` is the client of the mode, chosen once by `Engine::Create()`:
+/// probes are sent and replies matched without an indirect call, and only
+/// the methods of `Engine` take one to get here.
+template <typename Client>
+class ProbingEngine final : public Engine::Impl {
+  static constexpr std::chrono::seconds kMetricsInterval{1};
+  // How long the slot of a finished trace is kept unused beyond its wait
+  // time, so that its timers have expired before the slot is reused.
+  static constexpr std::chrono::seconds kSlotQuarantine{1};
+
+  // A trace and the state of its rounds, or nothing while the slot is free.
+  struct Slot {
+    std::optional<Trace> trace;
+    TraceCallbacks callbacks;
+    // What the trace printed, unless `callbacks.output` takes it.
+    std::string output;
+    TimePoint round_start;
+    int round = 0;
+    // Whether the slot is in `ready_` or `parked_`.
+    bool queued = false;
+  };
+
+  Options options_;
+  Client client_;
+  EngineMetrics &metrics_;
+  ClockType::duration interval_, slot_quarantine_;
+  std::optional<Resolver> resolver_;
+  std::optional<StopSets> stop_sets_;
+  std::optional<TraceStore> store_;
+  std::unordered_map<in_addr_t, Route> routes_;
+  std::unordered_map<int, std::function<void()>> watches_;
+
+  // Stable as slots are added, which callbacks may do.
+  std::deque<Slot> slots_;
+  // The slot tracing each destination, the traces waiting for it, and how
+  // many traces each destination had, which offsets their attempt numbers.
+  // A count outlives the last trace to its destination by the quarantine of
+  // slots, while replies to it may still come, and is then forgotten.
+  std::unordered_map<in_addr_t, size_t> by_address_;
+  std::unordered_map<in_addr_t, std::deque<std::pair<Target, TraceCallbacks>>>
+      waiting_;
+  struct Traced {
+    size_t count = 0;
+    TimePoint forget_at;
+  };
+  std::unordered_map<in_addr_t, Traced> traced_;
+  std::deque<std::pair<TimePoint, in_addr_t>> untraced_;
+  // Free slots, and from when they may be reused.
+  std::deque<std::pair<TimePoint, size_t>> vacated_;
+  // Slots whose header is yet to be delivered.
+  std::vector<size_t> started_;
+  size_t active_ = 0;
+
+  Scheduler scheduler_;
+  // When the overall rate allows the next probe, if `ready_` is not empty.
+  TimePoint next_slot_;
+  std::optional<TimePoint> next_export_;
+  // When to start the next round of each trace.
+  TimerWheel<size_t> restarts_;
+  // Traces that may send, visited round-robin, or, if they are over the
+  // rate of their destination, parked until it allows another probe.
+  RingQueue<size_t> ready_;
+  TimerWheel<size_t> parked_;
+  // When to give up on outstanding probes, by slot and probe. A timer is
+  // stale if the deadline of its probe has changed since.
+  TimerWheel<std::pair<size_t, size_t>> expiry_;
+  ProbeTable table_;
+  // Traces whose output waits for a name, and until when at the latest.
+  std::unordered_map<size_t, TimePoint> naming_;
+  // What a trace printed, on its way to the trace's callback.
+  std::string output_;
+
+  Resolver *GetResolver() { return resolver_ ? &*resolver_ : nullptr; }
+
+  void Enqueue(size_t slot) {
+    if (slots_[slot].queued) return;
+    slots_[slot].queued = true;
+    ready_.push_back(slot);
+  }
+
+  void Launch(Target target, TraceCallbacks callbacks) {
+    in_addr_t address = target.addr.sin_addr.s_addr;
+    if (!by_address_.emplace(address, 0).second) {
+      waiting_[address].emplace_back(std::move(target), std::move(callbacks));
+      return;
+    }
+    auto now = ClockType::now();
+    while (!untraced_.empty() && untraced_.front().first <= now) {
+      auto traced = traced_.find(untraced_.front().second);
+      untraced_.pop_front();
+      // Unless traced again since.
+      if (traced != traced_.end() && traced->second.forget_at <= now &&
+          !by_address_.count(traced->first))
+        traced_.erase(traced);
+    }
+    size_t slot = slots_.size();
+    if (!vacated_.empty() && vacated_.front().first <= now) {
+      slot = vacated_.front().second;
+      vacated_.pop_front();
+    } else {
+      slots_.emplace_back();
+    }
+    by_address_[address] = slot;
+    auto &entry = slots_[slot];
+    entry.trace.emplace(std::move(target), options_, GetResolver(),
+                        stop_sets_ ? &*stop_sets_ : nullptr,
+                        traced_[address].count++);
+    auto route = routes_.find(address);
+    if (route != routes_.end()) entry.trace->Retrace(route->second);
+    entry.callbacks = std::move(callbacks);
+    entry.round_start = now;
+    entry.round = 0;
+    started_.push_back(slot);
+    Enqueue(slot);
+  }
+
+  /// Pass what the trace of `slot` has printed on, if anything.
+  void Deliver(size_t slot) {
+    auto &entry = slots_[slot];
+    output_.clear();
+    entry.trace->Flush(output_);
+    if (output_.empty()) return;
+    if (entry.callbacks.output) {
+      entry.callbacks.output(output_);
+    } else {
+      entry.output += output_;
+    }
+  }
+
+  /// Stop waiting for the probes of `slot` still in flight.
+  void Forget(size_t slot) {
+    const auto &trace = *slots_[slot].trace;
+    for (size_t probe : trace.InFlight())
+      table_.Erase(trace.GetProbeId(probe).Key());
+  }
+
+  /// The result of the round of `slot` that is `Done()`.
+  TraceResult GetResult(size_t slot) {
+    auto &entry = slots_[slot];
+    const auto &trace = *entry.trace;
+    TraceResult result;
+    result.probes.reserve(trace.Size());
+    result.target = trace.GetTarget();
+    result.reached = trace.Reached();
+    result.round = entry.round;
+    for (size_t index = 0; index < trace.Size(); ++index) {
+      const auto &probe = trace.GetProbe(index);
+      if (probe.skipped) continue;
+      ProbeOutcome outcome;
+      outcome.ttl = probe.ttl;
+      outcome.status = probe.status;
+      if (probe.status != TIMEOUT) {
+        auto addr = probe.responder;
+        outcome.responder = addr;
+        const std::string *name = resolver_ ? resolver_->Find(addr) : nullptr;
+        if (name) outcome.name = *name;
+        outcome.rtt =
+            Timestamp::Elapsed(probe.send_time, probe.recv_time).first;
+      }
+      result.probes.push_back(std::move(outcome));
+    }
+    std::swap(result.output, entry.output);
+    return result;
+  }
+
+  /// End the trace of `slot` with `result`, free the slot and start the
+  /// next trace to its destination.
+  void Finish(size_t slot, TraceResult result) {
+    Forget(slot);
+    auto &entry = slots_[slot];
+    auto callbacks = std::exchange(entry.callbacks, {});
+    in_addr_t address = entry.trace->GetTarget().addr.sin_addr.s_addr;
+    entry.trace.reset();
+    vacated_.emplace_back(ClockType::now() + slot_quarantine_, slot);
+    by_address_.erase(address);
+    active_--;
+    auto next = waiting_.find(address);
+    if (next != waiting_.end()) {
+      auto [target, next_callbacks] = std::move(next->second.front());
+      next->second.pop_front();
+      if (next->second.empty()) waiting_.erase(next);
+      Launch(std::move(target), std::move(next_callbacks));
+    } else {
+      auto forget_at = ClockType::now() + slot_quarantine_;
+      traced_[address].forget_at = forget_at;
+      untraced_.emplace_back(forget_at, address);
+    }
+    // Last, as it may destroy whatever added the trace, such as a coroutine.
+    if (callbacks.done) callbacks.done(result);
+  }
+
+  /// Print what the trace of `slot` can by now, and see to the end of its
+  /// round.
+  void Update(size_t slot) {
+    auto &entry = slots_[slot];
+    auto &trace = *entry.trace;
+    if (trace.Done()) return;
+    if (auto give_up = trace.Print()) {
+      naming_[slot] = *give_up;
+    } else {
+      naming_.erase(slot);
+    }
+    Deliver(slot);
+    if (!trace.Done()) {
+      if (trace.CanSend()) Enqueue(slot);
+      return;
+    }
+    if (store_) store_->Record(trace, entry.round_start, GetResolver());
+    auto result = GetResult(slot);
+    if (options_.interval > 0) {
+      result.last = options_.count > 0 && entry.round + 1 == options_.count;
+    } else {
+      metrics_.probes_skipped.Add(trace.Skipped());
+      if (!options_.cache_file.empty()) {
+        in_addr_t address = trace.GetTarget().addr.sin_addr.s_addr;
+        auto previous = routes_.find(address);
+        routes_[address] = trace.GetRoute(
+            previous != routes_.end() ? &previous->second : nullptr);
+      }
+    }
+    if (result.last) {
+      Finish(slot, std::move(result));
+      return;
+    }
+    // Probes past the end of the round are of no interest any more.
+    Forget(slot);
+    entry.round++;
+    restarts_.Insert(entry.round_start + interval_, slot);
+    if (entry.callbacks.done) entry.callbacks.done(result);
+  }
+
+  /// Send what the scheduler allows of the probes of the traces in
+  /// `ready_`.
+  void Send(TimePoint now) {
+    while (!ready_.empty()) {
+      if (auto wait = scheduler_.Wait(now)) {
+        next_slot_ = *wait;
+        break;
+      }
+      size_t slot = ready_.front();
+      ready_.pop_front();
+      auto &entry = slots_[slot];
+      if (!entry.trace || !entry.trace->CanSend()) {
+        entry.queued = false;
+        continue;
+      }
+      auto &trace = *entry.trace;
+      if (auto wait = scheduler_.Acquire(trace.GetTarget().addr.sin_addr,
+                                         now)) {
+        parked_.Insert(*wait, slot);
+        continue;
+      }
+      size_t probe = trace.NextProbe(now);
+      auto id = trace.GetProbeId(probe);
+      client_.SendRequest(trace.GetTarget().addr, id, trace.GetFlow(probe));
+      metrics_.probes_sent.Add();
+      table_.Insert(id.Key(), {static_cast<uint32_t>(slot),
+                               static_cast<uint32_t>(probe)});
+      expiry_.Insert(trace.GetProbe(probe).deadline, {slot, probe});
+      if (trace.CanSend()) {
+        ready_.push_back(slot);
+      } else {
+        entry.queued = false;
+      }
+      now = ClockType::now();
+    }
+    client_.Flush();
+  }
+
+  /// Time out `probe` of the trace in `slot`.
+  void GiveUp(size_t slot, size_t probe) {
+    auto &trace = *slots_[slot].trace;
+    trace.OnTimeout(probe);
+    auto id = trace.GetProbeId(probe);
+    metrics_.hops[id.ttl].timeouts.Add();
+    table_.Erase(id.Key());
+    Update(slot);
+  }
+
+  void HandleEvents(Events &events) {
+    auto polled = ClockType::now();
+    for (const auto &stamp : events.sent) {
+      auto entry = table_.Find(stamp.id.Key());
+      if (!entry) continue;
+      auto &trace = *slots_[entry->trace].trace;
+      // Only the first timestamp of a probe follows its userspace one.
+      const auto &send_time = trace.GetProbe(entry->probe).send_time;
+      if (send_time.source == USERSPACE &&
+          stamp.send_time.source != USERSPACE)
+        metrics_.send_latency.Observe(stamp.send_time.time - send_time.time);
+      trace.OnSent(entry->probe, stamp.send_time);
+    }
+    for (const auto &reply : events.replies) {
+      if (reply.recv_time.source != USERSPACE)
+        metrics_.receive_latency.Observe(polled - reply.recv_time.time);
+      // Late or foreign replies are no longer (or never were) in the table.
+      auto entry = table_.Find(reply.id.Key());
+      if (!entry) {
+        metrics_.replies_late.Add();
+        continue;
+      }
+      table_.Erase(reply.id.Key());
+      auto &trace = *slots_[entry->trace].trace;
+      trace.OnReply(entry->probe, reply);
+      const auto &probe = trace.GetProbe(entry->probe);
+      metrics_.replies_matched.Add();
+      metrics_.hops[reply.id.ttl].rtt.Observe(
+          Timestamp::Elapsed(probe.send_time, probe.recv_time).first);
+      trace.Tighten([&](size_t probe) {
+        expiry_.Insert(trace.GetProbe(probe).deadline, {entry->trace, probe});
+      });
+      if (resolver_ && reply.status != TIMEOUT) {
+        resolver_->Request(reply.responder);
+      }
+      Update(entry->trace);
+    }
+    for (const auto &id : events.lost) {
+      if (auto entry = table_.Find(id.Key()))
+        GiveUp(entry->trace, entry->probe);
+    }
+    for (int fd : events.ready) {
+      if (resolver_ && fd == resolver_->Fd()) {
+        resolver_->Collect();
+        continue;
+      }
+      // Handlers may unwatch any descriptor, their own included.
+      auto watch = watches_.find(fd);
+      if (watch == watches_.end()) continue;
+      auto on_ready = watch->second;
+      on_ready();
+    }
+    if (!naming_.empty()) {
+      std::vector<size_t> waiting;
+      for (auto [slot, give_up] : naming_) waiting.push_back(slot);
+      for (size_t slot : waiting) Update(slot);
+    }
+  }
+
+  void Step(int timeout_ms) {
+    for (size_t slot : std::exchange(started_, {})) {
+      if (slots_[slot].trace) Deliver(slot);
+    }
+    auto now = ClockType::now();
+    restarts_.Expire(now, [&](TimePoint /*when*/, size_t slot) {
+      auto &entry = slots_[slot];
+      entry.trace->Restart();
+      entry.round_start = now;
+      Enqueue(slot);
+    });
+    parked_.Expire(now, [&](TimePoint /*when*/, size_t slot) {
+      ready_.push_back(slot);
+    });
+    Send(now);
+
+    if (auto deadline = Deadline()) {
+      auto until = static_cast<int>(std::max<int64_t>(
+          0, std::chrono::ceil<std::chrono::milliseconds>(*deadline -
+                                                          ClockType::now())
+                 .count()));
+      timeout_ms = timeout_ms < 0 ? until : std::min(timeout_ms, until);
+    }
+    HandleEvents(client_.Poll(timeout_ms));
+
+    now = ClockType::now();
+    expiry_.Expire(now, [&](TimePoint when, std::pair<size_t, size_t> timer) {
+      auto [slot, probe] = timer;
+      // The trace may be finished and gone.
+      if (!slots_[slot].trace) return;
+      auto &trace = *slots_[slot].trace;
+      if (trace.GetProbe(probe).done || trace.GetProbe(probe).deadline != when)
+        return;
+      // RTTs measured later, or the kernel send timestamp, may have moved
+      // the deadline back.
+      if (trace.Reschedule(probe) && trace.GetProbe(probe).deadline > now) {
+        expiry_.Insert(trace.GetProbe(probe).deadline, timer);
+        return;
+      }
+      GiveUp(slot, probe);
+    });
+
+    if (next_export_ && *next_export_ <= now) {
+      ExportMetrics(options_.metrics_file, client_, GetResolver());
+      next_export_ = now + kMetricsInterval;
+    }
+  }
+
+ public:
+  explicit ProbingEngine(const Options &options)
+      : options_(options),
+        client_(options),
+        metrics_(client_.Metrics()),
+        interval_(Seconds(options.interval)),
+        slot_quarantine_(Seconds(options.wait_time) + kSlotQuarantine),
+        scheduler_(options, ClockType::now()),
+        next_slot_(ClockType::now()) {
+    if (options.resolve) {
+      resolver_.emplace();
+      client_.AddWatch(resolver_->Fd());
+    }
+    if (options.start_ttl != 0) stop_sets_.emplace();
+    if (!options.store_file.empty()) store_.emplace(options.store_file);
+    if (!options.cache_file.empty()) routes_ = ReadRoutes(options.cache_file);
+    if (!options.metrics_file.empty())
+      next_export_ = next_slot_ + kMetricsInterval;
+  }
+
+  void Add(Target target, TraceCallbacks callbacks) override {
+    active_++;
+    Launch(std::move(target), std::move(callbacks));
+  }
+
+  [[nodiscard]] size_t Active() const override { return active_; }
+  [[nodiscard]] int Fd() const override { return client_.Fd(); }
+
+  [[nodiscard]] std::optional<TimePoint> Deadline() const override {
+    std::optional<TimePoint> deadline = expiry_.Next();
+    auto wake_by = [&](std::optional<TimePoint> when) {
+      if (when && (!deadline || *when < *deadline)) deadline = when;
+    };
+    if (!ready_.empty()) wake_by(next_slot_);
+    if (!started_.empty()) wake_by(ClockType::now());
+    wake_by(client_.Due());
+    wake_by(parked_.Next());
+    wake_by(restarts_.Next());
+    wake_by(next_export_);
+    for (auto [slot, give_up] : naming_) wake_by(give_up);
+    return deadline;
+  }
+
+  std::optional<Error> Process(int timeout_ms) override {
+    try {
+      Step(timeout_ms);
+    } catch (Error &error) {
+      return error;
+    }
+    return store_ ? store_->GetError() : std::nullopt;
+  }
+
+  std::optional<Error> Watch(int fd, uint32_t events,
+                             std::function<void()> on_ready) override {
+    try {
+      client_.AddWatch(fd, events);
+    } catch (Error &error) {
+      return error;
+    }
+    watches_[fd] = std::move(on_ready);
+    return std::nullopt;
+  }
+
+  std::optional<Error> ModifyWatch(int fd, uint32_t events) override {
+    try {
+      client_.ModifyWatch(fd, events);
+    } catch (Error &error) {
+      return error;
+    }
+    return std::nullopt;
+  }
+
+  void Unwatch(int fd) override {
+    client_.RemoveWatch(fd);
+    watches_.erase(fd);
+  }
+
+  [[nodiscard]] ReceiveStats Stats() const override {
+    return client_.Stats();
+  }
+
+  std::optional<Error> Close() override {
+    try {
+      if (!options_.metrics_file.empty())
+        ExportMetrics(options_.metrics_file, client_, GetResolver());
+      if (!options_.cache_file.empty())
+        WriteRoutes(options_.cache_file, routes_);
+    } catch (Error &error) {
+      return error;
+    }
+    return store_ ? store_->Close() : std::nullopt;
+  }
+};
+
+/// The engine of `options.mode`, which is not looked at again.
+std::unique_ptr<Engine::Impl> BuildEngine(const Options &options) {
+  switch (options.mode) {
+    case UDP:
+      return std::make_unique<ProbingEngine<UDPClient>>(options);
+    case TCP:
+      return std::make_unique<ProbingEngine<TCPClient>>(options);
+    case ICMP:
+      return std::make_unique<ProbingEngine<ICMPClient>>(options);
+  }
+  __builtin_unreachable();
+}
+
+}  // namespace
+
+Result<std::unique_ptr<Engine>> Engine::Create(const Options &options) {
+  if (auto error = Validate(options)) return *error;
+  try {
+    return std::unique_ptr<Engine>(new Engine(BuildEngine(options)));
+  } catch (Error &error) {
+    return error;
+  }
+}
+
+Engine::Engine(std::unique_ptr<Impl> impl) : impl_(std::move(impl)) {}
+Engine::~Engine() = default;
+
+void Engine::Add(Target target, TraceCallbacks callbacks) {
+  impl_->Add(std::move(target), std::move(callbacks));
+}
+
+size_t Engine::Active() const { return impl_->Active(); }
+int Engine::Fd() const { return impl_->Fd(); }
+
+std::optional<TimePoint> Engine::Deadline() const {
+  return impl_->Deadline();
+}
+
+std::optional<Error> Engine::Process(int timeout_ms) {
+  return impl_->Process(timeout_ms);
+}
+
+std::optional<Error> Engine::Watch(int fd, uint32_t events,
+                                   std::function<void()> on_ready) {
+  return impl_->Watch(fd, events, std::move(on_ready));
+}
+
+std::optional<Error> Engine::ModifyWatch(int fd, uint32_t events) {
+  return impl_->ModifyWatch(fd, events);
+}
+
+void Engine::Unwatch(int fd) { impl_->Unwatch(fd); }
+ReceiveStats Engine::Stats() const { return impl_->Stats(); }
+std::optional<Error> Engine::Close() { return impl_->Close(); }
+
+}  // namespace traceroute
@@ -0,0 +1,300 @@
+#ifndef TRACEROUTE_TRACER_H_
+#define TRACEROUTE_TRACER_H_
+
+// The probing engine as a library. An `Engine` owns its sockets and traces
+// any number of targets at once, without threads of its own beyond those of
+// the name resolver and the store writer. It never blocks unless asked to,
+// so that it can be driven by the event loop of its embedder: wait for
+// `Fd()` to become readable or for `Deadline()` to pass, whichever comes
+// first, then call `Process()`. Results are passed to callbacks from within
+// `Process()`, on its thread. No function exits the program; failures are
+// returned as an `Error`.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define TRACEROUTE_COROUTINES 1
+#endif
+
+namespace traceroute {
+
+using ClockType = std::chrono::steady_clock;
+using TimePoint = std::chrono::time_point<ClockType>;
+
+enum Mode { ICMP, TCP, UDP };
+// How probes choose their flow identifier, which load balancers hash: one
+// per probe, the same for all (Paris traceroute), or as many as it takes to
+// find every next hop (the Multipath Detection Algorithm).
+enum Multipath { CLASSIC, PARIS, MDA };
+
+enum ICMPStatus : uint8_t {
+  DESTINATION_REACHED,
+  TIMEOUT,
+  TTL_EXPIRED,
+  HOST_UNREACHABLE,
+  NETWORK_UNREACHABLE,
+  PROTOCOL_UNREACHABLE,
+};
+
+/// What went wrong: what was attempted and, for a system call, its errno.
+struct Error {
+  std::string what;
+  int code = 0;
+
+  /// As perror() would print it.
+  [[nodiscard]] std::string Message() const;
+};
+
+/// A value, or the error that prevented it.
+template <typename T>
+class Result {
+  std::variant<T, Error> value_;
+
+ public:
+  Result(T value) : value_(std::move(value)) {}      // NOLINT
+  Result(Error error) : value_(std::move(error)) {}  // NOLINT
+
+  explicit operator bool() const { return value_.index() == 0; }
+  T &operator*() { return std::get<0>(value_); }
+  T *operator->() { return &std::get<0>(value_); }
+  [[nodiscard]] const Error &GetError() const { return std::get<1>(value_); }
+};
+
+/// The most probes per hop that `Validate` accepts.
+constexpr int kMaxQueries = 10;
+
+/// How to probe, shared by every trace of an engine.
+struct Options {
+  Mode mode = UDP;
+  int nqueries = 3;
+  int first_ttl = 1;
+  int max_ttl = 30;
+  int sim_queries = 16;
+  // Destination port of TCP probes.
+  int port = 80;
+  // Consecutive silent hops after which a trace stops; 0 means never.
+  int gap_limit = 0;
+  // Where traces start with Doubletree stop sets; 0 means without them.
+  int start_ttl = 0;
+  Multipath multipath = CLASSIC;
+  // With MDA, the probability of finding every next hop of a hop.
+  double confidence = 0.95;
+  double wait_time = 5.0;
+  // Probes per second over all targets, to each target and to each /24 of
+  // targets; 0 means unlimited.
+  double send_rate = 0.0;
+  double destination_rate = 0.0;
+  double prefix_rate = 0.0;
+  // Seconds between the rounds of continuous monitoring; 0 means a single
+  // round. Rounds per target, with 0 meaning until the engine is closed.
+  double interval = 0.0;
+  int count = 0;
+  bool resolve = true;
+  bool extensions = false;
+  // Of several engines side by side, one per thread, this one traces the
+  // destinations that `ShardOf()` puts in `shard` of `shards`, and reads
+  // only the replies about them; any other destination would never seem to
+  // answer.
+  int shard = 0;
+  int shards = 1;
+  // Read ICMP replies from a memory-mapped AF_PACKET ring rather than a raw
+  // socket, unless the kernel has none to offer.
+  bool packet_ring = false;
+  // Send probes and receive replies through an io_uring, which batches the
+  // system calls of a round of the event loop into one, unless the kernel
+  // has none to offer; epoll and plain system calls otherwise.
+  bool io_uring = false;
+  // Where to record every probe sent and packet received as a pcap file, if
+  // anywhere.
+  std::string record_file;
+  // A recording to replay instead of probing the network, if any, which
+  // takes no sockets or privileges. Its packets are received as soon as
+  // their probe is sent again, or as long after it as they were then if
+  // `replay_timing` is set, and with the RTTs of the recording either way.
+  std::string replay_file;
+  bool replay_timing = false;
+  // Where to keep the metrics in the Prometheus text format, if anywhere.
+  std::string metrics_file;
+  // Where to append the results in the format of store.h, if anywhere.
+  std::string store_file;
+  // Where the route to every target is kept between runs, for incremental
+  // re-tracing, if anywhere.
+  std::string cache_file;
+};
+
+/// Why `options` cannot be traced with, if they cannot.
+std::optional<Error> Validate(const Options &options);
+
+/// The most queries per hop with which traces to a destination one after
+/// the other, as rounds of monitoring or jobs of a daemon, still send
+/// distinct probes: fewer than `kMaxQueries` in classic UDP mode, and none
+/// with MDA at a confidence that takes more than half the attempt numbers of
+/// a hop, as above 99.2%.
+int MaxRepeatedQueries(const Options &options);
+
+/// The shard of `shards` that traces `addr`: its address, in host byte
+/// order, with every byte folded into the lowest, modulo `shards`, so that
+/// destinations that differ in any byte spread evenly.
+int ShardOf(struct in_addr addr, int shards);
+
+struct Target {
+  std::string hostname;
+  struct sockaddr_in addr;
+};
+
+/// The addresses of `host`, a name or a dotted quad, in the order the
+/// resolver gave them.
+Result<std::vector<struct in_addr>> LookUp(const std::string &host);
+
+/// The outcome of one probe of a trace.
+struct ProbeOutcome {
+  int ttl = 0;
+  ICMPStatus status = TIMEOUT;
+  // Unless the probe timed out.
+  std::optional<struct in_addr> responder;
+  // Of the responder, if it has one and it is known by now.
+  std::string name;
+  ClockType::duration rtt{};
+};
+
+/// A trace, or a round of it when monitoring, once done.
+struct TraceResult {
+  Target target;
+  // Of every probe sent, in hop order; hops that were left out, as known
+  // from other traces or the previous route, are not.
+  std::vector<ProbeOutcome> probes;
+  bool reached = false;
+  // Counted from 0, and whether no other round follows.
+  int round = 0;
+  bool last = true;
+  // What the trace printed, unless `TraceCallbacks::output` took it.
+  std::string output;
+};
+
+/// Called from `Engine::Process()`, which they may add traces to.
+struct TraceCallbacks {
+  // What the trace prints, in the format of traceroute, as hops complete.
+  std::function<void(std::string_view text)> output;
+  // Once a trace or a round of it is done.
+  std::function<void(const TraceResult &result)> done;
+};
+
+/// Counters of the receive socket.
+struct ReceiveStats {
+  uint64_t seen = 0;     // ICMP messages read by userspace
+  uint64_t matched = 0;  // Of which answered one of our probes
+  // ICMP messages dropped by the socket filter, if the kernel counters can
+  // be read.
+  std::optional<uint64_t> rejected;
+  // Whether replies were read from the ring of `Options::packet_ring`.
+  bool packet_ring = false;
+  // Whether probes were sent and replies received through the io_uring of
+  // `Options::io_uring`.
+  bool io_uring = false;
+  // Whether packets were replayed from `Options::replay_file`.
+  bool replay = false;
+};
+
+class Engine {
+ public:
+  class Impl;
+
+  /// Open the sockets of `options.mode` (which takes CAP_NET_RAW), and the
+  /// files of `options`.
+  static Result<std::unique_ptr<Engine>> Create(const Options &options);
+
+  Engine(const Engine &other) = delete;
+  Engine(Engine &&other) = delete;
+  Engine &operator=(const Engine &other) = delete;
+  Engine &operator=(Engine &&other) = delete;
+  ~Engine();
+
+  /// Trace `target`, once the traces to its destination added before are
+  /// done.
+  void Add(Target target, TraceCallbacks callbacks);
+
+  /// The traces added and not done yet, including the last rounds of those
+  /// that are monitored.
+  [[nodiscard]] size_t Active() const;
+
+  /// Readable when `Process()` has events to handle.
+  [[nodiscard]] int Fd() const;
+
+  /// When `Process()` has to be called next at the latest, if it has to.
+  [[nodiscard]] std::optional<TimePoint> Deadline() const;
+
+  /// Send the probes that are due, handle the replies and timeouts, and call
+  /// back. With a `timeout_ms`, wait that long at most (forever if -1) for
+  /// something to do first, or until `Deadline()` if that is sooner. After
+  /// an error, the engine is of no further use.
+  std::optional<Error> Process(int timeout_ms = 0);
+
+  /// Have `Process()` also wait for `events` (as of epoll) on `fd`, and call
+  /// `on_ready` when they happen. For embedders whose loop is the engine's.
+  std::optional<Error> Watch(int fd, uint32_t events,
+                             std::function<void()> on_ready);
+  /// Wait for `events` on `fd`, watched before, from now on.
+  std::optional<Error> ModifyWatch(int fd, uint32_t events);
+  /// Stop waiting for `fd`, before it is closed.
+  void Unwatch(int fd);
+
+  /// The receive counters so far.
+  [[nodiscard]] ReceiveStats Stats() const;
+
+  /// Export the metrics and save the routes for the last time, and write
+  /// the results not written yet. The traces still active are abandoned.
+  std::optional<Error> Close();
+
+#ifdef TRACEROUTE_COROUTINES
+  /// `co_await engine.Trace(target)` suspends the coroutine until the trace
+  /// is done, and resumes it from within `Process()` with its result.
+  class Awaitable {
+    Engine &engine_;
+    Target target_;
+    std::optional<TraceResult> result_;
+
+   public:
+    Awaitable(Engine &engine, Target target)
+        : engine_(engine), target_(std::move(target)) {}
+
+    [[nodiscard]] bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      engine_.Add(std::move(target_),
+                  {nullptr, [this, handle](const TraceResult &result) {
+                     if (!result.last) return;
+                     result_ = result;
+                     handle.resume();
+                   }});
+    }
+
+    TraceResult await_resume() { return std::move(*result_); }
+  };
+
+  Awaitable Trace(Target target) { return {*this, std::move(target)}; }
+#endif
+
+ private:
+  explicit Engine(std::unique_ptr<Impl> impl);
+
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace traceroute
+
+#endif  // TRACEROUTE_TRACER_H_
@@ -1,65 +1,82 @@
 #include <arpa/inet.h>
-#include <fcntl.h>
-#include <netdb.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <chrono>
-#include <climits>
+#include <cmath>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
-#include <variant>
 #include <vector>
 
-namespace {
-
-constexpr int kIpHeaderSize = 20;
-constexpr int kIcmpIdentifier = 0x7122, kIcmpSeqNum = 0x1234;
-constexpr uint16_t kInitialPort = 33435;
-
-// Perform DNS lookup
-in_addr LookUp(const char *domain) {
-  hostent *host = gethostbyname(domain);
-  if (!host || !host->h_addr_list) {
-    std::cerr << "traceroute: unknown host " << domain << "\n";
-    exit(1);
-  }
-  auto **addr_list = reinterpret_cast<in_addr **>(host->h_addr_list);
-  if (!addr_list || !addr_list[0]) {
-    std::cerr << "traceroute: unknown host " << domain << "\n";
-    exit(1);
-  }
-  int num_ip = 0;
-  while (addr_list[num_ip]) num_ip++;
-  if (num_ip > 1) {
-    std::cerr << "traceroute: Warning: " << domain
-              << " has multiple addresses; using " << inet_ntoa(*addr_list[0])
-              << "\n";
-  }
-  return *addr_list[0];
-}
+#include "tracer.h"
 
-enum Mode { ICMP, TCP, UDP };
+namespace {
 
-struct Config {
-  Mode mode = UDP;
-  int nqueries = 3;
-  int first_ttl = 1;
-  int max_ttl = 30;
-  double wait_time = 5.0;
-  char *hostname;
+using traceroute::ClockType;
+using traceroute::ICMP;
+using traceroute::MDA;
+using traceroute::PARIS;
+using traceroute::CLASSIC;
+using traceroute::ProbeOutcome;
+using traceroute::Target;
+using traceroute::TCP;
+using traceroute::TIMEOUT;
+using traceroute::TraceResult;
+
+// Beyond which threads only contend for CPUs.
+constexpr int kMaxJobs = 256;
+
+/// The options of the engine, and what to trace with them.
+struct Config : traceroute::Options {
+  bool statistics = false;
+  // Worker threads, each with an engine and a share of the targets.
+  int jobs = 1;
+  char *hostname = nullptr;
+  char *targets_file = nullptr;
+  // The socket to take jobs on as a daemon, or to submit them to.
+  char *listen_socket = nullptr;
+  char *submit_socket = nullptr;
 };
 
 [[noreturn]] void PrintUsage() {
   std::cerr << "Usage:\n";
-  std::cerr << "  traceroute [ -IT ] [ -f first_ttl ] [ -q nqueries ] [ -m "
-               "max_ttl ] [ -w waittime ] host\n";
+  std::cerr << "  traceroute [ -ITneSrUx ] [ -f first_ttl ] [ -q nqueries ] [ "
+               "-m max_ttl ] [ -N squeries ] [ -w waittime ] [ -R rate ] [ -D "
+               "rate ] [ -P rate ] [ -G gaplimit ] [ -H start_ttl ] [ -a "
+               "classic|paris|mda ] [ -C confidence ] [ -p port ] [ -M "
+               "metrics_file ] [ -o store_file ] [ -u cache_file ] [ -i "
+               "interval ] [ -c count ] [ -j jobs ] [ -W record_file ] [ -X "
+               "replay_file ] host\n";
+  std::cerr << "  traceroute [ options ] -F targets_file\n";
+  std::cerr << "  traceroute [ options ] -L socket\n";
+  std::cerr << "  traceroute -A socket [ -F targets_file | host ]\n";
   exit(1);
 }
 
@@ -68,6 +85,15 @@ struct Config {
   exit(1);
 }
 
+[[noreturn]] void PrintError(const traceroute::Error &error) {
+  std::cerr << "traceroute: " << error.Message() << "\n";
+  exit(1);
+}
+
+void Check(const std::optional<traceroute::Error> &error) {
+  if (error) PrintError(*error);
+}
+
 Config ParseArg(int argc, char *argv[]) {
   Config config{};
 
@@ -85,551 +111,997 @@ Config ParseArg(int argc, char *argv[]) {
   auto ParseFloat = [&]() {
     if (optind == argc) PrintUsage();
     try {
-      return std::stof(argv[optind++]);
+      return std::stod(argv[optind++]);
     } catch (...) {
       PrintUsage();
     }
   };
 
-  for (int opt = getopt(argc, argv, "fmqwIT"); opt != -1;
-       opt = getopt(argc, argv, "fmqwIT")) {
+  // NOLINTNEXTLINE
+  auto ParseString = [&]() {
+    if (optind == argc) PrintUsage();
+    return argv[optind++];
+  };
+
+  for (int opt = getopt(argc, argv, "fmqwNRDPGHaCpFMouLAicjWXITneSrUx");
+       opt != -1;
+       opt = getopt(argc, argv, "fmqwNRDPGHaCpFMouLAicjWXITneSrUx")) {
     if (opt == 'I') config.mode = ICMP;
     if (opt == 'T') config.mode = TCP;
+    if (opt == 'n') config.resolve = false;
+    if (opt == 'e') config.extensions = true;
+    if (opt == 'S') config.statistics = true;
+    if (opt == 'r') config.packet_ring = true;
+    if (opt == 'U') config.io_uring = true;
+    if (opt == 'x') config.replay_timing = true;
 
     if (opt == 'f') config.first_ttl = ParseInt();
     if (opt == 'm') config.max_ttl = ParseInt();
     if (opt == 'q') config.nqueries = ParseInt();
+    if (opt == 'N') config.sim_queries = ParseInt();
     if (opt == 'w') config.wait_time = ParseFloat();
+    if (opt == 'R') config.send_rate = ParseFloat();
+    if (opt == 'D') config.destination_rate = ParseFloat();
+    if (opt == 'P') config.prefix_rate = ParseFloat();
+    if (opt == 'G') config.gap_limit = ParseInt();
+    if (opt == 'H') config.start_ttl = ParseInt();
+    if (opt == 'a') {
+      std::string multipath = ParseString();
+      if (multipath == "classic") {
+        config.multipath = CLASSIC;
+      } else if (multipath == "paris") {
+        config.multipath = PARIS;
+      } else if (multipath == "mda") {
+        config.multipath = MDA;
+      } else {
+        PrintUsage();
+      }
+    }
+    if (opt == 'C') config.confidence = ParseFloat() / 100;
+    if (opt == 'p') config.port = ParseInt();
+    if (opt == 'F') config.targets_file = ParseString();
+    if (opt == 'M') config.metrics_file = ParseString();
+    if (opt == 'o') config.store_file = ParseString();
+    if (opt == 'u') config.cache_file = ParseString();
+    if (opt == 'L') config.listen_socket = ParseString();
+    if (opt == 'A') config.submit_socket = ParseString();
+    if (opt == 'i') config.interval = ParseFloat();
+    if (opt == 'c') config.count = ParseInt();
+    if (opt == 'j') config.jobs = ParseInt();
+    if (opt == 'W') config.record_file = ParseString();
+    if (opt == 'X') config.replay_file = ParseString();
   }
 
+  // Counting rounds implies having them.
+  if (config.count > 0 && config.interval == 0) config.interval = 1.0;
+  if (traceroute::Validate(config)) PrintUsage();
+  // Shards would overwrite each other's metrics, routes and recordings, and
+  // a daemon has a single engine.
+  bool single = config.listen_socket || !config.metrics_file.empty() ||
+                !config.cache_file.empty() || !config.record_file.empty() ||
+                !config.replay_file.empty();
+  if (config.jobs < 1 || config.jobs > kMaxJobs || (config.jobs > 1 && single))
+    PrintUsage();
+  // A daemon traces what it is asked to, once each, though a destination
+  // may be asked for again.
+  if (config.listen_socket) {
+    if (config.targets_file || config.submit_socket ||
+        config.interval > 0 || optind != argc ||
+        config.nqueries > traceroute::MaxRepeatedQueries(config))
+      PrintUsage();
+    return config;
+  }
+  if (config.targets_file) {
+    if (optind != argc) PrintUsage();
+    return config;
+  }
   if (optind != argc - 1) PrintUsage();
   config.hostname = argv[optind];
   return config;
 }
 
-namespace icmp {
-
-// type
-constexpr uint8_t kEchoReply = 0x0;
-constexpr uint8_t kDestinationUnreachable = 0x3;
-constexpr uint8_t kEchoRequest = 0x8;
-constexpr uint8_t kTimeExceed = 11;
-
-// code
+/// A sketch of RTTs for streaming quantiles, after DDSketch: bucket `i`
+/// holds the values up to `kMin * kGamma^i`, so that every quantile is
+/// within `kAccuracy` of the true one, whatever the number of values, and two
+/// sketches merge by adding their buckets.
+class RttSketch {
+  static constexpr double kAccuracy = 0.02;
+  static constexpr double kGamma = (1 + kAccuracy) / (1 - kAccuracy);
+  static constexpr std::chrono::duration<double, std::micro> kMin{10};
+  // Up to about 90 s.
+  static constexpr size_t kBuckets = 400;
 
-// Destination unreachable
-constexpr uint8_t kNetworkUnreachable = 0x0;
-constexpr uint8_t kHostUnreachable = 0x1;
-constexpr uint8_t kProtocolUnreachable = 0x2;
-constexpr uint8_t kPortUnreachable = 0x3;
+  std::array<uint16_t, kBuckets> counts_{};
+  uint32_t total_ = 0;
 
-// Time exceeded
-constexpr uint8_t kTTLExpired = 0x0;
-constexpr uint8_t kFragmentReassemblyTimeExceeded = 0x1;
+ public:
+  /// At most as many values as a `uint16_t` holds.
+  void Add(ClockType::duration rtt) {
+    assert(total_ < UINT16_MAX && "Sketch full.");
+    auto ratio = std::chrono::duration<double, std::micro>(rtt) / kMin;
+    size_t bucket = 0;
+    if (ratio > 1) {
+      bucket = std::min(kBuckets - 1, static_cast<size_t>(std::ceil(
+                                          std::log(ratio) / std::log(kGamma))));
+    }
+    counts_[bucket]++;
+    total_++;
+  }
 
-}  // namespace icmp
+  void Merge(const RttSketch &other) {
+    for (size_t bucket = 0; bucket < kBuckets; ++bucket)
+      counts_[bucket] = static_cast<uint16_t>(counts_[bucket] +
+                                              other.counts_[bucket]);
+    total_ += other.total_;
+  }
 
-struct alignas(2) ICMPPacket {
-  // type + code + checksum + identifier + seq
-  static constexpr size_t kPacketSize = 8;
+  void Clear() { *this = {}; }
+
+  /// The `q`-quantile, if there are any values.
+  [[nodiscard]] std::optional<ClockType::duration> Quantile(double q) const {
+    if (total_ == 0) return std::nullopt;
+    auto rank = static_cast<uint32_t>(q * (total_ - 1));
+    uint32_t seen = 0;
+    size_t bucket = 0;
+    for (; bucket < kBuckets - 1; ++bucket) {
+      seen += counts_[bucket];
+      if (seen > rank) break;
+    }
+    // The middle of the bucket, relatively.
+    auto value = kMin * 2 * std::pow(kGamma, bucket) / (kGamma + 1);
+    return std::chrono::duration_cast<ClockType::duration>(value);
+  }
+};
 
-  uint8_t type;
-  uint8_t code;
-  uint16_t checksum;
-  uint16_t identifier;
-  uint16_t sequence_number;
+/// The statistics of one hop of a monitored path, in fixed memory whatever
+/// the number of rounds: totals, loss over the last `kWindow` probes, and
+/// quantiles over the last `kEpoch` to `2 * kEpoch` rounds.
+class HopStats {
+  static constexpr size_t kWindow = 128;
+  static constexpr size_t kEpoch = 32;
+  // Probes of a round, at most `kMaxQueries` of them.
+  static_assert(2 * kEpoch * traceroute::kMaxQueries < UINT16_MAX,
+                "Sketches must not overflow.");
+
+  uint64_t sent_ = 0, received_ = 0;
+  // Whether each of the last `kWindow` probes was lost, as a ring.
+  std::bitset<kWindow> lost_;
+  ClockType::duration last_{}, best_{}, worst_{}, total_{}, jitter_{};
+  struct in_addr responder_ {};
+  std::string name_;
+  // Of this epoch and the one before; allocated once the hop answers.
+  std::unique_ptr<std::array<RttSketch, 2>> sketches_;
+  size_t rounds_ = 0;
 
-  ICMPPacket() = default;
+ public:
+  /// Account for a probe of the current round.
+  void Record(const ProbeOutcome &probe) {
+    lost_[sent_++ % kWindow] = probe.status == TIMEOUT;
+    if (probe.status == TIMEOUT) return;
+    auto rtt = probe.rtt;
+    if (received_++ == 0) {
+      best_ = worst_ = rtt;
+      sketches_ = std::make_unique<std::array<RttSketch, 2>>();
+    } else {
+      // The interarrival jitter of RFC 3550, between successive replies.
+      auto difference = rtt > last_ ? rtt - last_ : last_ - rtt;
+      jitter_ += (difference - jitter_) / 16;
+    }
+    last_ = rtt;
+    best_ = std::min(best_, rtt);
+    worst_ = std::max(worst_, rtt);
+    total_ += rtt;
+    responder_ = *probe.responder;
+    name_ = probe.name;
+    (*sketches_)[0].Add(rtt);
+  }
 
-  ICMPPacket(uint16_t id, uint16_t seq)
-      : type(icmp::kEchoRequest),
-        code(0x0),
-        identifier(htons(id)),
-        sequence_number(htons(seq)) {
-    uint32_t sum = (static_cast<uint32_t>(type) << 8) + code + id + seq;
-    auto high = static_cast<uint32_t>(sum >> 16);
-    auto low = static_cast<uint32_t>(sum & ((1U << 16) - 1));
-    checksum = htons(static_cast<uint16_t>(~(high + low)));
+  /// Close a round in which the hop was probed.
+  void EndRound() {
+    if (++rounds_ % kEpoch != 0 || !sketches_) return;
+    auto &[current, previous] = *sketches_;
+    previous = current;
+    current.Clear();
   }
 
-  // Needs to be called if the object is directly built from bytes w/ memcpy
-  void Normalize() {
-    identifier = ntohs(identifier);
-    sequence_number = ntohs(sequence_number);
+  /// Print a row of the table of `PathStats::Print`.
+  void Print(std::ostream &out) const {
+    auto ms = [&](std::optional<ClockType::duration> value) {
+      out << std::setw(7);
+      if (!value) {
+        out << "-";
+        return;
+      }
+      out << std::chrono::duration<double, std::milli>(*value).count();
+    };
+    std::string host = "???";
+    if (received_ > 0) host = name_.empty() ? inet_ntoa(responder_) : name_;
+    size_t window = std::min<uint64_t>(sent_, kWindow);
+    out << std::left << std::setw(32) << host.substr(0, 31) << std::right
+        << std::fixed << std::setprecision(1) << std::setw(6)
+        << 100.0 * static_cast<double>(lost_.count()) /
+               static_cast<double>(std::max<size_t>(window, 1))
+        << "%" << std::setw(6) << sent_;
+    std::optional<RttSketch> recent;
+    if (received_ > 0) {
+      recent = (*sketches_)[0];
+      recent->Merge((*sketches_)[1]);
+      ms(last_);
+      ms(total_ / received_);
+      ms(best_);
+      ms(worst_);
+      ms(jitter_);
+    } else {
+      for (int i = 0; i < 5; ++i) ms(std::nullopt);
+    }
+    for (double q : {0.5, 0.9, 0.99})
+      ms(recent ? recent->Quantile(q) : std::nullopt);
   }
 };
 
-struct TCPHeader {
-  uint16_t source_port;
-  uint16_t destination_port;
-  uint32_t sequence_number;
-  uint32_t ack;
-  uint32_t unused;
-  uint16_t checksum;
-  uint16_t urgent_pointer;
-};
+/// The statistics of every hop of a monitored path.
+class PathStats {
+  int first_ttl_;
+  std::vector<HopStats> hops_;
+  // Of the last round.
+  size_t length_ = 0;
 
-struct TCPPacket {};
+ public:
+  explicit PathStats(int first_ttl) : first_ttl_(first_ttl) {}
+
+  /// Account for a round of a trace.
+  void Record(const TraceResult &result) {
+    length_ = 0;
+    for (const auto &probe : result.probes) {
+      auto hop = static_cast<size_t>(probe.ttl - first_ttl_);
+      length_ = std::max(length_, hop + 1);
+      if (hops_.size() < length_) hops_.resize(length_);
+      hops_[hop].Record(probe);
+    }
+    for (size_t hop = 0; hop < length_; ++hop) hops_[hop].EndRound();
+  }
 
-struct UDPHeader {
-  uint16_t source_port;
-  uint16_t destination_port;
-  uint16_t length;
-  uint16_t checksum;
+  /// Print a table of the hops on the path of the last round, one per
+  /// line, each line ended with `eol`.
+  void Print(std::ostream &out, const Target &target,
+             const char *eol = "\n") const {
+    out << "traceroute to " << target.hostname << " ("
+        << inet_ntoa(target.addr.sin_addr) << ")" << eol;
+    out << "    " << std::left << std::setw(32) << "Host" << std::right
+        << std::setw(7) << "Loss%" << std::setw(6) << "Snt";
+    for (const char *column :
+         {"Last", "Avg", "Best", "Wrst", "Jttr", "p50", "p90", "p99"})
+      out << std::setw(7) << column;
+    out << eol;
+    for (size_t hop = 0; hop < length_; ++hop) {
+      out << std::setw(2) << first_ttl_ + static_cast<int>(hop) << ". ";
+      hops_[hop].Print(out);
+      out << eol;
+    }
+  }
 };
 
-struct UDPPacket {};
-
-using Packet = std::variant<ICMPPacket, TCPPacket, UDPPacket>;
-using ClockType = std::chrono::steady_clock;
-using TimePoint = std::chrono::time_point<ClockType>;
-
-enum ICMPStatus : uint8_t {
-  DESTINATION_REACHED,
-  TIMEOUT,
-  TTL_EXPIRED,
-  HOST_UNREACHABLE,
-  NETWORK_UNREACHABLE,
-  PROTOCOL_UNREACHABLE,
-};
+// The frames of the daemon protocol. A client sends a JOB, with the address
+// of a destination (4 bytes, in network byte order) and the host it was
+// given as, and gets its OUTPUT as hops complete, then DONE; or FAILED,
+// with the reason, if it could not be traced.
+enum FrameType : uint8_t { JOB = 1, OUTPUT, DONE, FAILED };
+
+/// A message either way: the size of what follows (4 bytes), the type, the
+/// job it is about (4 bytes, chosen by the client), and the payload, with
+/// numbers in network byte order.
+struct Frame {
+  static constexpr size_t kHeaderSize = 9;
+  static constexpr size_t kMaxPayload = 1 << 16;
+
+  FrameType type;
+  uint32_t job;
+  std::string payload;
+
+  /// Append the frame of `type` about `job` to `out`.
+  static void Append(std::string &out, FrameType type, uint32_t job,
+                     std::string_view payload) {
+    auto put32 = [&](uint32_t value) {
+      for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>(value >> shift));
+    };
+    put32(static_cast<uint32_t>(kHeaderSize - 4 + payload.size()));
+    out.push_back(static_cast<char>(type));
+    put32(job);
+    out.append(payload);
+  }
 
-class TraceRouteClient {
- protected:
-  struct sockaddr_in addr_ {};  // NOLINT
-  int send_fd_{}, recv_fd_{};   // NOLINT
-
-  template <size_t BufferSize>
-  bool RecvICMPReply(std::array<uint8_t, BufferSize> &buffer, ICMPPacket &recv,
-                     struct sockaddr &recv_addr) const {
-    socklen_t recv_addr_len = sizeof(recv_addr);
-    auto recv_bytes = recvfrom(
-        recv_fd_, reinterpret_cast<void *>(buffer.data()), buffer.size(), 0,
-        reinterpret_cast<struct sockaddr *>(&recv_addr), &recv_addr_len);
-    if (recv_bytes == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
-      PrintError("recvfrom");
+  /// Remove the first frame from `in` and return it, if it is whole. A
+  /// frame too large to be one of ours is an error.
+  static std::optional<Frame> Take(std::string &in, bool &error) {
+    auto get32 = [&](size_t offset) {
+      uint32_t value = 0;
+      for (size_t i = 0; i < 4; ++i)
+        value = value << 8 | static_cast<uint8_t>(in[offset + i]);
+      return value;
+    };
+    if (in.size() < kHeaderSize) return std::nullopt;
+    size_t size = get32(0);
+    if (size < kHeaderSize - 4 || size > kHeaderSize - 4 + kMaxPayload) {
+      error = true;
+      return std::nullopt;
     }
-    memcpy(&recv, buffer.data() + kIpHeaderSize, sizeof(recv));
-    recv.identifier = ntohs(recv.identifier);
-    recv.sequence_number = ntohs(recv.sequence_number);
-    return false;
+    if (in.size() < 4 + size) return std::nullopt;
+    Frame frame{static_cast<FrameType>(in[4]), get32(5),
+                in.substr(kHeaderSize, size - (kHeaderSize - 4))};
+    in.erase(0, 4 + size);
+    return frame;
   }
-
- public:
-  TraceRouteClient() = default;
-
-  // XXX(wp): Probably implement these later?
-  TraceRouteClient(const TraceRouteClient &other) = delete;
-  TraceRouteClient(TraceRouteClient &&other) = delete;
-  TraceRouteClient &operator=(const TraceRouteClient &other) = delete;
-  TraceRouteClient &operator=(TraceRouteClient &&other) = delete;
-
-  TraceRouteClient(char *host, int domain, int type, int protocol)
-      : send_fd_(socket(domain, type, protocol)) {
-    if (send_fd_ == -1) PrintError("socket");
-    addr_.sin_family = AF_INET;
-    addr_.sin_addr = LookUp(host);
-    addr_.sin_port = htons(7);
-    recv_fd_ = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-  }
-
-  virtual ~TraceRouteClient() = default;
-
-  virtual void InitSocket(int ttl, double time_limit) {
-    if (setsockopt(send_fd_, IPPROTO_IP, IP_TTL,
-                   reinterpret_cast<const void *>(&ttl), sizeof(ttl)) < 0)
-      PrintError("setsockopt(ttl)");
-    struct timeval tv {};
-    tv.tv_sec = static_cast<int>(time_limit);
-    tv.tv_usec = static_cast<int>((time_limit - static_cast<int>(time_limit)) *
-                                  1'000'000);
-    if (setsockopt(recv_fd_, SOL_SOCKET, SO_RCVTIMEO,
-                   reinterpret_cast<const void *>(&tv), sizeof(tv)) < 0)
-      PrintError("setsockopt(rcvtime)");
-  }
-
-  virtual void SendRequest(Packet packet) = 0;
-
-  /// Return a tuple consisting of
-  /// - Source IP address
-  /// - Time when the packet is received
-  /// - The returned status
-  [[nodiscard]] virtual std::tuple<struct sockaddr, TimePoint, ICMPStatus>
-  RecvReply() const = 0;
-
-  const char *GetAddress() const { return inet_ntoa(addr_.sin_addr); }
 };
 
-class TCPClient : public TraceRouteClient {
-  // XXX(wp): Fails with some routers if port is not 80
-  uint16_t port_ = 80;
-  int last_ret_ = INT_MIN;
-  int fd_args_ = 0;
-  TimePoint send_time_{};
-  long time_limit_us_{};
+/// The daemon end of the protocol: a listening Unix domain socket and the
+/// clients connected to it, served from within `Engine::Process()`. Nothing
+/// blocks the event loop: a client is read from as its frames arrive, and
+/// what it has not read yet waits in its buffer, up to `kMaxBuffered`,
+/// beyond which it is disconnected.
+/// Connections are known by a serial number, which is never reused, so
+/// output for a client that left goes nowhere.
+class JobServer {
+  static constexpr size_t kMaxBuffered = 16 << 20;
+
+  struct Connection {
+    int fd;
+    std::string in, out;
+  };
 
  public:
-  explicit TCPClient(char *host)
-      : TraceRouteClient(host, AF_INET, SOCK_RAW, IPPROTO_ICMP) {}
-
-  ~TCPClient() override {
-    close(send_fd_);
-    close(recv_fd_);
-  }
-
-  void InitSocket(int ttl, double time_limit) override {
-    time_limit_us_ = static_cast<long>(time_limit * 1'000'000);
-    close(send_fd_);
-    send_fd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    struct sockaddr bind_addr {};
-    bind_addr.sa_family = AF_INET;
-    if (bind(send_fd_, &bind_addr, sizeof(bind_addr)) < 0) PrintError("bind");
-    if (setsockopt(send_fd_, IPPROTO_IP, IP_TTL,
-                   reinterpret_cast<const void *>(&ttl), sizeof(ttl)) < 0)
-      PrintError("setsockopt(ttl)");
-    struct timeval tv {};
-    tv.tv_sec = static_cast<int>(time_limit);
-    tv.tv_usec = static_cast<int>((time_limit - static_cast<int>(time_limit)) *
-                                  1'000'000);
-    if (setsockopt(recv_fd_, SOL_SOCKET, SO_RCVTIMEO,
-                   reinterpret_cast<const void *>(&tv), sizeof(tv)) < 0)
-      PrintError("setsockopt(rcvtime)");
-    fd_args_ = fcntl(send_fd_, F_GETFL, NULL);
-    if (fcntl(send_fd_, F_SETFL, fd_args_ | O_NONBLOCK) < 0) {
-      PrintError("fnctl");
-    }
+  /// A destination to trace for a client.
+  struct Job {
+    uint64_t connection;
+    uint32_t id;
+    Target target;
+  };
+
+ private:
+  traceroute::Engine &engine_;
+  std::function<void(Job)> on_job_;
+  std::string path_;
+  int listen_fd_ = -1;
+  uint64_t next_connection_ = 0;
+  std::unordered_map<uint64_t, Connection> connections_;
+  std::unordered_map<int, uint64_t> by_fd_;
+
+  void Close(uint64_t id) {
+    auto iter = connections_.find(id);
+    if (iter == connections_.end()) return;
+    engine_.Unwatch(iter->second.fd);
+    close(iter->second.fd);
+    by_fd_.erase(iter->second.fd);
+    connections_.erase(iter);
   }
 
-  void SendRequest(Packet packet) override {
-    assert(std::holds_alternative<TCPPacket>(packet) &&
-           "Expecting TCP packet.");
-    addr_.sin_port = htons(port_);
-    last_ret_ =
-        connect(send_fd_, reinterpret_cast<const struct sockaddr *>(&addr_),
-                sizeof(addr_));
-    send_time_ = ClockType::now();
-    if (last_ret_ != 0) {
-      if (errno == EHOSTUNREACH || errno == ECONNREFUSED) {
-        last_ret_ = errno;
-      } else if (errno == EINPROGRESS) {
-        last_ret_ = EALREADY;
-      } else {
-        PrintError("connect");
-      }
+  /// Write what `connection` has not read yet, and wait until it can take
+  /// more if that is not all. Return false if it is gone.
+  bool Drain(Connection &connection) {
+    bool waiting = !connection.out.empty();
+    while (!connection.out.empty()) {
+      ssize_t ret = send(connection.fd, connection.out.data(),
+                         connection.out.size(), MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0 && errno == EAGAIN) break;
+      if (ret < 0) return false;
+      connection.out.erase(0, static_cast<size_t>(ret));
+    }
+    if (connection.out.size() > kMaxBuffered) return false;
+    if (waiting == connection.out.empty()) {
+      return !engine_.ModifyWatch(
+          connection.fd,
+          connection.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
     }
+    return true;
   }
 
-  [[nodiscard]] std::tuple<struct sockaddr, TimePoint, ICMPStatus> RecvReply()
-      const override {
-    assert(last_ret_ != INT_MIN);
-    std::array<uint8_t, kIpHeaderSize + ICMPPacket::kPacketSize + 64> buffer{};
-    int last_ret{last_ret_};
-    if (last_ret != EALREADY) {
-      if (last_ret == EHOSTUNREACH) {
-        return std::make_tuple(sockaddr{}, ClockType::now(), TIMEOUT);
+  /// Take every pending connection.
+  void Accept() {
+    int fd = -1;
+    while ((fd = accept4(listen_fd_, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      uint64_t id = next_connection_++;
+      if (engine_.Watch(fd, EPOLLIN, [this, fd] { OnReady(fd); })) {
+        close(fd);
+        continue;
       }
-      struct sockaddr recv_addr {};
-      memcpy(&recv_addr, &addr_, sizeof(recv_addr));
-      return std::make_tuple(recv_addr, ClockType::now(), DESTINATION_REACHED);
+      connections_[id] = {fd, {}, {}};
+      by_fd_[fd] = id;
     }
+  }
+
+  /// Serve the connection on `fd`, which is ready: read frames, start their
+  /// jobs, and write what is pending.
+  void OnReady(int fd) {
+    uint64_t id = by_fd_.at(fd);
+    auto &connection = connections_.at(id);
+    std::array<char, 4096> buffer{};
+    bool closed = false;
     while (true) {
-      fd_set read_fds{}, write_fds{}, err_fds{};
-      FD_ZERO(&read_fds);
-      FD_ZERO(&write_fds);
-      FD_ZERO(&err_fds);
-      FD_SET(send_fd_, &read_fds);
-      FD_SET(send_fd_, &write_fds);
-      FD_SET(send_fd_, &err_fds);
-      auto cur_time = ClockType::now();
-      auto time_elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
-                              cur_time - send_time_)
-                              .count();
-      if (time_elapsed > time_limit_us_) {
-        return std::make_tuple(sockaddr{}, ClockType::now(), TIMEOUT);
+      ssize_t ret = read(fd, buffer.data(), buffer.size());
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0 && errno == EAGAIN) break;
+      if (ret <= 0) {
+        closed = true;
+        break;
       }
-      timeval timeout_val{};
-      timeout_val.tv_sec = (time_limit_us_ - time_elapsed) / 1'000'000;
-      timeout_val.tv_usec = (time_limit_us_ - time_elapsed) % 1'000'000;
-      if (select(send_fd_ + 1, &read_fds, &write_fds, &err_fds, &timeout_val) <
-          0) {
-        PrintError("select");
-      }
-      if (FD_ISSET(send_fd_, &read_fds) || FD_ISSET(send_fd_, &write_fds) ||
-          FD_ISSET(send_fd_, &err_fds)) {
-        last_ret =
-            connect(send_fd_, reinterpret_cast<const struct sockaddr *>(&addr_),
-                    sizeof(addr_));
-        if (last_ret != 0) {
-          last_ret = errno;
-        }
-        if (last_ret == 0 || last_ret == ECONNREFUSED) {
-          struct sockaddr recv_addr {};
-          memcpy(&recv_addr, &addr_, sizeof(recv_addr));
-          return std::make_tuple(recv_addr, ClockType::now(),
-                                 DESTINATION_REACHED);
-        }
-        if (last_ret != EALREADY) {
-          ICMPPacket recv{};
-          struct sockaddr recv_addr {};
-          bool timeout = RecvICMPReply(buffer, recv, recv_addr);
-          auto recv_time = ClockType::now();
-          if (timeout) return std::make_tuple(sockaddr{}, recv_time, TIMEOUT);
-
-          struct sockaddr_in send_addr {};
-          socklen_t len = sizeof(send_addr);
-          if (getsockname(send_fd_,
-                          reinterpret_cast<struct sockaddr *>(&send_addr),
-                          &len) < 0) {
-            PrintError("getsockname");
-          }
-
-          uint16_t port = ntohs(send_addr.sin_port);
-          TCPHeader header{};
-          memcpy(&header,
-                 buffer.data() + kIpHeaderSize + ICMPPacket::kPacketSize +
-                     kIpHeaderSize,
-                 sizeof(header));
-          if (ntohs(header.source_port) != port) continue;
-          if (recv.type == icmp::kTimeExceed) {
-            return std::make_tuple(recv_addr, recv_time, TTL_EXPIRED);
-          }
-          if (recv.type == icmp::kDestinationUnreachable) {
-            constexpr std::array<ICMPStatus, 4> kUnreachableLookUpTable = {
-                NETWORK_UNREACHABLE, HOST_UNREACHABLE, PROTOCOL_UNREACHABLE,
-                DESTINATION_REACHED};
-            return std::make_tuple(recv_addr, recv_time,
-                                   kUnreachableLookUpTable.at(recv.type));
-          }
-        } else {
-          assert(false && "Unexpected last_ret.");
-        }
+      connection.in.append(buffer.data(), static_cast<size_t>(ret));
+    }
+    bool error = false;
+    while (auto frame = Frame::Take(connection.in, error)) {
+      if (frame->type != JOB || frame->payload.size() <= 4) {
+        error = true;
+        break;
       }
+      struct sockaddr_in addr {};
+      addr.sin_family = AF_INET;
+      memcpy(&addr.sin_addr, frame->payload.data(), 4);
+      on_job_({id, frame->job, {frame->payload.substr(4), addr}});
+    }
+    if (closed || error || !Drain(connection)) Close(id);
+  }
+
+ public:
+  /// Listen on `path`, replacing whatever socket was there, and have
+  /// `engine` wait for connections, passing every job to `on_job`.
+  JobServer(const char *path, traceroute::Engine &engine,
+            std::function<void(Job)> on_job)
+      : engine_(engine), on_job_(std::move(on_job)), path_(path) {
+    struct sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (path_.size() >= sizeof(addr.sun_path)) {
+      std::cerr << "traceroute: socket path too long: " << path << "\n";
+      exit(1);
     }
+    std::copy(path_.begin(), path_.end(), addr.sun_path);
+    listen_fd_ =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) PrintError("socket");
+    unlink(path);
+    if (bind(listen_fd_, reinterpret_cast<const struct sockaddr *>(&addr),
+             sizeof(addr)) < 0)
+      PrintError(path);
+    if (listen(listen_fd_, SOMAXCONN) < 0) PrintError("listen");
+    Check(engine_.Watch(listen_fd_, EPOLLIN, [this] { Accept(); }));
+  }
+
+  JobServer(const JobServer &other) = delete;
+  JobServer(JobServer &&other) = delete;
+  JobServer &operator=(const JobServer &other) = delete;
+  JobServer &operator=(JobServer &&other) = delete;
+
+  ~JobServer() {
+    while (!connections_.empty()) Close(connections_.begin()->first);
+    engine_.Unwatch(listen_fd_);
+    close(listen_fd_);
+    unlink(path_.c_str());
+  }
+
+  /// Queue a frame for the client of `job`, if it is still connected, or
+  /// several if `payload` is too large for one.
+  void Send(const Job &job, FrameType type, std::string_view payload) {
+    auto iter = connections_.find(job.connection);
+    if (iter == connections_.end()) return;
+    do {
+      Frame::Append(iter->second.out, type, job.id,
+                    payload.substr(0, Frame::kMaxPayload));
+      payload.remove_prefix(std::min(payload.size(), Frame::kMaxPayload));
+    } while (!payload.empty());
+    if (!Drain(iter->second)) Close(job.connection);
   }
 };
 
-class ICMPClient : public TraceRouteClient {
+/// Drop the targets whose address came before, with a warning.
+void Deduplicate(std::vector<Target> &targets) {
+  std::unordered_set<in_addr_t> seen;
+  targets.erase(
+      std::remove_if(targets.begin(), targets.end(),
+                     [&](const Target &target) {
+                       if (seen.insert(target.addr.sin_addr.s_addr).second)
+                         return false;
+                       std::cerr << "traceroute: Warning: skipping duplicate "
+                                    "target "
+                                 << target.hostname << "\n";
+                       return true;
+                     }),
+      targets.end());
+}
+
+/// A bounded queue from one thread to another, without locks: only the
+/// producer moves `tail_`, and only the consumer `head_`, each publishing
+/// the slots it is done with by a release store the other acquires.
+template <typename T>
+class SpscQueue {
+  std::vector<std::optional<T>> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+
  public:
-  explicit ICMPClient(char *host)
-      : TraceRouteClient(host, AF_INET, SOCK_RAW, IPPROTO_ICMP) {}
+  /// Of `capacity` items, a power of 2.
+  explicit SpscQueue(size_t capacity)
+      : slots_(capacity), mask_(capacity - 1) {
+    assert((capacity & mask_) == 0 && "Capacity must be a power of 2.");
+  }
 
-  // XXX(wp): Probably implement these later?
-  ICMPClient(const ICMPClient &other) = delete;
-  ICMPClient(ICMPClient &&other) = delete;
-  ICMPClient &operator=(const ICMPClient &other) = delete;
-  ICMPClient &operator=(ICMPClient &&other) = delete;
+  /// Append `value`, which is left alone if the queue is full.
+  bool Push(T &&value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+      return false;
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
 
-  ~ICMPClient() override {
-    close(send_fd_);
-    close(recv_fd_);
+  std::optional<T> Pop() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return std::nullopt;
+    std::optional<T> value = std::move(slots_[head & mask_]);
+    slots_[head & mask_].reset();
+    head_.store(head + 1, std::memory_order_release);
+    return value;
   }
+};
 
-  void SendRequest(Packet packet) override {
-    assert(std::holds_alternative<ICMPPacket>(packet) &&
-           "Expecting ICMP packet.");
-    auto &icmp = std::get<ICMPPacket>(packet);
-    if (sendto(send_fd_, reinterpret_cast<const void *>(&icmp), sizeof(icmp), 0,
-               reinterpret_cast<const struct sockaddr *>(&addr_),
-               sizeof(addr_)) < 0)
-      PrintError("sendto");
+/// What becomes of the results of the targets, in the order they arrive:
+/// the output of a single target is streamed, and that of several printed
+/// whole as each is done. Monitored targets are tabulated instead, live for
+/// a single one on a terminal, and once monitoring ends otherwise.
+class OutputStage {
+  const std::vector<Target> &targets_;
+  bool continuous_, live_;
+  std::vector<PathStats> paths_;
+
+ public:
+  OutputStage(const Config &config, const std::vector<Target> &targets)
+      : targets_(targets),
+        continuous_(config.interval > 0),
+        live_(continuous_ && targets.size() == 1 && isatty(STDOUT_FILENO)) {
+    for (size_t target = 0; continuous_ && target < targets.size(); ++target)
+      paths_.emplace_back(config.first_ttl);
+    if (live_) std::cout << "\x1b[2J";
   }
 
-  [[nodiscard]] std::tuple<struct sockaddr, TimePoint, ICMPStatus> RecvReply()
-      const override {
-    std::array<uint8_t, kIpHeaderSize + ICMPPacket::kPacketSize + 64> buffer{};
-    while (true) {
-      ICMPPacket recv{};
-      struct sockaddr recv_addr {};
-      bool timeout = RecvICMPReply(buffer, recv, recv_addr);
-      auto recv_time = ClockType::now();
-      if (timeout) return std::make_tuple(sockaddr{}, recv_time, TIMEOUT);
-
-      if (recv.identifier == kIcmpIdentifier &&
-          recv.sequence_number == kIcmpSeqNum) {
-        if (recv.type == icmp::kEchoReply) {
-          return std::make_tuple(recv_addr, recv_time, DESTINATION_REACHED);
-        }
-      }
-      if (recv.type == icmp::kTimeExceed) {
-        ICMPPacket orig{};
-        memcpy(&orig,
-               buffer.data() + kIpHeaderSize + ICMPPacket::kPacketSize +
-                   kIpHeaderSize,
-               sizeof(orig));
-        orig.identifier = ntohs(orig.identifier);
-        orig.sequence_number = ntohs(orig.sequence_number);
-        if (orig.identifier == kIcmpIdentifier &&
-            orig.sequence_number == kIcmpSeqNum) {
-          assert(recv.code == icmp::kTTLExpired);
-          return std::make_tuple(recv_addr, recv_time, TTL_EXPIRED);
-        }
-      }
-      if (recv.type == icmp::kDestinationUnreachable) {
-        constexpr std::array<ICMPStatus, 4> kUnreachableLookUpTable = {
-            NETWORK_UNREACHABLE, HOST_UNREACHABLE, PROTOCOL_UNREACHABLE,
-            DESTINATION_REACHED};
-        return std::make_tuple(recv_addr, recv_time,
-                               kUnreachableLookUpTable.at(recv.type));
-      }
+  /// Whether what a trace prints is to be passed on as it comes.
+  [[nodiscard]] bool Streams() const {
+    return targets_.size() == 1 && !continuous_;
+  }
+
+  void Output(std::string_view text) { std::cout << text << std::flush; }
+
+  void Done(size_t target, const TraceResult &result) {
+    if (!continuous_) {
+      std::cout << result.output << std::flush;
+      return;
     }
+    paths_[target].Record(result);
+    if (!live_) return;
+    // Overwrite the previous table in place, line by line.
+    std::ostringstream out;
+    out << "\x1b[H";
+    paths_[target].Print(out, targets_[target], "\x1b[K\n");
+    out << "\x1b[J";
+    std::cout << out.str() << std::flush;
+  }
+
+  /// Print the tables that were not shown live.
+  void Close() {
+    if (!continuous_ || live_) return;
+    for (size_t target = 0; target < targets_.size(); ++target)
+      paths_[target].Print(std::cout, targets_[target]);
   }
 };
 
-class UDPClient : public TraceRouteClient {
-  uint16_t port_ = kInitialPort;
+/// Have SIGINT and SIGTERM read from the returned descriptor rather than
+/// end the program, so that it stops through its event loop. Signals are
+/// blocked before any engine starts its threads, which inherit that.
+int BlockSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &signals, nullptr) < 0)
+    PrintError("sigprocmask");
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0) PrintError("signalfd");
+  return signal_fd;
+}
 
- public:
-  explicit UDPClient(char *host)
-      : TraceRouteClient(host, AF_INET, SOCK_DGRAM, IPPROTO_UDP) {}
+void PrintStats(const traceroute::ReceiveStats &stats) {
+  std::cerr << "traceroute: " << stats.seen << " ICMP messages read, "
+            << stats.matched << " matched";
+  if (stats.rejected)
+    std::cerr << ", " << *stats.rejected << " rejected by the filter";
+  if (stats.packet_ring) std::cerr << ", through the packet ring";
+  if (stats.io_uring) std::cerr << ", through io_uring";
+  if (stats.replay) std::cerr << ", replayed";
+  std::cerr << "\n";
+}
 
-  ~UDPClient() {
-    close(send_fd_);
-    close(recv_fd_);
+/// Trace `targets`, or, with `config.listen_socket`, the jobs that clients
+/// submit there until the program is interrupted, every one as it arrives,
+/// sending its output back as it is printed. With `config.interval`,
+/// targets are monitored until the program is interrupted, if not for
+/// `config.count` rounds.
+void TraceRoute(const Config &config, const std::vector<Target> &targets) {
+  int signal_fd = -1;
+  if (config.interval > 0 || config.listen_socket) signal_fd = BlockSignals();
+  auto created = traceroute::Engine::Create(config);
+  if (!created) PrintError(created.GetError());
+  auto &engine = **created;
+  bool interrupted = false;
+  if (signal_fd >= 0)
+    Check(engine.Watch(signal_fd, EPOLLIN, [&] { interrupted = true; }));
+
+  OutputStage output(config, targets);
+  for (size_t target = 0; target < targets.size(); ++target) {
+    traceroute::TraceCallbacks callbacks;
+    if (output.Streams()) {
+      callbacks.output = [&](std::string_view text) { output.Output(text); };
+    }
+    callbacks.done = [&, target](const TraceResult &result) {
+      output.Done(target, result);
+    };
+    engine.Add(targets[target], std::move(callbacks));
   }
 
-  void SendRequest(Packet packet) override {
-    assert(std::holds_alternative<UDPPacket>(packet) &&
-           "Expecting UDP packet.");
-    auto &udp = std::get<UDPPacket>(packet);
-    addr_.sin_port = htons(port_);
-    port_++;
-    if (sendto(send_fd_, reinterpret_cast<const void *>(&udp), sizeof(udp), 0,
-               reinterpret_cast<const struct sockaddr *>(&addr_),
-               sizeof(addr_)) < 0)
-      PrintError("sendto");
+  // The jobs of a daemon not done yet, by a number of their own, as clients
+  // may reuse theirs.
+  std::unordered_map<uint64_t, JobServer::Job> jobs;
+  uint64_t next_job = 0;
+  std::optional<JobServer> server;
+  if (config.listen_socket) {
+    server.emplace(config.listen_socket, engine, [&](JobServer::Job job) {
+      uint64_t number = next_job++;
+      auto target = job.target;
+      jobs.emplace(number, std::move(job));
+      engine.Add(
+          std::move(target),
+          {[&, number](std::string_view text) {
+             server->Send(jobs.at(number), OUTPUT, text);
+           },
+           [&, number](const TraceResult & /*result*/) {
+             server->Send(jobs.at(number), DONE, {});
+             jobs.erase(number);
+           }});
+    });
   }
 
-  [[nodiscard]] std::tuple<struct sockaddr, TimePoint, ICMPStatus> RecvReply()
-      const override {
-    std::array<uint8_t, kIpHeaderSize + ICMPPacket::kPacketSize + 64> buffer{};
-    while (true) {
-      ICMPPacket recv{};
-      struct sockaddr recv_addr {};
-      bool timeout = RecvICMPReply(buffer, recv, recv_addr);
-      auto recv_time = ClockType::now();
-      if (timeout) return std::make_tuple(sockaddr{}, recv_time, TIMEOUT);
-
-      UDPHeader header{};
-      memcpy(&header,
-             buffer.data() + kIpHeaderSize + ICMPPacket::kPacketSize +
-                 kIpHeaderSize,
-             sizeof(header));
-      // Verify the returned UDP header by its destination port.
-      if (ntohs(header.destination_port) != port_ - 1) continue;
-      if (recv.type == icmp::kTimeExceed) {
-        assert(recv.code == icmp::kTTLExpired);
-        return std::make_tuple(recv_addr, recv_time, TTL_EXPIRED);
+  while ((engine.Active() > 0 || server) && !interrupted)
+    Check(engine.Process(-1));
+  for (const auto &[number, job] : jobs)
+    server->Send(job, FAILED, "interrupted");
+  Check(engine.Close());
+  output.Close();
+  if (config.statistics) PrintStats(engine.Stats());
+  server.reset();
+  if (signal_fd >= 0) {
+    engine.Unwatch(signal_fd);
+    close(signal_fd);
+  }
+}
+
+/// A thread of `TraceRouteSharded`, with an engine of its own for the
+/// targets of its shard.
+struct Worker {
+  static constexpr size_t kQueueSize = 1024;
+
+  // For the output stage: what the trace of a target printed, or its
+  // result.
+  struct Event {
+    size_t target;
+    std::string text;
+    std::optional<TraceResult> result;
+  };
+
+  std::unique_ptr<traceroute::Engine> engine;
+  // Indices into the targets of the run.
+  std::vector<size_t> targets;
+  SpscQueue<Event> events{kQueueSize};
+  // Readable once the worker is to stop.
+  int stop_fd = -1;
+  std::optional<traceroute::Error> error;
+  std::thread thread;
+
+  /// Trace every target until done or stopped, handing events over, and
+  /// count the worker as `finished` then. Writing to `wake_fd` tells the
+  /// output stage there are events.
+  void Run(const std::vector<Target> &all, bool stream, int wake_fd,
+           std::atomic<size_t> &finished) {
+    bool stopped = false, handed = false;
+    auto wake = [&] {
+      uint64_t one = 1;
+      // Only the count matters, and it cannot overflow.
+      (void)!write(wake_fd, &one, sizeof(one));
+      handed = false;
+    };
+    auto hand = [&](Event event) {
+      while (!events.Push(std::move(event))) {
+        // The output stage is behind, and may not know it.
+        wake();
+        std::this_thread::yield();
       }
-      if (recv.type == icmp::kDestinationUnreachable) {
-        constexpr std::array<ICMPStatus, 4> kUnreachableLookUpTable = {
-            NETWORK_UNREACHABLE, HOST_UNREACHABLE, PROTOCOL_UNREACHABLE,
-            DESTINATION_REACHED};
-        return std::make_tuple(recv_addr, recv_time,
-                               kUnreachableLookUpTable.at(recv.type));
+      handed = true;
+    };
+    error = engine->Watch(stop_fd, EPOLLIN, [&] { stopped = true; });
+    for (size_t target : targets) {
+      traceroute::TraceCallbacks callbacks;
+      if (stream) {
+        callbacks.output = [&, target](std::string_view text) {
+          hand({target, std::string(text), std::nullopt});
+        };
       }
+      callbacks.done = [&, target](const TraceResult &result) {
+        hand({target, {}, result});
+      };
+      engine->Add(all[target], std::move(callbacks));
+    }
+    while (!error && !stopped && engine->Active() > 0) {
+      error = engine->Process(-1);
+      if (handed) wake();
     }
+    if (!error) error = engine->Close();
+    finished.fetch_add(1, std::memory_order_release);
+    wake();
   }
 };
 
-Packet BuildPacket(Mode mode) {
-  switch (mode) {
-    case TCP:
-      return TCPPacket{};
-    case UDP:
-      return UDPPacket{};
-    case ICMP:
-      return ICMPPacket(kIcmpIdentifier, kIcmpSeqNum);
+/// The CPUs the program may run on, in order.
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) return cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+/// Trace `targets` as `TraceRoute` does, on `config.jobs` threads pinned to
+/// a CPU each. The targets are split by address into shards, each traced by
+/// an engine of its own, with its own sockets and table of probes, whose
+/// socket filter only passes the replies about its shard. What the workers
+/// print and find flows to this thread through a queue per worker, and is
+/// passed on in the order it is taken from them.
+void TraceRouteSharded(const Config &config,
+                       const std::vector<Target> &targets) {
+  int signal_fd = config.interval > 0 ? BlockSignals() : -1;
+  auto shards = static_cast<size_t>(config.jobs);
+  std::deque<Worker> workers(shards);
+  for (size_t target = 0; target < targets.size(); ++target) {
+    auto shard = traceroute::ShardOf(targets[target].addr.sin_addr,
+                                     config.jobs);
+    workers[shard].targets.push_back(target);
+  }
+  // Engines are created in turn, so that the first one to open the store
+  // is the one to write its header.
+  for (size_t shard = 0; shard < shards; ++shard) {
+    auto &worker = workers[shard];
+    if (worker.targets.empty()) continue;
+    traceroute::Options options = config;
+    options.shard = static_cast<int>(shard);
+    options.shards = config.jobs;
+    // A destination is in a single shard, but the probes of all of them and
+    // a /24 may be spread over every one.
+    options.send_rate /= config.jobs;
+    options.prefix_rate /= config.jobs;
+    auto created = traceroute::Engine::Create(options);
+    if (!created) PrintError(created.GetError());
+    worker.engine = std::move(*created);
+    worker.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker.stop_fd < 0) PrintError("eventfd");
+  }
+
+  OutputStage output(config, targets);
+  int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd < 0) PrintError("eventfd");
+  std::atomic<size_t> finished{0};
+  size_t started = 0;
+  auto cpus = AllowedCpus();
+  for (auto &worker : workers) {
+    if (!worker.engine) continue;
+    worker.thread = std::thread([&] {
+      worker.Run(targets, output.Streams(), wake_fd, finished);
+    });
+    if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[started % cpus.size()], &set);
+      pthread_setaffinity_np(worker.thread.native_handle(), sizeof(set),
+                             &set);
+    }
+    started++;
+  }
+
+  std::array<struct pollfd, 2> fds{
+      {{wake_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}}};
+  while (true) {
+    // Events handed over before a worker finished are drained after.
+    bool done = finished.load(std::memory_order_acquire) == started;
+    for (auto &worker : workers) {
+      while (auto event = worker.events.Pop()) {
+        if (event->result) {
+          output.Done(event->target, *event->result);
+        } else {
+          output.Output(event->text);
+        }
+      }
+    }
+    if (done) break;
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      PrintError("poll");
+    }
+    uint64_t count = 0;
+    if (fds[0].revents & POLLIN)
+      (void)!read(wake_fd, &count, sizeof(count));
+    if (fds[1].revents & POLLIN) {
+      // Stop every worker, once, and wait for them to finish.
+      uint64_t one = 1;
+      for (auto &worker : workers) {
+        if (worker.engine) (void)!write(worker.stop_fd, &one, sizeof(one));
+      }
+      fds[1].fd = -1;
+    }
+  }
+
+  traceroute::ReceiveStats stats;
+  std::optional<traceroute::ReceiveStats> first;
+  for (auto &worker : workers) {
+    if (!worker.engine) continue;
+    worker.thread.join();
+    if (worker.error) PrintError(*worker.error);
+    auto shard = worker.engine->Stats();
+    if (!first) first = shard;
+    stats.seen += shard.seen;
+    stats.matched += shard.matched;
+    stats.packet_ring = shard.packet_ring;
+    stats.io_uring = shard.io_uring;
+    worker.engine.reset();
+    close(worker.stop_fd);
   }
-  __builtin_unreachable();
+  output.Close();
+  // Every shard counts the messages about the others as rejected, so only
+  // those no shard read were rejected by them all.
+  if (first && first->rejected)
+    stats.rejected = *first->rejected + first->seen - stats.seen;
+  if (config.statistics) PrintStats(stats);
+  close(wake_fd);
+  if (signal_fd >= 0) close(signal_fd);
 }
 
-std::unique_ptr<TraceRouteClient> BuildClient(const Config &config) {
-  switch (config.mode) {
-    case UDP:
-      return std::make_unique<UDPClient>(config.hostname);
-    case TCP:
-      return std::make_unique<TCPClient>(config.hostname);
-    case ICMP:
-      return std::make_unique<ICMPClient>(config.hostname);
+/// The target `host` names, unless it names none, which is reported.
+std::optional<Target> Resolve(const std::string &host) {
+  auto addrs = traceroute::LookUp(host);
+  if (!addrs) {
+    std::cerr << "traceroute: " << addrs.GetError().Message() << "\n";
+    return std::nullopt;
+  }
+  if (addrs->size() > 1) {
+    std::cerr << "traceroute: Warning: " << host
+              << " has multiple addresses; using " << inet_ntoa(addrs->front())
+              << "\n";
   }
-  __builtin_unreachable();
+  struct sockaddr_in sock_addr {};
+  sock_addr.sin_family = AF_INET;
+  sock_addr.sin_addr = addrs->front();
+  return Target{host, sock_addr};
 }
 
-bool operator!=(const struct sockaddr &lhs, const struct sockaddr &rhs) {
-  return lhs.sa_family != rhs.sa_family ||
-         memcmp(lhs.sa_data, rhs.sa_data, sizeof(lhs.sa_data));
+/// Read one host per line, skipping blank lines and `#` comments.
+std::vector<Target> ReadTargets(const char *path) {
+  std::ifstream file(path);
+  if (!file) PrintError(path);
+  std::vector<Target> targets;
+  std::string line;
+  while (std::getline(file, line)) {
+    auto begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#') continue;
+    auto end = line.find_first_of(" \t\r#", begin);
+    if (auto target = Resolve(line.substr(begin, end - begin)))
+      targets.push_back(std::move(*target));
+  }
+  return targets;
 }
 
-class TraceRouteLogger {
-  struct sockaddr previous_ip_ {};
-  bool first_record_;
+/// Have the daemon listening on `path` trace `targets`, and print what it
+/// sends back: as it comes for a single target, and every trace whole once
+/// done otherwise. Return whether every trace was done.
+bool Submit(const char *path, const std::vector<Target> &targets) {
+  struct sockaddr_un addr {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    std::cerr << "traceroute: socket path too long: " << path << "\n";
+    return false;
+  }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) PrintError("socket");
+  if (connect(fd, reinterpret_cast<const struct sockaddr *>(&addr),
+              sizeof(addr)) < 0)
+    PrintError(path);
+
+  std::string out;
+  for (uint32_t job = 0; job < targets.size(); ++job) {
+    const auto &target = targets[job];
+    std::string payload(4, '\0');
+    memcpy(payload.data(), &target.addr.sin_addr, 4);
+    payload += target.hostname.substr(0, Frame::kMaxPayload - 4);
+    Frame::Append(out, JOB, job, payload);
+  }
+  for (size_t sent = 0; sent < out.size();) {
+    ssize_t ret = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) PrintError("send");
+    sent += static_cast<size_t>(ret);
+  }
 
- public:
-  explicit TraceRouteLogger(int ttl) : first_record_(true) {
-    std::cout << std::setw(2) << ttl << " ";
-    std::cout << std::flush;
-  }
-  ~TraceRouteLogger() { std::cout << "\n"; }
-
-  void Print(struct sockaddr ip, const TimePoint &send_time,
-             const TimePoint &recv_time, ICMPStatus status) {
-    // First reply
-    if (ip != previous_ip_ && status != TIMEOUT) {
-      if (!first_record_) std::cout << "\n   ";
-      char hostname[1024];
-      getnameinfo(&ip, sizeof(ip), hostname, sizeof(hostname), nullptr, 0, 0);
-      std::cout << hostname << " ("
-                << inet_ntoa(reinterpret_cast<sockaddr_in *>(&ip)->sin_addr)
-                << ")";
-    }
-    if (status == TIMEOUT) {
-      std::cout << " *";
-    } else if (status == HOST_UNREACHABLE) {
-      std::cout << " !H";
-    } else if (status == NETWORK_UNREACHABLE) {
-      std::cout << " !N";
-    } else if (status == PROTOCOL_UNREACHABLE) {
-      std::cout << " !P";
-    } else {
-      auto time_elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
-                              recv_time - send_time)
-                              .count();
-      std::cout << std::fixed << std::setprecision(3) << "  "
-                << static_cast<double>(time_elapsed) / 1'000 << " ms";
-      previous_ip_ = ip;
+  bool stream = targets.size() == 1, error = false;
+  std::vector<std::string> outputs(targets.size());
+  size_t remaining = targets.size(), failed = 0;
+  std::string in;
+  std::array<char, 4096> buffer{};
+  while (remaining > 0 && !error) {
+    ssize_t ret = read(fd, buffer.data(), buffer.size());
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) PrintError("read");
+    if (ret == 0) break;
+    in.append(buffer.data(), static_cast<size_t>(ret));
+    while (auto frame = Frame::Take(in, error)) {
+      if (frame->job >= targets.size()) {
+        error = true;
+        break;
+      }
+      auto &output = outputs[frame->job];
+      if (frame->type == OUTPUT) {
+        if (stream) {
+          std::cout << frame->payload << std::flush;
+        } else {
+          output += frame->payload;
+        }
+      } else if (frame->type == DONE) {
+        std::cout << output << std::flush;
+        output.clear();
+        remaining--;
+      } else if (frame->type == FAILED) {
+        std::cerr << "traceroute: " << targets[frame->job].hostname << ": "
+                  << frame->payload << "\n";
+        failed++;
+        remaining--;
+      }
     }
-    first_record_ = false;
-    std::cout << std::flush;
   }
-};
+  close(fd);
+  if (remaining > 0)
+    std::cerr << "traceroute: lost the connection to " << path << "\n";
+  return remaining == 0 && failed == 0;
+}
 
 }  // namespace
 
 int main(int argc, char *argv[]) {
-  static_assert(sizeof(ICMPPacket) == ICMPPacket::kPacketSize,
-                "Padding is not allowed.");
   auto config = ParseArg(argc, argv);
 
-  std::unique_ptr<TraceRouteClient> client = BuildClient(config);
-  std::cout << "traceroute to " << config.hostname << " ("
-            << client->GetAddress() << "), " << config.max_ttl << " hops max"
-            << std::endl;
-
-  for (int hop = config.first_ttl; hop <= config.max_ttl; ++hop) {
-    bool is_exceed = true;
-    TraceRouteLogger logger(hop);
-    // XXX(waynetu): (Improvement) Send all requests before receiving replies.
-    for (int query = 0; query < config.nqueries; ++query) {
-      client->InitSocket(hop, config.wait_time);
-      auto send_time = ClockType::now();
-      auto packet = BuildPacket(config.mode);
-      client->SendRequest(packet);
-      auto [source_ip, recv_time, status] = client->RecvReply();
-      is_exceed &= (status != DESTINATION_REACHED);
-      logger.Print(source_ip, send_time, recv_time, status);
-    }
+  std::vector<Target> targets;
+  if (config.targets_file) {
+    targets = ReadTargets(config.targets_file);
+  } else if (!config.listen_socket) {
+    auto target = Resolve(config.hostname);
+    if (!target) return 1;
+    targets.push_back(std::move(*target));
+  }
+
+  // Names are looked up here, so that a daemon never waits for them.
+  if (config.submit_socket)
+    return Submit(config.submit_socket, targets) ? 0 : 1;
 
-    // Destination reached
-    if (!is_exceed) break;
+  Deduplicate(targets);
+  if (config.jobs > 1) {
+    TraceRouteSharded(config, targets);
+  } else {
+    TraceRoute(config, targets);
   }
 }
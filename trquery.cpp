@@ -0,0 +1,416 @@
+// Queries over the trace stores that `traceroute -o` appends to (see
+// store.h). Files are mapped rather than read, and only the blocks and the
+// columns a query needs are decoded, one block at a time, so a store much
+// larger than memory costs no more than its largest block. Blocks whose
+// dictionaries lack the address a query looks for are skipped undecoded.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "store.h"
+
+namespace {
+
+namespace store = traceroute::store;
+
+// What to print: the size of every file and column, every row, the traces
+// through an interface, or the distribution of RTTs at every hop.
+enum Query { SUMMARY, DUMP, THROUGH, RTTS };
+
+struct Config {
+  Query query = SUMMARY;
+  // Only the rows of this destination, if given.
+  std::optional<in_addr_t> target;
+  in_addr_t interface = 0;
+  std::vector<std::string> files;
+};
+
+[[noreturn]] void PrintUsage() {
+  std::cerr << "Usage:\n";
+  std::cerr << "  trquery [ -d | -r | -x interface ] [ -t target ] "
+               "store_file ...\n";
+  exit(1);
+}
+
+[[noreturn]] void PrintError(const char *s = nullptr) {
+  perror(s);
+  exit(1);
+}
+
+std::optional<in_addr_t> ParseAddress(const char *text) {
+  struct in_addr addr {};
+  if (inet_pton(AF_INET, text, &addr) != 1) return std::nullopt;
+  return addr.s_addr;
+}
+
+Config ParseArg(int argc, char *argv[]) {
+  Config config{};
+  int queries = 0;
+  for (int opt = getopt(argc, argv, "drx:t:"); opt != -1;
+       opt = getopt(argc, argv, "drx:t:")) {
+    if (opt == 'd') config.query = DUMP;
+    if (opt == 'r') config.query = RTTS;
+    if (opt == 'x') {
+      auto interface = ParseAddress(optarg);
+      if (!interface) PrintUsage();
+      config.query = THROUGH;
+      config.interface = *interface;
+    }
+    if (opt == 'd' || opt == 'r' || opt == 'x') queries++;
+    if (opt == 't') {
+      config.target = ParseAddress(optarg);
+      if (!config.target) PrintUsage();
+    }
+    if (opt == '?') PrintUsage();
+  }
+  for (int i = optind; i < argc; ++i) config.files.emplace_back(argv[i]);
+  if (queries > 1 || config.files.empty()) PrintUsage();
+  return config;
+}
+
+/// A file mapped read-only for as long as this lives.
+class MappedFile {
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+
+ public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) PrintError(path.c_str());
+    struct stat status {};
+    if (fstat(fd, &status) < 0) PrintError("fstat");
+    size_ = static_cast<size_t>(status.st_size);
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) PrintError("mmap");
+      // Blocks are visited in order, and each of them once.
+      madvise(data, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const uint8_t *>(data);
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile &other) = delete;
+  MappedFile(MappedFile &&other) = delete;
+  MappedFile &operator=(const MappedFile &other) = delete;
+  MappedFile &operator=(MappedFile &&other) = delete;
+
+  ~MappedFile() {
+    if (data_) munmap(const_cast<uint8_t *>(data_), size_);
+  }
+
+  [[nodiscard]] const uint8_t *Data() const { return data_; }
+  [[nodiscard]] size_t Size() const { return size_; }
+};
+
+/// Pass every whole block of the store at `path` to `fn`, and return the
+/// number of bytes they take, header included.
+template <typename Fn>
+size_t ForEachBlock(const std::string &path, Fn &&fn) {
+  MappedFile file(path);
+  size_t offset = store::kFileMagic.size();
+  if (file.Size() < offset ||
+      !std::equal(store::kFileMagic.begin(), store::kFileMagic.end(),
+                  file.Data())) {
+    std::cerr << "trquery: " << path << " is not a trace store\n";
+    exit(1);
+  }
+  while (offset < file.Size()) {
+    auto block =
+        store::BlockView::Parse(file.Data() + offset, file.Size() - offset);
+    if (!block) {
+      std::cerr << "trquery: Warning: ignoring the last "
+                << file.Size() - offset << " bytes of " << path
+                << ", which are not a whole block\n";
+      break;
+    }
+    fn(*block);
+    offset += block->Size();
+  }
+  return offset;
+}
+
+using Columns = std::array<std::vector<uint64_t>, store::kColumns>;
+
+/// The values of `columns` of `block`, whose indexes are within its
+/// dictionaries, or nothing if any of them is corrupt, which is reported.
+std::optional<Columns> Decode(const store::BlockView &block,
+                              std::initializer_list<store::Column> columns) {
+  Columns values;
+  for (auto column : columns) {
+    auto decoded = block.Decode(column);
+    if (!decoded) {
+      std::cerr << "trquery: Warning: skipping a block with a corrupt "
+                << store::kColumnNames[column] << " column\n";
+      return std::nullopt;
+    }
+    values[column] = std::move(*decoded);
+  }
+  return values;
+}
+
+/// The index of `address` in the dictionary of `block`, if it is there.
+std::optional<uint64_t> IndexOf(const store::BlockView &block,
+                                in_addr_t address) {
+  const auto &addresses = block.Addresses();
+  auto iter = std::find(addresses.begin(), addresses.end(), address);
+  if (iter == addresses.end()) return std::nullopt;
+  return static_cast<uint64_t>(iter - addresses.begin());
+}
+
+std::string FormatAddress(in_addr_t address) {
+  std::array<char, INET_ADDRSTRLEN> text{};
+  inet_ntop(AF_INET, &address, text.data(), text.size());
+  return text.data();
+}
+
+/// A time since the epoch in nanoseconds, in UTC, to the millisecond.
+std::string FormatTime(uint64_t ns) {
+  auto seconds = static_cast<time_t>(ns / 1'000'000'000);
+  struct tm utc {};
+  gmtime_r(&seconds, &utc);
+  std::array<char, 32> text{};
+  strftime(text.data(), text.size(), "%Y-%m-%dT%H:%M:%S", &utc);
+  std::ostringstream out;
+  out << text.data() << "." << std::setw(3) << std::setfill('0')
+      << ns / 1'000'000 % 1'000 << "Z";
+  return out.str();
+}
+
+/// The name at `index` + 1 in the dictionary of `block`, or "" for 0.
+std::string_view NameAt(const store::BlockView &block, uint64_t index) {
+  if (index == 0 || index > block.Names().size()) return "";
+  return block.Names()[index - 1];
+}
+
+void Summarize(const std::string &path) {
+  size_t blocks = 0, rows = 0, traces = 0;
+  std::array<size_t, store::kColumns> column_sizes{};
+  size_t size = ForEachBlock(path, [&](const store::BlockView &block) {
+    blocks++;
+    for (size_t column = 0; column < store::kColumns; ++column)
+      column_sizes[column] += block.EncodedSize(store::Column(column));
+    auto values = Decode(block, {store::TARGET, store::START});
+    if (!values) return;
+    // The row count of a corrupt block is not to be trusted.
+    rows += block.Rows();
+    const auto &columns = *values;
+    for (size_t row = 0; row < block.Rows(); ++row) {
+      if (row == 0 ||
+          columns[store::TARGET][row] != columns[store::TARGET][row - 1] ||
+          columns[store::START][row] != columns[store::START][row - 1])
+        traces++;
+    }
+  });
+  std::cout << path << ": " << traces << " traces, " << rows << " probes, "
+            << blocks << " blocks, " << size << " bytes";
+  if (rows > 0) {
+    std::cout << std::fixed << std::setprecision(1) << " ("
+              << static_cast<double>(size) / static_cast<double>(rows)
+              << " per probe)";
+  }
+  std::cout << "\n";
+  for (size_t column = 0; column < store::kColumns; ++column) {
+    std::cout << "  " << std::left << std::setw(16)
+              << store::kColumnNames[column] << std::right << std::setw(12)
+              << column_sizes[column] << " bytes\n";
+  }
+}
+
+void Dump(const Config &config, const std::string &path) {
+  ForEachBlock(path, [&](const store::BlockView &block) {
+    std::optional<uint64_t> target;
+    if (config.target) {
+      target = IndexOf(block, *config.target);
+      if (!target) return;
+    }
+    auto values = Decode(
+        block, {store::TARGET, store::TARGET_NAME, store::START, store::TTL,
+                store::RESPONDER, store::RESPONDER_NAME, store::STATUS,
+                store::SENT, store::RTT});
+    if (!values) return;
+    const auto &columns = *values;
+    const auto &addresses = block.Addresses();
+    for (size_t row = 0; row < block.Rows(); ++row) {
+      if (target && columns[store::TARGET][row] != *target) continue;
+      uint64_t responder = columns[store::RESPONDER][row];
+      uint64_t status = columns[store::STATUS][row];
+      std::cout << FormatTime(columns[store::START][row]) << "\t"
+                << NameAt(block, columns[store::TARGET_NAME][row] + 1) << "\t"
+                << FormatAddress(addresses.at(columns[store::TARGET][row]))
+                << "\t" << columns[store::TTL][row] << "\t"
+                << (responder == 0 ? "*"
+                                   : FormatAddress(addresses.at(responder - 1)))
+                << "\t" << NameAt(block, columns[store::RESPONDER_NAME][row])
+                << "\t"
+                << (status < store::kStatusNames.size()
+                        ? store::kStatusNames[status]
+                        : "?")
+                << "\t" << FormatTime(columns[store::SENT][row]) << "\t"
+                << std::fixed << std::setprecision(3)
+                << static_cast<double>(columns[store::RTT][row]) / 1e6
+                << "\n";
+    }
+  });
+}
+
+/// Print every trace that crossed `config.interface`, with the hop it was
+/// seen at.
+void Through(const Config &config, const std::string &path) {
+  ForEachBlock(path, [&](const store::BlockView &block) {
+    auto interface = IndexOf(block, config.interface);
+    if (!interface) return;
+    std::optional<uint64_t> target;
+    if (config.target) {
+      target = IndexOf(block, *config.target);
+      if (!target) return;
+    }
+    auto values =
+        Decode(block, {store::TARGET, store::TARGET_NAME, store::START,
+                       store::TTL, store::RESPONDER});
+    if (!values) return;
+    const auto &columns = *values;
+    for (size_t row = 0; row < block.Rows(); ++row) {
+      // The first row of a trace that reports the interface, if any.
+      if (columns[store::RESPONDER][row] != *interface + 1 ||
+          (target && columns[store::TARGET][row] != *target))
+        continue;
+      std::cout << FormatTime(columns[store::START][row]) << " "
+                << NameAt(block, columns[store::TARGET_NAME][row] + 1) << " ("
+                << FormatAddress(
+                       block.Addresses().at(columns[store::TARGET][row]))
+                << ") hop " << columns[store::TTL][row] << "\n";
+      while (row + 1 < block.Rows() &&
+             columns[store::TARGET][row + 1] == columns[store::TARGET][row] &&
+             columns[store::START][row + 1] == columns[store::START][row])
+        row++;
+    }
+  });
+}
+
+/// The RTTs of a hop, in logarithmic buckets, so that every quantile is
+/// within `kAccuracy` of the true one in bounded memory.
+class Distribution {
+  static constexpr double kAccuracy = 0.01;
+  static constexpr double kGamma = (1 + kAccuracy) / (1 - kAccuracy);
+  // Bucket 0 holds everything up to a microsecond.
+  static constexpr double kMinNs = 1e3;
+
+  std::vector<uint64_t> buckets_;
+  uint64_t probes_ = 0, replies_ = 0;
+  uint64_t min_ = UINT64_MAX, max_ = 0;
+
+ public:
+  void AddTimeout() { probes_++; }
+
+  void Add(uint64_t rtt_ns) {
+    probes_++;
+    replies_++;
+    min_ = std::min(min_, rtt_ns);
+    max_ = std::max(max_, rtt_ns);
+    double ratio = static_cast<double>(rtt_ns) / kMinNs;
+    auto bucket = static_cast<size_t>(
+        ratio <= 1 ? 0 : std::ceil(std::log(ratio) / std::log(kGamma)));
+    if (bucket >= buckets_.size()) buckets_.resize(bucket + 1);
+    buckets_[bucket]++;
+  }
+
+  [[nodiscard]] uint64_t Probes() const { return probes_; }
+  [[nodiscard]] uint64_t Replies() const { return replies_; }
+  [[nodiscard]] double MinMs() const { return static_cast<double>(min_) / 1e6; }
+  [[nodiscard]] double MaxMs() const { return static_cast<double>(max_) / 1e6; }
+
+  /// The `q` quantile of the RTTs, in milliseconds; there must be some.
+  [[nodiscard]] double QuantileMs(double q) const {
+    auto rank = static_cast<uint64_t>(q * static_cast<double>(replies_ - 1));
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    for (; bucket + 1 < buckets_.size(); ++bucket) {
+      seen += buckets_[bucket];
+      if (seen > rank) break;
+    }
+    // The middle of the bucket, in relative terms.
+    double value = kMinNs * std::pow(kGamma, bucket) * 2 / (1 + kGamma);
+    return std::clamp(value / 1e6, MinMs(), MaxMs());
+  }
+};
+
+void PrintRtts(const Config &config) {
+  std::vector<Distribution> hops;
+  for (const auto &path : config.files) {
+    ForEachBlock(path, [&](const store::BlockView &block) {
+      std::optional<uint64_t> target;
+      if (config.target) {
+        target = IndexOf(block, *config.target);
+        if (!target) return;
+      }
+      auto values = Decode(block, {store::TARGET, store::TTL,
+                                   store::RESPONDER, store::RTT});
+      if (!values) return;
+      const auto &columns = *values;
+      for (size_t row = 0; row < block.Rows(); ++row) {
+        if (target && columns[store::TARGET][row] != *target) continue;
+        auto ttl = static_cast<size_t>(columns[store::TTL][row]);
+        if (ttl >= hops.size()) hops.resize(ttl + 1);
+        if (columns[store::RESPONDER][row] == 0) {
+          hops[ttl].AddTimeout();
+        } else {
+          hops[ttl].Add(columns[store::RTT][row]);
+        }
+      }
+    });
+  }
+  std::cout << std::right << std::setw(3) << "hop" << std::setw(10)
+            << "probes" << std::setw(8) << "loss%" << std::setw(10) << "min"
+            << std::setw(10) << "p50" << std::setw(10) << "p90"
+            << std::setw(10) << "p99" << std::setw(10) << "max" << "\n";
+  for (size_t ttl = 0; ttl < hops.size(); ++ttl) {
+    const auto &hop = hops[ttl];
+    if (hop.Probes() == 0) continue;
+    std::cout << std::setw(3) << ttl << std::setw(10) << hop.Probes()
+              << std::fixed << std::setprecision(1) << std::setw(8)
+              << 100.0 * static_cast<double>(hop.Probes() - hop.Replies()) /
+                     static_cast<double>(hop.Probes())
+              << std::setprecision(3);
+    if (hop.Replies() == 0) {
+      std::cout << "\n";
+      continue;
+    }
+    std::cout << std::setw(10) << hop.MinMs() << std::setw(10)
+              << hop.QuantileMs(0.5) << std::setw(10) << hop.QuantileMs(0.9)
+              << std::setw(10) << hop.QuantileMs(0.99) << std::setw(10)
+              << hop.MaxMs() << "\n";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  auto config = ParseArg(argc, argv);
+  if (config.query == RTTS) {
+    PrintRtts(config);
+    return 0;
+  }
+  for (const auto &path : config.files) {
+    if (config.query == SUMMARY) Summarize(path);
+    if (config.query == DUMP) Dump(config, path);
+    if (config.query == THROUGH) Through(config, path);
+  }
+}